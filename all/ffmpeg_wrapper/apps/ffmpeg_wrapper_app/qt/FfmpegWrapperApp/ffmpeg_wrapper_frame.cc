@@ -14,6 +14,7 @@
 #include <QMessageBox>
 #include <QStandardPaths>
 #include <QUrl>
+#include <cstring>
 
 #include "ffmpeg_wrapper/ffmpeg_wrapper.h"
 #include "ffmpeg_wrapper/video_converter.h"
@@ -25,14 +26,10 @@ namespace {
 QImage ConvertCvImageToQImage(const VideoInfoCapture::Image& cvimage) {
   int cvwidth = cvimage.GetWidth();
   int cvheight = cvimage.GetHeight();
-  QImage dest(cvwidth, cvheight, QImage::Format_ARGB32);
+  // Image 按 r、g、b、a 的字节顺序存放，与 Format_RGBA8888 相同，整行拷贝
+  QImage dest(cvwidth, cvheight, QImage::Format_RGBA8888);
   for (int y = 0; y < cvheight; ++y) {
-    for (int x = 0; x < cvwidth; ++x) {
-      unsigned char r, g, b, a;
-      cvimage.GetColor(x, y, &r, &g, &b, &a);
-      QColor qcolor(r, g, b, a);
-      dest.setPixelColor(x, y, qcolor);
-    }
+    memcpy(dest.scanLine(y), cvimage.Row(y), cvwidth * 4);
   }
   return dest;
 }
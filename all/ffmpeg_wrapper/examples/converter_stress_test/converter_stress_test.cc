@@ -0,0 +1,168 @@
+// Copyright (c) 2022 The FfmpegWrapper Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// 并发压力测试：一个进程中同时运行 16 个转码任务（VideoConverterQueue，
+// max_workers=16），检查每个任务都成功结束、进度没有倒退、
+// 输出文件可以打开并且有视频流
+//
+// 用法：converter_stress_test <输入文件> <输出目录> [任务数]
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "ffmpeg_wrapper/video_converter.h"
+#include "ffmpeg_wrapper/video_converter_queue.h"
+#include "ffmpeg_wrapper/video_info_capture.h"
+
+namespace {
+
+constexpr int kDefaultJobs = 16;
+// 单位毫秒，每个任务只转码开头一段，压力来自并发而不是时长
+constexpr uint32_t kRecordTime = 10000;
+
+// 所有任务共享，统计同时运行的任务数和未结束的任务数
+struct Progress {
+  std::mutex mutex;
+  std::condition_variable cv;
+  int remaining{0};
+  int running{0};
+  int max_running{0};
+};
+
+// 记录一个任务的回调，回调在队列的工作线程上执行
+class JobWatcher : public VideoConverter::Delegate {
+ public:
+  explicit JobWatcher(Progress *progress) : progress_(progress) {}
+
+  void OnConvertProgress(VideoConverter::Response r) override {
+    std::lock_guard<std::mutex> lock(progress_->mutex);
+    if (progress_count_++ == 0) {
+      progress_->running++;
+      progress_->max_running =
+          std::max(progress_->max_running, progress_->running);
+    }
+    if (r.percent >= 0) {
+      if (r.percent + 1e-6 < last_percent_) {
+        percent_regressed_ = true;
+      }
+      last_percent_ = r.percent;
+    }
+    if (r.frames < frames_) {
+      frames_regressed_ = true;
+    }
+    frames_ = r.frames;
+  }
+  void OnConvertEnd(VideoConverter::Response r) override {
+    std::lock_guard<std::mutex> lock(progress_->mutex);
+    if (progress_count_ > 0) {
+      progress_->running--;
+    }
+    ended_ = true;
+    succeeded_ = r.succeeded;
+    progress_->remaining--;
+    progress_->cv.notify_all();
+  }
+
+  // 所有任务结束后调用，不通过时返回原因
+  std::string Check(const std::string &output_file) const {
+    if (!ended_) {
+      return "not ended";
+    }
+    if (!succeeded_) {
+      return "conversion failed";
+    }
+    if (progress_count_ == 0) {
+      return "no progress reported";
+    }
+    if (percent_regressed_ || frames_regressed_) {
+      return "progress went backwards";
+    }
+    if (frames_ <= 0) {
+      return "no frames encoded";
+    }
+    auto info = VideoInfoCapture::ExtractFileInfo(output_file.c_str());
+    if (info.video_stream_bitrates.empty()) {
+      return "output has no video stream";
+    }
+    return std::string();
+  }
+  int64_t frames() const { return frames_; }
+
+ private:
+  Progress *progress_{nullptr};
+  int progress_count_{0};
+  double last_percent_{0};
+  bool percent_regressed_{false};
+  int64_t frames_{0};
+  bool frames_regressed_{false};
+  bool ended_{false};
+  bool succeeded_{false};
+};
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  if (argc < 3) {
+    fprintf(stderr, "usage: %s <input> <output_dir> [jobs]\n", argv[0]);
+    return 2;
+  }
+  std::string input = argv[1];
+  std::string output_dir = argv[2];
+  int jobs = argc > 3 ? std::max(1, atoi(argv[3])) : kDefaultJobs;
+
+  // 每个任务一个线程，所有任务同时运行
+  VideoConverterQueue::Options options;
+  options.max_workers = jobs;
+  options.max_threads = jobs;
+  VideoConverterQueue queue(options);
+
+  Progress progress;
+  progress.remaining = jobs;
+  std::vector<std::unique_ptr<JobWatcher>> watchers;
+  std::vector<std::string> outputs;
+  for (int i = 0; i < jobs; i++) {
+    VideoConverter::Request request;
+    request.input_file = input;
+    request.output_file =
+        output_dir + "/stress_" + std::to_string(i) + ".mp4";
+    request.output_file_format = "mp4";
+    request.video_encoder = "libx264";
+    request.audio_encoder = "aac";
+    request.output_video_record_time = kRecordTime;
+    request.threads = 1;
+    // 一半任务走流水线模式，两种模式同时受压
+    request.pipelined = i % 2 == 1;
+    watchers.push_back(std::make_unique<JobWatcher>(&progress));
+    outputs.push_back(request.output_file);
+    queue.Submit(request, 0, watchers.back().get());
+  }
+
+  {
+    std::unique_lock<std::mutex> lock(progress.mutex);
+    progress.cv.wait(lock, [&progress] { return progress.remaining == 0; });
+  }
+  queue.Shutdown();
+
+  int failures = 0;
+  for (int i = 0; i < jobs; i++) {
+    std::string error = watchers[i]->Check(outputs[i]);
+    if (!error.empty()) {
+      failures++;
+      fprintf(stderr, "job %d (%s): %s\n", i, outputs[i].c_str(),
+              error.c_str());
+    } else {
+      printf("job %d: %lld frames\n", i,
+             static_cast<long long>(watchers[i]->frames()));
+    }
+  }
+  printf("%d/%d jobs passed, at most %d running at the same time\n",
+         jobs - failures, jobs, progress.max_running);
+  return failures == 0 ? 0 : 1;
+}
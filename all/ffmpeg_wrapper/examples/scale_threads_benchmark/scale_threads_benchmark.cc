@@ -0,0 +1,104 @@
+// Copyright (c) 2022 The FfmpegWrapper Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// 缩放线程数基准：把同一段输入（如 8K）缩小到 1080p，filter_threads 分别为
+// 1、2、4、8，按 GetProfile() 中视频流滤镜阶段的耗时计算缩放吞吐量
+// 输入流的 filter 阶段是送入滤镜（缩放在这里执行），输出流的是取出结果，
+// 两者相加
+//
+// 用法：scale_threads_benchmark <输入文件> <输出文件> [宽 高 [时长（秒）]]
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#include "ffmpeg_wrapper/video_converter.h"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+constexpr int kThreads[] = {1, 2, 4, 8};
+constexpr int kDefaultWidth = 1920;
+constexpr int kDefaultHeight = 1080;
+constexpr int kDefaultDuration = 10;
+
+class EndWatcher : public VideoConverter::Delegate {
+ public:
+  void OnConvertEnd(VideoConverter::Response r) override {
+    succeeded_ = r.succeeded;
+  }
+  bool succeeded() const { return succeeded_; }
+
+ private:
+  bool succeeded_{false};
+};
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  if (argc < 3) {
+    fprintf(stderr, "usage: %s <input> <output> [width height [seconds]]\n",
+            argv[0]);
+    return 2;
+  }
+  int width = argc > 4 ? atoi(argv[3]) : kDefaultWidth;
+  int height = argc > 4 ? atoi(argv[4]) : kDefaultHeight;
+  int duration = argc > 5 ? atoi(argv[5]) : kDefaultDuration;
+
+  printf("%8s %10s %14s %12s %12s\n", "threads", "frames", "filter (ms)",
+         "filter fps", "total (ms)");
+  for (int threads : kThreads) {
+    VideoConverter::Request request;
+    request.input_file = argv[1];
+    request.output_file = argv[2];
+    // 编码用最快的参数，尽量不让编码拖慢滤镜
+    request.video_encoder = "libx264";
+    request.video_preset = "ultrafast";
+    request.audio_encoder = "aac";
+    request.output_video_width = width;
+    request.output_video_height = height;
+    request.output_video_record_time = duration * 1000;
+    request.filter_threads = threads;
+    request.progress_rate = 0;
+    request.profile = true;
+    request.auto_stream_copy = false;
+
+    EndWatcher watcher;
+    Clock::time_point start = Clock::now();
+    // 没有 async_call_fun 时 Start() 同步执行
+    auto converter =
+        VideoConverter::MakeVideoConverter(request, &watcher, nullptr);
+    if (!converter) {
+      fprintf(stderr, "cannot create converter\n");
+      return 1;
+    }
+    converter->Start();
+    double total_ms =
+        std::chrono::duration<double, std::milli>(Clock::now() - start)
+            .count();
+    if (!watcher.succeeded()) {
+      printf("%8d %10s\n", threads, "failed");
+      continue;
+    }
+
+    int64_t frames = 0;
+    int64_t filter_time = 0;
+    for (const auto &stream : converter->GetProfile().streams) {
+      if (stream.media_type != "video") {
+        continue;
+      }
+      filter_time += stream.filter.total_time;
+      if (stream.output) {
+        frames += stream.filter.frames;
+      }
+    }
+    double fps = filter_time > 0 ? frames * 1000000.0 / filter_time : 0;
+    printf("%8d %10lld %14.1f %12.1f %12.1f\n", threads,
+           static_cast<long long>(frames), filter_time / 1000.0, fps,
+           total_ms);
+  }
+  return 0;
+}
@@ -0,0 +1,100 @@
+// Copyright (c) 2022 The FfmpegWrapper Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// 开始时间的 seek 基准：按不同的 output_video_start_time 转码同一个文件，
+// 测从 Start() 到编码出第一帧（第一次 frames > 0 的进度回调）的时间；
+// 输入 seek 生效时这个时间与开始时间基本无关，只多解码不到一个 GOP
+//
+// 用法：seek_start_benchmark <输入文件> <输出文件> [开始时间（秒）...]
+// 默认开始时间为 0 60 600 3600
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "ffmpeg_wrapper/video_converter.h"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+// 单位毫秒，每次只转码开始时间之后的一小段
+constexpr uint32_t kRecordTime = 2000;
+// 进度回调的频率，决定首帧时间的测量精度
+constexpr int kProgressRate = 1000;
+
+class FirstFrameTimer : public VideoConverter::Delegate {
+ public:
+  explicit FirstFrameTimer(Clock::time_point start) : start_(start) {}
+
+  void OnConvertProgress(VideoConverter::Response r) override {
+    if (first_frame_ms_ < 0 && r.frames > 0) {
+      first_frame_ms_ = std::chrono::duration<double, std::milli>(
+                            Clock::now() - start_)
+                            .count();
+    }
+  }
+  void OnConvertEnd(VideoConverter::Response r) override {
+    succeeded_ = r.succeeded;
+  }
+
+  double first_frame_ms() const { return first_frame_ms_; }
+  bool succeeded() const { return succeeded_; }
+
+ private:
+  Clock::time_point start_;
+  double first_frame_ms_{-1};
+  bool succeeded_{false};
+};
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  if (argc < 3) {
+    fprintf(stderr, "usage: %s <input> <output> [start_seconds...]\n",
+            argv[0]);
+    return 2;
+  }
+  std::vector<uint32_t> offsets;
+  for (int i = 3; i < argc; i++) {
+    offsets.push_back(static_cast<uint32_t>(atoi(argv[i])));
+  }
+  if (offsets.empty()) {
+    offsets = {0, 60, 600, 3600};
+  }
+
+  printf("%12s %16s %12s\n", "start (s)", "first frame (ms)", "total (ms)");
+  for (uint32_t offset : offsets) {
+    VideoConverter::Request request;
+    request.input_file = argv[1];
+    request.output_file = argv[2];
+    request.video_encoder = "libx264";
+    request.audio_encoder = "aac";
+    request.output_video_start_time = offset * 1000;
+    request.output_video_record_time = kRecordTime;
+    request.progress_rate = kProgressRate;
+
+    Clock::time_point start = Clock::now();
+    FirstFrameTimer timer(start);
+    // 没有 async_call_fun 时 Start() 同步执行
+    auto converter =
+        VideoConverter::MakeVideoConverter(request, &timer, nullptr);
+    if (!converter) {
+      fprintf(stderr, "cannot create converter\n");
+      return 1;
+    }
+    converter->Start();
+    double total_ms =
+        std::chrono::duration<double, std::milli>(Clock::now() - start)
+            .count();
+    if (!timer.succeeded() || timer.first_frame_ms() < 0) {
+      printf("%12u %16s %12.1f\n", offset, "failed", total_ms);
+      continue;
+    }
+    printf("%12u %16.1f %12.1f\n", offset, timer.first_frame_ms(), total_ms);
+  }
+  return 0;
+}
@@ -0,0 +1,117 @@
+// Copyright (c) 2022 The FfmpegWrapper Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// 缩略图基准：对每个输入文件（如 1080p、4K、8K 的 H.264 和 HEVC）分别用
+// 默认模式和预览模式调用 ExtractVideoFirstValidFrameToImageBuffer，
+// 预热一次后取多次的平均值，输出每张缩略图的耗时和缩略图尺寸
+//
+// 用法：thumbnail_benchmark [-n 次数] <输入文件>...
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "ffmpeg_wrapper/video_info_capture.h"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+constexpr int kDefaultIterations = 10;
+// 预览模式的缩略图尺寸
+constexpr int kPreviewWidth = 320;
+constexpr int kPreviewHeight = 180;
+
+struct Result {
+  bool ok{false};
+  double ms{0};
+  int width{0};
+  int height{0};
+};
+
+// 返回每张缩略图的平均耗时，任何一次没有截到图都算失败
+Result Measure(const char *path,
+               const VideoInfoCapture::CaptureOptions &options,
+               int iterations) {
+  Result result;
+  unsigned int duration = 0;
+  // 预热：文件缓存、解码器和缩放上下文缓存
+  auto image = VideoInfoCapture::ExtractVideoFirstValidFrameToImageBuffer(
+      path, &duration, options);
+  if (!image) {
+    return result;
+  }
+  result.width = image->GetWidth();
+  result.height = image->GetHeight();
+  image.reset();
+
+  Clock::time_point start = Clock::now();
+  for (int i = 0; i < iterations; i++) {
+    image = VideoInfoCapture::ExtractVideoFirstValidFrameToImageBuffer(
+        path, &duration, options);
+    if (!image) {
+      return result;
+    }
+    image.reset();
+  }
+  result.ms =
+      std::chrono::duration<double, std::milli>(Clock::now() - start).count() /
+      iterations;
+  result.ok = true;
+  return result;
+}
+
+void PrintResult(const char *path, const char *mode, const Result &result) {
+  if (!result.ok) {
+    printf("%-40s %-8s %12s\n", path, mode, "failed");
+    return;
+  }
+  printf("%-40s %-8s %12.1f %6dx%d\n", path, mode, result.ms, result.width,
+         result.height);
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  int iterations = kDefaultIterations;
+  std::vector<const char *> inputs;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+      iterations = atoi(argv[++i]);
+    } else {
+      inputs.push_back(argv[i]);
+    }
+  }
+  if (inputs.empty() || iterations <= 0) {
+    fprintf(stderr, "usage: %s [-n iterations] <input>...\n", argv[0]);
+    return 2;
+  }
+
+  VideoInfoCapture::CaptureOptions default_options;
+  VideoInfoCapture::CaptureOptions preview_options;
+  preview_options.preview = true;
+  preview_options.max_width = kPreviewWidth;
+  preview_options.max_height = kPreviewHeight;
+
+  printf("%-40s %-8s %12s %s\n", "input", "mode", "ms/thumb", "size");
+  int failures = 0;
+  for (const char *input : inputs) {
+    Result full = Measure(input, default_options, iterations);
+    Result preview = Measure(input, preview_options, iterations);
+    PrintResult(input, "default", full);
+    PrintResult(input, "preview", preview);
+    if (full.ok && preview.ok && preview.ms > 0) {
+      printf("%-40s %-8s %11.1fx\n", input, "speedup", full.ms / preview.ms);
+    }
+    failures += !full.ok + !preview.ok;
+  }
+  auto stats = VideoInfoCapture::GetScalerCacheStats();
+  printf("scaler cache: %lld hits, %lld misses\n",
+         static_cast<long long>(stats.hits),
+         static_cast<long long>(stats.misses));
+  return failures == 0 ? 0 : 1;
+}
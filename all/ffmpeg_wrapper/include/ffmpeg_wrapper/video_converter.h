@@ -1,8 +1,10 @@
 #pragma once
 
+#include <cstdint>
 #include <functional>
 #include <memory>
 #include <string>
+#include <vector>
 
 #include "ffmpeg_wrapper/ffmpeg_wrapper_export.h"
 
@@ -17,6 +19,49 @@ class FFMPEG_WRAPPER_API VideoConverter {
       const std::string& converter_name = "ffmpeg");
 
  public:
+  // 自定义输入输出的 seek 回调，whence 为 SEEK_SET/SEEK_CUR/SEEK_END，
+  // 返回新的位置；whence 为 kSeekSize 时返回总大小，未知时返回 <0
+  static constexpr int kSeekSize = 0x10000;
+  using SeekFuncType = std::function<int64_t(int64_t offset, int whence)>;
+  // 流式输入的读取回调暂时没有数据时返回这个值，稍后会再读；
+  // 一直阻塞等数据的回调在停止转码时也要等它返回
+  static constexpr int kReadAgain = -0x10000;
+  // 从内存或者回调读取输入，设置后 input_file 只用来推测封装格式
+  struct IoSource {
+    // 内存中的输入数据，转码结束之前需要保持有效，不会拷贝
+    const uint8_t* data{nullptr};
+    size_t size{0};
+    // 或者读取回调，返回读取的字节数，结束时返回 0，出错返回 <0
+    std::function<int(uint8_t* buf, int size)> read;
+    SeekFuncType seek;  // 可选，没有时输入不能 seek
+  };
+  // 输出到回调或者内存，设置后 output_file 只用来推测封装格式
+  // 不 seek 时 mp4 等封装需要写成分片格式（streaming_format 为 "fmp4"）
+  struct IoSink {
+    // 写入回调，返回 <0 表示出错
+    std::function<int(const uint8_t* buf, int size)> write;
+    SeekFuncType seek;  // 可选
+    // 或者写入这个缓冲区，自动增长，可以 seek，转码结束之前需要保持有效
+    std::vector<uint8_t>* buffer{nullptr};
+  };
+
+ public:
+  // 一路输出的参数
+  struct OutputSpec {
+    std::string output_file;
+    std::string output_file_format;
+    std::string video_encoder;
+    std::string audio_encoder;
+    int output_video_width{-1};
+    int output_video_height{-1};
+    std::string output_video_bitrate{};
+    std::string output_audio_bitrate{};
+  };
+  // 一组编码参数，preset 为空、crf < 0 时不设置
+  struct EncoderTuning {
+    std::string preset;
+    int crf{-1};
+  };
   struct Request {
     std::string input_file;
     std::string output_file;
@@ -29,18 +74,157 @@ class FFMPEG_WRAPPER_API VideoConverter {
     uint32_t output_video_record_time{0};  // 单位毫秒，转码多长时间
     std::string output_video_bitrate{};
     std::string output_audio_bitrate{};
+    // 编码器的 preset 和 CRF，libx264/libx265 等支持时生效，
+    // 设置 CRF 时按固定质量编码，忽略 output_video_bitrate
+    std::string video_preset;
+    int video_crf{-1};
+    // 按内容复杂度选码率（per-title）：转码前在几个采样窗口上并行地快速解码
+    // 缩小的画面，估计空间和时间复杂度，按输出的分辨率和帧率推算码率；
+    // output_video_bitrate 作为上限，设置 video_crf 时推算的码率作为 maxrate
+    // 0 不开启，1 整个文件一个码率，2 分段转码、断点续转时每段各自推算
+    int content_adaptive{0};
+    // 自动调优编码参数：在输入的几个采样窗口上用不同的 preset/CRF 试编码，
+    // 测编码速度和 PSNR；tune_target_psnr > 0 时选 PSNR 达标的最快参数，
+    // 否则选速度达到 tune_target_speed 倍实时的最高画质，再用它转码
+    // 选出的参数在 OnConvertEnd 的 Response::tuning 中返回，可以按内容类别缓存，
+    // 之后设置到 video_preset/video_crf 上直接用
+    bool auto_tune{false};
+    double tune_target_psnr{0};   // dB
+    double tune_target_speed{1};  // 相对实时播放的倍数
+    std::vector<EncoderTuning> tune_candidates;  // 为空时按编码器选默认组合
+    int tune_samples{3};             // 采样窗口数
+    int tune_sample_duration{2000};  // 单位毫秒，每个采样窗口的时长
     int threads{0};
+    // 滤镜图的线程数，缩放等滤镜按分片多线程处理
+    // 0 根据 threads（未设置时为 CPU 核数）按输出路数平分，>0 指定线程数
+    int filter_threads{0};
+    // 流水线模式，解封装、解码及滤镜、编码、封装分别在独立的线程上运行，
+    // 音视频编码可以并行
+    bool pipelined{false};
+    // 分段并行转码，按关键帧切分后多段同时转码再拼接，适合长视频
+    // 0 不分段，-1 根据 CPU 核数和时长自动选择段数，>0 指定段数
+    int parallel_segments{0};
+    // 精确裁剪，需要设置开始时间或时长：只重新编码开始时间到下一个关键帧、
+    // 最后一个关键帧到结束时间这两段，中间按关键帧直接复制，再拼接成一个文件
+    // 要求不缩放、视频编码与源相同，否则按普通方式转码
+    // 拼接的各段参数集不同，mp4/mov 输出写成 avc3/hev1（参数集在码流中），
+    // 其它把参数集放在文件头的封装（如 mkv、flv）也按普通方式转码
+    bool smart_cut{false};
+    // 两遍编码，需要设置 output_video_bitrate：第一遍只编码视频、不写文件，
+    // 统计数据保存在内存中，第二遍按统计数据分配码率
+    // 分段转码和精确裁剪时不生效
+    bool two_pass{false};
+    // 断点续转，单位秒，>0 时按这个间隔在关键帧处分段逐段转码，
+    // 每段是完整的文件，进度记在输出文件旁边的 .journal 中；
+    // 中断或崩溃后用相同的 Request 重新开始会跳过已完成的段，最后拼接成一个文件
+    int checkpoint_interval{0};
+    // 流式输出，转码过程中每完成一个分片回调 OnConvertSegment，
+    // 下游不用等转码结束就可以开始播放或上传
+    // "fmp4"：分片 MP4，output_file 为 .mp4 文件
+    // "hls"：HLS/CMAF 分片（fMP4）和播放列表，output_file 为 .m3u8 文件
+    // 设置后不使用分段转码、精确裁剪和断点续转
+    std::string streaming_format;
+    int fragment_duration{2000};  // 单位毫秒，分片时长，按这个间隔强制关键帧
+    // 自定义输入输出，只用于单路输出，设置后不使用分段转码、两遍编码等
+    // 需要多次打开输入的模式；HLS 输出的是多个文件，不支持 output
+    IoSource input;
+    IoSink output;
+    int io_buffer_size{0};  // AVIOContext 的缓冲区大小，0 表示 32KB
+    // 流式输入：input_file 是管道或 socket（如 "pipe:0"、"unix:/tmp/x.sock"），
+    // 或者 input 只有读取回调，数据还在陆续到达；限制探测的数据量，
+    // 由单独的线程预读，收到开头的数据就开始转码。输入不能 seek，
+    // 要选 mpegts、flv、mkv 这类不需要 seek 的封装，不使用分段转码、两遍编码
+    bool streaming_input{false};
+    // 预读和解封装队列最多缓存多少块/包，<=0 表示默认值 8
+    int thread_queue_size{0};
+    // 多路输出（如 1080p/720p/480p），共用一次解封装和解码
+    // 不为空时忽略上面单路输出的参数
+    std::vector<OutputSpec> outputs;
+    // 进度回调每秒最多几次，<=0 表示不回调进度
+    int progress_rate{10};
+    // 统计各阶段耗时，通过 GetProfile() 获取
+    bool profile{false};
+    // 源流已经是目标编码、不缩放不裁剪且码率不降低时直接复制，不重新编码
+    bool auto_stream_copy{true};
+    // 本地文件的探测结果缓存，见 VideoInfoCapture::SetProbeCacheOptions：
+    // 头部信息完整的文件（如 mp4）再次打开时不用 avformat_find_stream_info
+    // 解码探测，分段转码时复用关键帧位置
+    bool probe_cache{true};
   };
 
  public:
   struct Response {
     std::string output_file;
+    // OnConvertEnd 时有效，出错或者被 Stop() 中断时为 false
+    bool succeeded{false};
+    std::vector<std::string> output_files;  // 多路输出时的所有输出文件
+    // 直接复制未重新编码的输出流，"输出文件序号:流序号"
+    std::vector<std::string> copied_streams;
+    // 自动调优选出的编码参数，及其在采样窗口上的编码帧率、速度和 PSNR
+    EncoderTuning tuning;
+    double tuning_fps{-1};
+    double tuning_speed{-1};
+    double tuning_psnr{-1};
+    // 流式输出时刚完成的分片，分片 MP4 为输出文件中的一段字节，
+    // HLS 为一个分片文件，回调时播放列表已经更新
+    std::string segment_file;
+    int segment_index{-1};
+    int64_t segment_offset{0};
+    int64_t segment_size{0};
+    // 流水线模式下各阶段队列中等待处理的数量，用来定位瓶颈
+    int demux_queue_depth{0};   // 已解封装，等待解码的数据包
+    int encode_queue_depth{0};  // 已滤镜，等待编码的帧
+    int mux_queue_depth{0};     // 已编码，等待封装的数据包
+    // 单位微秒，因为输入数据未就绪而等待的累计时间
+    int64_t stall_time{0};
+    // 转码过程中新分配 AVPacket/AVFrame 等对象的次数，
+    // 稳定运行后不再增长说明帧和数据包都在复用
+    int64_t allocations{0};
+    // 转码进度，-1 表示未知
+    int64_t frames{0};         // 已编码的视频帧数
+    double fps{0};             // 编码帧率
+    double speed{-1};          // 相对实时播放的倍数
+    int64_t out_time{0};       // 单位微秒，已输出的时长
+    int64_t output_bytes{-1};  // 已输出的字节数
+    double bitrate{-1};        // 单位 kbit/s
+    double percent{-1};        // 0~100
+    int64_t eta{-1};           // 单位微秒，预计剩余时间
+  };
+  // 一个阶段的耗时统计，时间单位都是微秒
+  struct StageStats {
+    int64_t calls{0};
+    int64_t frames{0};  // 帧数或数据包数
+    int64_t bytes{0};
+    int64_t total_time{0};
+    // 单次调用耗时的分位数
+    int64_t p50{0};
+    int64_t p95{0};
+    int64_t p99{0};
+    // 流水线模式下阻塞在队列上的时间
+    int64_t blocked_time{0};
+  };
+  // 输入流统计 demux/decode/filter（送入滤镜），
+  // 输出流统计 filter（取出滤镜结果）/encode/mux
+  struct StreamProfile {
+    bool output{false};
+    int file_index{0};
+    int stream_index{0};
+    std::string media_type;
+    StageStats demux;
+    StageStats decode;
+    StageStats filter;
+    StageStats encode;
+    StageStats mux;
+  };
+  struct Profile {
+    std::vector<StreamProfile> streams;
   };
   class Delegate {
    public:
     virtual ~Delegate() = default;
     virtual void OnConvertBegin(Response r) {}
     virtual void OnConvertProgress(Response r) {}
+    virtual void OnConvertSegment(Response r) {}
     virtual void OnConvertEnd(Response r) {}
   };
   using AsyncCallFuncType = std::function<void(std::function<void()>)>;
@@ -49,6 +233,8 @@ class FFMPEG_WRAPPER_API VideoConverter {
   virtual ~VideoConverter() {}
   virtual void Start() = 0;
   virtual void Stop() = 0;
+  // 转码过程中和结束后都可以调用，Request::profile 为 false 时为空
+  virtual Profile GetProfile() const { return Profile(); }
 
  public:
   static std::unique_ptr<VideoConverter> MakeVideoConverter(
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+
+#include "ffmpeg_wrapper/ffmpeg_wrapper_export.h"
+#include "ffmpeg_wrapper/video_converter.h"
+
+// 批量转码队列：固定数量的工作线程按优先级执行转码任务，
+// 并按每个任务预计使用的线程数做准入控制，避免多个任务同时运行时
+// 线程数超过 CPU 核数
+class FFMPEG_WRAPPER_API VideoConverterQueue {
+ public:
+  using JobId = int64_t;
+
+  struct Options {
+    int max_workers{0};  // 同时运行的任务数，0 表示 CPU 核数的一半
+    int max_threads{0};  // 所有运行中任务的线程总数上限，0 表示 CPU 核数
+  };
+  struct Counts {
+    int queued{0};
+    int running{0};
+    int finished{0};
+    int cancelled{0};
+  };
+
+ public:
+  VideoConverterQueue();
+  explicit VideoConverterQueue(const Options& options);
+  ~VideoConverterQueue();
+
+  // priority 越大越先执行，相同优先级按提交顺序执行
+  // delegate 的回调在 async_call_fun 上执行，为空时在工作线程上执行，
+  // delegate 需要在任务结束（OnConvertEnd）之前保持有效
+  JobId Submit(const VideoConverter::Request& request, int priority = 0,
+               VideoConverter::Delegate* delegate = nullptr,
+               VideoConverter::AsyncCallFuncType async_call_fun = nullptr);
+  // 取消排队中或者正在运行的任务，任务不存在或已结束时返回 false
+  bool Cancel(JobId id);
+  // 取消所有任务，排队中的任务也会收到 OnConvertEnd，等待工作线程退出
+  void Shutdown();
+
+  Counts GetCounts() const;
+
+ private:
+  class Impl;
+  std::unique_ptr<Impl> impl_;
+
+ private:
+  VideoConverterQueue(const VideoConverterQueue&) = delete;
+  VideoConverterQueue& operator=(const VideoConverterQueue&) = delete;
+};
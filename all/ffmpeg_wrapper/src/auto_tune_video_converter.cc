@@ -0,0 +1,367 @@
+#include "auto_tune_video_converter.h"
+
+#include <cstring>
+#include <functional>
+
+#include "ffmpeg_probe_cache.h"
+#include "ffmpeg_util.h"
+#include "ffmpeg_video_converter.h"
+
+namespace {
+
+// 试编码占总进度的百分比
+constexpr int kTunePercent = 20;
+// 采样窗口最短 100 毫秒
+constexpr int64_t kMinSampleDuration = 100000;
+
+// 输出视频流编码阶段的累计耗时，单位微秒
+// 打开输入、seek 到窗口、解码和初始化编码器的开销与 preset 无关，
+// 窗口较短时会冲淡各组参数之间的速度差别，不计入
+int64_t VideoEncodeTime(const VideoConverter::Profile &profile) {
+  int64_t total = 0;
+  for (const auto &stream : profile.streams) {
+    if (stream.output && stream.media_type == "video") {
+      total += stream.encode.total_time;
+    }
+  }
+  return total;
+}
+
+// 最后转码的进度接在试编码之后，结束时的 Response 留给调用方补上调优结果
+class FinalDelegate : public VideoConverter::Delegate {
+ public:
+  FinalDelegate(std::function<void(VideoConverter::Response)> post_progress,
+                std::function<void(VideoConverter::Response)> post_segment,
+                VideoConverter::Response *end)
+      : post_progress_(post_progress), post_segment_(post_segment), end_(end) {}
+
+  void OnConvertProgress(VideoConverter::Response r) override {
+    if (r.percent >= 0) {
+      r.percent = kTunePercent + r.percent * (100 - kTunePercent) / 100;
+    }
+    post_progress_(r);
+  }
+  void OnConvertSegment(VideoConverter::Response r) override {
+    post_segment_(r);
+  }
+  void OnConvertEnd(VideoConverter::Response r) override { *end_ = r; }
+
+ private:
+  std::function<void(VideoConverter::Response)> post_progress_;
+  std::function<void(VideoConverter::Response)> post_segment_;
+  VideoConverter::Response *end_{nullptr};
+};
+
+}  // namespace
+
+AutoTuneVideoConverter::AutoTuneVideoConverter(
+    const VideoConverter::Request &request, VideoConverter::Delegate *delegate,
+    VideoConverter::AsyncCallFuncType call_fun)
+    : BaseVideoConverter(request, delegate, call_fun), request_(request) {}
+
+AutoTuneVideoConverter::~AutoTuneVideoConverter() {
+  if (worker_) {
+    worker_->join();
+  }
+}
+
+void AutoTuneVideoConverter::Start() {
+  if (async_call_fun_) {
+    worker_ = std::make_unique<std::thread>(AutoTuneVideoConverter::Run, this);
+  } else {
+    AutoTuneVideoConverter::Run(this);
+  }
+}
+void AutoTuneVideoConverter::Stop() {
+  stopped_ = true;
+  {
+    std::lock_guard<std::mutex> lock(converter_mutex_);
+    if (trial_converter_) {
+      trial_converter_->Stop();
+    }
+    if (final_converter_) {
+      final_converter_->Stop();
+    }
+  }
+  if (worker_) {
+    worker_->join();
+  }
+}
+
+VideoConverter::Profile AutoTuneVideoConverter::GetProfile() const {
+  std::lock_guard<std::mutex> lock(converter_mutex_);
+  return final_converter_ ? final_converter_->GetProfile()
+                          : VideoConverter::Profile();
+}
+
+bool AutoTuneVideoConverter::Convert(VideoConverter::Response *r) {
+  VideoConverter::Request request = request_;
+  request.auto_tune = false;
+  std::vector<VideoConverter::EncoderTuning> candidates = Candidates();
+  std::vector<Window> windows;
+  if (candidates.empty()) {
+    AvLog(nullptr, AV_LOG_WARNING,
+          "Auto-tune: no preset/crf candidates for encoder '%s', "
+          "converting as requested.\n",
+          request_.video_encoder.c_str());
+  } else if (PlanWindows(&windows)) {
+    std::vector<Trial> trials;
+    for (size_t i = 0; i < candidates.size(); i++) {
+      Trial trial;
+      trial.tuning = candidates[i];
+      if (RunTrial(windows, &trial)) {
+        trials.push_back(trial);
+      }
+      if (stopped_) {
+        return false;
+      }
+      VideoConverter::Response progress;
+      progress.output_file = output_file_;
+      progress.percent = kTunePercent * (i + 1.0) / candidates.size();
+      PostConvertProgress(progress);
+    }
+    if (!trials.empty()) {
+      const Trial &chosen = trials[ChooseTrial(trials)];
+      r->tuning = chosen.tuning;
+      r->tuning_fps = chosen.fps;
+      r->tuning_speed = chosen.speed;
+      r->tuning_psnr = chosen.psnr;
+      request.video_preset = chosen.tuning.preset;
+      request.video_crf = chosen.tuning.crf;
+      if (chosen.tuning.crf >= 0) {
+        // 固定质量编码，码率和两遍编码都不再需要
+        request.output_video_bitrate.clear();
+        request.two_pass = false;
+      }
+      AvLog(nullptr, AV_LOG_INFO,
+            "Auto-tune %s: preset=%s crf=%d, %.1f fps, %.2fx, PSNR %.2f dB\n",
+            output_file_.c_str(), chosen.tuning.preset.c_str(),
+            chosen.tuning.crf, chosen.fps, chosen.speed, chosen.psnr);
+    }
+  }
+  return RunFinal(request, r);
+}
+
+std::vector<VideoConverter::EncoderTuning> AutoTuneVideoConverter::Candidates()
+    const {
+  if (!request_.tune_candidates.empty()) {
+    return request_.tune_candidates;
+  }
+  // 各编码器 preset 的取值和 CRF 的范围不同，只给 x264/x265 提供默认组合
+  const AVCodec *codec = FindVideoEncoder(request_.video_encoder);
+  if (!codec || (strcmp(codec->name, "libx264") != 0 &&
+                 strcmp(codec->name, "libx265") != 0)) {
+    return {};
+  }
+  std::vector<VideoConverter::EncoderTuning> candidates;
+  for (const char *preset : {"veryfast", "faster", "medium", "slow"}) {
+    for (int crf : {20, 23, 26}) {
+      candidates.push_back({preset, crf});
+    }
+  }
+  return candidates;
+}
+
+bool AutoTuneVideoConverter::PlanWindows(std::vector<Window> *windows) const {
+  AVFormatContext *ic = nullptr;
+  int ret = avformat_open_input(&ic, input_file_.c_str(), nullptr, nullptr);
+  if (ret < 0) {
+    PrintError(input_file_.c_str(), ret);
+    return false;
+  }
+  ret = request_.probe_cache ? FindStreamInfoCached(ic, input_file_, nullptr)
+                            : avformat_find_stream_info(ic, nullptr);
+  int64_t duration = ic->duration;
+  avformat_close_input(&ic);
+  if (ret < 0) {
+    PrintError(input_file_.c_str(), ret);
+    return false;
+  }
+
+  // 只在要转码的时间段内采样
+  int64_t window_start = request_.output_video_start_time * 1000LL;
+  int64_t window_end = duration > 0 ? duration : INT64_MAX;
+  if (request_.output_video_record_time > 0) {
+    window_end = FFMIN(window_end, window_start +
+                                       request_.output_video_record_time *
+                                           1000LL);
+  }
+  int64_t sample =
+      FFMAX(request_.tune_sample_duration * 1000LL, kMinSampleDuration);
+  int count = FFMAX(request_.tune_samples, 1);
+  if (window_end == INT64_MAX) {
+    // 时长未知，只从开头取一个窗口
+    windows->push_back({window_start, sample});
+    return true;
+  }
+  int64_t length = window_end - window_start;
+  if (length <= 0) {
+    return false;
+  }
+  if (length <= sample * count) {
+    windows->push_back({window_start, length});
+    return true;
+  }
+  // 窗口均匀分布在各自区间的中间，避开片头片尾
+  for (int i = 0; i < count; i++) {
+    int64_t center = window_start + length * (2 * i + 1) / (2 * count);
+    windows->push_back({center - sample / 2, sample});
+  }
+  return true;
+}
+
+bool AutoTuneVideoConverter::RunTrial(const std::vector<Window> &windows,
+                                      Trial *trial) {
+  int64_t frames = 0;
+  int64_t duration = 0;
+  int64_t elapsed = 0;
+  double psnr_sum = 0;
+  int64_t psnr_frames = 0;
+  for (const auto &window : windows) {
+    VideoConverter::Request request = request_;
+    request.auto_tune = false;
+    // 只编码视频，不写文件
+    request.output_file_format = "null";
+    request.streaming_format.clear();
+    request.auto_stream_copy = false;
+    request.progress_rate = 0;
+    request.content_adaptive = 0;
+    request.output_video_start_time = 0;
+    request.output_video_record_time = 0;
+    request.video_preset = trial->tuning.preset;
+    request.video_crf = trial->tuning.crf;
+    // 只按编码阶段的耗时计算速度
+    request.profile = true;
+    std::shared_ptr<FfmpegVideoConverter> converter;
+    {
+      std::lock_guard<std::mutex> lock(converter_mutex_);
+      if (stopped_) {
+        return false;
+      }
+      trial_converter_ =
+          std::make_shared<FfmpegVideoConverter>(request, nullptr, nullptr);
+      converter = trial_converter_;
+    }
+    converter->SetTimeWindow(window.start_time, window.recording_time);
+    converter->DisableStreams(false, true);
+    converter->EnablePsnr();
+    converter->Start();
+    elapsed += VideoEncodeTime(converter->GetProfile());
+    VideoQuality quality = converter->GetVideoQuality();
+    bool succeeded = converter->Succeeded();
+    {
+      std::lock_guard<std::mutex> lock(converter_mutex_);
+      trial_converter_.reset();
+    }
+    if (stopped_) {
+      return false;
+    }
+    if (!succeeded || quality.frames <= 0) {
+      AvLog(nullptr, AV_LOG_WARNING,
+            "Auto-tune: preset=%s crf=%d failed to encode.\n",
+            trial->tuning.preset.c_str(), trial->tuning.crf);
+      return false;
+    }
+    frames += quality.frames;
+    duration += window.recording_time;
+    if (quality.psnr >= 0) {
+      psnr_sum += quality.psnr * quality.frames;
+      psnr_frames += quality.frames;
+    }
+  }
+  elapsed = FFMAX(elapsed, 1);
+  trial->fps = frames * 1000000.0 / elapsed;
+  trial->speed = static_cast<double>(duration) / elapsed;
+  trial->psnr = psnr_frames > 0 ? psnr_sum / psnr_frames : -1;
+  AvLog(nullptr, AV_LOG_INFO,
+        "Auto-tune: preset=%s crf=%d, %.1f fps, %.2fx, PSNR %.2f dB\n",
+        trial->tuning.preset.c_str(), trial->tuning.crf, trial->fps,
+        trial->speed, trial->psnr);
+  return true;
+}
+
+size_t AutoTuneVideoConverter::ChooseTrial(
+    const std::vector<Trial> &trials) const {
+  // 编码器不输出 PSNR 时按 CRF 比较画质，CRF 越小画质越好
+  auto better_quality = [](const Trial &a, const Trial &b) {
+    if (a.psnr >= 0 && b.psnr >= 0) {
+      return a.psnr > b.psnr;
+    }
+    return a.tuning.crf >= 0 && b.tuning.crf >= 0 &&
+           a.tuning.crf < b.tuning.crf;
+  };
+  // 有画质目标时在达标的参数中选最快的，否则在速度达标的参数中选画质最好的
+  bool by_psnr = request_.tune_target_psnr > 0;
+  size_t best = trials.size();
+  for (size_t i = 0; i < trials.size(); i++) {
+    const Trial &trial = trials[i];
+    bool meets = by_psnr ? trial.psnr >= request_.tune_target_psnr
+                         : trial.speed >= request_.tune_target_speed;
+    if (!meets) {
+      continue;
+    }
+    if (best == trials.size() ||
+        (by_psnr ? trial.speed > trials[best].speed
+                 : better_quality(trial, trials[best]))) {
+      best = i;
+    }
+  }
+  if (best != trials.size()) {
+    return best;
+  }
+  // 都达不到目标时选最接近的：画质目标选画质最好的，速度目标选最快的
+  AvLog(nullptr, AV_LOG_WARNING,
+        "Auto-tune: no candidate meets the target %s, using the closest.\n",
+        by_psnr ? "PSNR" : "speed");
+  best = 0;
+  for (size_t i = 1; i < trials.size(); i++) {
+    if (by_psnr ? better_quality(trials[i], trials[best])
+                : trials[i].speed > trials[best].speed) {
+      best = i;
+    }
+  }
+  return best;
+}
+
+bool AutoTuneVideoConverter::RunFinal(const VideoConverter::Request &request,
+                                      VideoConverter::Response *r) {
+  VideoConverter::Response end;
+  end.output_file = output_file_;
+  FinalDelegate delegate(
+      [this](VideoConverter::Response progress) {
+        PostConvertProgress(progress);
+      },
+      [this](VideoConverter::Response segment) {
+        PostConvertSegment(segment);
+      },
+      &end);
+  VideoConverter *converter = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(converter_mutex_);
+    if (stopped_) {
+      return false;
+    }
+    // 按调优后的参数走普通的选择逻辑，分段转码、两遍编码等照常生效
+    final_converter_ =
+        VideoConverter::MakeVideoConverter(request, &delegate, nullptr);
+    converter = final_converter_.get();
+  }
+  if (!converter) {
+    return false;
+  }
+  converter->Start();
+  end.tuning = r->tuning;
+  end.tuning_fps = r->tuning_fps;
+  end.tuning_speed = r->tuning_speed;
+  end.tuning_psnr = r->tuning_psnr;
+  *r = end;
+  return r->succeeded && !stopped_;
+}
+
+void AutoTuneVideoConverter::Run(void *arg) {
+  auto converter = static_cast<AutoTuneVideoConverter *>(arg);
+  VideoConverter::Response r;
+  r.output_file = converter->output_file_;
+  converter->Convert(&r);
+  converter->PostConvertEnd(r);
+}
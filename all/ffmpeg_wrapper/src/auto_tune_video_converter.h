@@ -0,0 +1,63 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "base_video_converter.h"
+
+class FfmpegVideoConverter;
+
+// 编码参数自动调优：在输入的几个采样窗口上用不同的 preset/CRF 试编码，
+// 测编码速度和 PSNR，按目标选出一组参数，再用它转码整个文件
+class AutoTuneVideoConverter : public BaseVideoConverter {
+ public:
+  AutoTuneVideoConverter(const VideoConverter::Request &request,
+                         VideoConverter::Delegate *delegate,
+                         VideoConverter::AsyncCallFuncType call_fun);
+  ~AutoTuneVideoConverter() override;
+
+  void Start() override;
+  void Stop() override;
+  // 最后转码整个文件时的统计，试编码阶段为空
+  VideoConverter::Profile GetProfile() const override;
+
+ private:
+  // 一组参数在所有采样窗口上的结果
+  struct Trial {
+    VideoConverter::EncoderTuning tuning;
+    double fps{0};
+    double speed{0};  // 采样窗口时长 / 试编码耗时
+    double psnr{-1};
+  };
+  struct Window {
+    int64_t start_time{0};      // 微秒
+    int64_t recording_time{0};  // 微秒
+  };
+
+  bool Convert(VideoConverter::Response *r);
+  // 编码器不支持 preset 和 CRF 时返回空
+  std::vector<VideoConverter::EncoderTuning> Candidates() const;
+  bool PlanWindows(std::vector<Window> *windows) const;
+  bool RunTrial(const std::vector<Window> &windows, Trial *trial);
+  // trials 不为空
+  size_t ChooseTrial(const std::vector<Trial> &trials) const;
+  bool RunFinal(const VideoConverter::Request &request,
+                VideoConverter::Response *r);
+
+  static void Run(void *converter);
+
+ private:
+  VideoConverter::Request request_;
+  std::atomic_bool stopped_{false};
+
+  // 同一时间只有一个试编码或最后转码的转码器
+  mutable std::mutex converter_mutex_;
+  std::shared_ptr<FfmpegVideoConverter> trial_converter_;
+  std::unique_ptr<VideoConverter> final_converter_;
+
+  std::unique_ptr<std::thread> worker_;
+};
@@ -26,6 +26,19 @@ void BaseVideoConverter::PostConvertProgress(VideoConverter::Response r) {
     delegate->OnConvertProgress(r);
   }
 }
+void BaseVideoConverter::PostConvertSegment(VideoConverter::Response r) {
+  if (async_call_fun_) {
+    std::weak_ptr<BaseVideoConverter> converter = this->weak_from_this();
+    async_call_fun_([converter, r]() {
+      if (auto conv = converter.lock()) {
+        // lock delegate
+        conv->delegate_->OnConvertSegment(r);
+      }
+    });
+  } else if (auto delegate = delegate_) {
+    delegate->OnConvertSegment(r);
+  }
+}
 void BaseVideoConverter::PostConvertEnd(VideoConverter::Response r) {
   if (async_call_fun_) {
     std::weak_ptr<BaseVideoConverter> converter = this->weak_from_this();
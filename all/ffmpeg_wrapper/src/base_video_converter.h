@@ -19,10 +19,14 @@ class BaseVideoConverter
 
   virtual void Start() = 0;
   virtual void Stop() = 0;
+  virtual VideoConverter::Profile GetProfile() const {
+    return VideoConverter::Profile();
+  }
 
  protected:
   void PostConvertBegin(VideoConverter::Response r);
   void PostConvertProgress(VideoConverter::Response r);
+  void PostConvertSegment(VideoConverter::Response r);
   void PostConvertEnd(VideoConverter::Response r);
 
  protected:
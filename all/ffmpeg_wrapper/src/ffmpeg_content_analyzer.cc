@@ -0,0 +1,299 @@
+#include "ffmpeg_content_analyzer.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "libavutil/opt.h"
+#include "libswscale/swscale.h"
+
+#ifdef __cplusplus
+}
+#endif
+
+#include <cmath>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+#include "ffmpeg_probe_cache.h"
+
+namespace {
+
+// 统一缩小到这个尺寸再计算，结果与源分辨率无关
+constexpr int kAnalyzeWidth = 160;
+constexpr int kAnalyzeHeight = 90;
+constexpr int kMinWindows = 2;
+constexpr int kMaxWindows = 8;
+
+// 每像素比特数 = 基础值 + 空间、时间复杂度的线性项，按 H.264 标定：
+// 静止的录屏约 0.02，说话的人像约 0.05，体育比赛约 0.15
+constexpr double kBaseBitsPerPixel = 0.01;
+constexpr double kSpatialBitsPerPixel = 0.001;
+constexpr double kTemporalBitsPerPixel = 0.012;
+constexpr double kMinBitsPerPixel = 0.015;
+constexpr double kMaxBitsPerPixel = 0.3;
+constexpr int64_t kMinBitrate = 100000;
+
+// 一个采样窗口的累计结果
+struct WindowStats {
+  double spatial_sum{0};
+  double temporal_sum{0};
+  int64_t frames{0};
+  int64_t frame_pairs{0};
+};
+
+class WindowAnalyzer {
+ public:
+  ~WindowAnalyzer() {
+    sws_freeContext(sws_ctx_);
+    av_frame_free(&frame_);
+    av_packet_free(&pkt_);
+    avcodec_free_context(&dec_ctx_);
+    avformat_close_input(&fmt_ctx_);
+  }
+
+  bool Run(const std::string &input_file, int64_t start_time, int max_frames,
+           WindowStats *stats) {
+    stats_ = stats;
+    max_frames_ = max_frames;
+    if (!Open(input_file, start_time)) {
+      return false;
+    }
+    int ret = 0;
+    while (stats_->frames < max_frames_ &&
+           (ret = av_read_frame(fmt_ctx_, pkt_)) >= 0) {
+      if (pkt_->stream_index == stream_index_) {
+        ret = Decode(pkt_);
+      }
+      av_packet_unref(pkt_);
+      if (ret < 0) {
+        break;
+      }
+    }
+    if (stats_->frames < max_frames_) {
+      Decode(nullptr);
+    }
+    return stats_->frames > 0;
+  }
+
+ private:
+  bool Open(const std::string &input_file, int64_t start_time) {
+    int ret =
+        avformat_open_input(&fmt_ctx_, input_file.c_str(), nullptr, nullptr);
+    if (ret < 0 ||
+        (ret = FindStreamInfoCached(fmt_ctx_, input_file, nullptr)) < 0) {
+      PrintError(input_file.c_str(), ret);
+      return false;
+    }
+    const AVCodec *dec = nullptr;
+    stream_index_ = av_find_best_stream(fmt_ctx_, AVMEDIA_TYPE_VIDEO, -1, -1,
+                                        &dec, 0);
+    if (stream_index_ < 0) {
+      return false;
+    }
+    // 其它流的数据包不读
+    for (unsigned int i = 0; i < fmt_ctx_->nb_streams; i++) {
+      if (static_cast<int>(i) != stream_index_) {
+        fmt_ctx_->streams[i]->discard = AVDISCARD_ALL;
+      }
+    }
+    dec_ctx_ = avcodec_alloc_context3(dec);
+    pkt_ = av_packet_alloc();
+    frame_ = av_frame_alloc();
+    if (!dec_ctx_ || !pkt_ || !frame_) {
+      return false;
+    }
+    ret = avcodec_parameters_to_context(
+        dec_ctx_, fmt_ctx_->streams[stream_index_]->codecpar);
+    if (ret < 0) {
+      return false;
+    }
+    // 只需要大致的画面：窗口之间已经并行，解码器单线程；
+    // 跳过环路滤波，支持 lowres 的解码器直接输出 1/4 尺寸
+    dec_ctx_->thread_count = 1;
+    dec_ctx_->skip_loop_filter = AVDISCARD_ALL;
+    dec_ctx_->flags2 |= AV_CODEC_FLAG2_FAST;
+    if (dec->max_lowres > 0) {
+      av_opt_set_int(dec_ctx_, "lowres", FFMIN(dec->max_lowres, 2), 0);
+    }
+    if ((ret = avcodec_open2(dec_ctx_, dec, nullptr)) < 0) {
+      PrintError(input_file.c_str(), ret);
+      return false;
+    }
+    if (start_time > 0) {
+      int64_t timestamp = start_time;
+      if (fmt_ctx_->start_time != AV_NOPTS_VALUE) {
+        timestamp += fmt_ctx_->start_time;
+      }
+      avformat_seek_file(fmt_ctx_, -1, INT64_MIN, timestamp, timestamp, 0);
+    }
+    return true;
+  }
+
+  int Decode(const AVPacket *pkt) {
+    int ret = avcodec_send_packet(dec_ctx_, pkt);
+    if (ret < 0 && ret != AVERROR_EOF) {
+      return ret;
+    }
+    while (stats_->frames < max_frames_) {
+      ret = avcodec_receive_frame(dec_ctx_, frame_);
+      if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+        return 0;
+      }
+      if (ret < 0) {
+        return ret;
+      }
+      AddFrame(frame_);
+      av_frame_unref(frame_);
+    }
+    return 0;
+  }
+
+  void AddFrame(const AVFrame *frame) {
+    sws_ctx_ = sws_getCachedContext(
+        sws_ctx_, frame->width, frame->height,
+        static_cast<AVPixelFormat>(frame->format), kAnalyzeWidth,
+        kAnalyzeHeight, AV_PIX_FMT_GRAY8, SWS_FAST_BILINEAR, nullptr, nullptr,
+        nullptr);
+    if (!sws_ctx_) {
+      return;
+    }
+    current_.resize(kAnalyzeWidth * kAnalyzeHeight);
+    uint8_t *dst[4] = {current_.data()};
+    int dst_stride[4] = {kAnalyzeWidth};
+    sws_scale(sws_ctx_, frame->data, frame->linesize, 0, frame->height, dst,
+              dst_stride);
+
+    // 空间复杂度：水平和垂直相邻像素差的平均
+    int64_t gradient = 0;
+    for (int y = 0; y < kAnalyzeHeight - 1; y++) {
+      const uint8_t *row = current_.data() + y * kAnalyzeWidth;
+      const uint8_t *next = row + kAnalyzeWidth;
+      for (int x = 0; x < kAnalyzeWidth - 1; x++) {
+        gradient += std::abs(row[x + 1] - row[x]) + std::abs(next[x] - row[x]);
+      }
+    }
+    stats_->spatial_sum +=
+        gradient / (2.0 * (kAnalyzeWidth - 1) * (kAnalyzeHeight - 1));
+    // 时间复杂度：与上一帧的平均差
+    if (!previous_.empty()) {
+      int64_t difference = 0;
+      for (size_t i = 0; i < current_.size(); i++) {
+        difference += std::abs(current_[i] - previous_[i]);
+      }
+      stats_->temporal_sum += static_cast<double>(difference) / current_.size();
+      stats_->frame_pairs++;
+    }
+    stats_->frames++;
+    previous_.swap(current_);
+  }
+
+ private:
+  AVFormatContext *fmt_ctx_{nullptr};
+  AVCodecContext *dec_ctx_{nullptr};
+  AVPacket *pkt_{nullptr};
+  AVFrame *frame_{nullptr};
+  SwsContext *sws_ctx_{nullptr};
+  int stream_index_{-1};
+  int max_frames_{0};
+  WindowStats *stats_{nullptr};
+  std::vector<uint8_t> current_;
+  std::vector<uint8_t> previous_;
+};
+
+}  // namespace
+
+ContentComplexity AnalyzeContent(const std::string &input_file,
+                                 int64_t start_time, int64_t end_time,
+                                 int windows, int frames_per_window) {
+  ContentComplexity content;
+  if (end_time == INT64_MAX) {
+    AVFormatContext *ic = nullptr;
+    int ret = avformat_open_input(&ic, input_file.c_str(), nullptr, nullptr);
+    if (ret < 0) {
+      PrintError(input_file.c_str(), ret);
+      return content;
+    }
+    if (FindStreamInfoCached(ic, input_file, nullptr) >= 0 &&
+        ic->duration > 0) {
+      end_time = ic->duration;
+    }
+    avformat_close_input(&ic);
+  }
+  // 时长未知时只分析开头
+  windows = end_time == INT64_MAX ? 1 : FFMAX(windows, 1);
+  int64_t length = end_time == INT64_MAX ? 0 : end_time - start_time;
+
+  std::vector<WindowStats> stats(windows);
+  std::vector<std::thread> workers;
+  for (int i = 0; i < windows; i++) {
+    int64_t window_start = start_time + length / windows * i;
+    workers.emplace_back([&, i, window_start]() {
+      WindowAnalyzer analyzer;
+      analyzer.Run(input_file, window_start, frames_per_window, &stats[i]);
+    });
+  }
+  for (auto &worker : workers) {
+    worker.join();
+  }
+
+  int64_t frame_pairs = 0;
+  for (const auto &window : stats) {
+    content.spatial += window.spatial_sum;
+    content.temporal += window.temporal_sum;
+    content.frames += window.frames;
+    frame_pairs += window.frame_pairs;
+  }
+  if (content.frames > 0) {
+    content.spatial /= content.frames;
+  }
+  if (frame_pairs > 0) {
+    content.temporal /= frame_pairs;
+  }
+  return content;
+}
+
+ContentComplexity AnalyzeContent(const VideoConverter::Request &request) {
+  int64_t start = request.output_video_start_time * 1000LL;
+  int64_t end = request.output_video_record_time > 0
+                    ? start + request.output_video_record_time * 1000LL
+                    : INT64_MAX;
+  return AnalyzeContent(request.input_file, start, end,
+                        ContentWindows(request.threads), kContentWindowFrames);
+}
+
+int ContentWindows(int threads) {
+  if (threads <= 0) {
+    threads = static_cast<int>(std::thread::hardware_concurrency());
+  }
+  return av_clip(threads, kMinWindows, kMaxWindows);
+}
+
+int64_t EstimateBitrate(const ContentComplexity &content, const AVCodec *codec,
+                        int width, int height, double frame_rate) {
+  double bpp = kBaseBitsPerPixel + kSpatialBitsPerPixel * content.spatial +
+               kTemporalBitsPerPixel * content.temporal;
+  bpp = av_clipd(bpp, kMinBitsPerPixel, kMaxBitsPerPixel);
+  // 相同画质下相对 H.264 的码率
+  double efficiency = 1.0;
+  switch (codec ? codec->id : AV_CODEC_ID_H264) {
+    case AV_CODEC_ID_HEVC:
+      efficiency = 0.6;
+      break;
+    case AV_CODEC_ID_VP9:
+      efficiency = 0.65;
+      break;
+    case AV_CODEC_ID_AV1:
+      efficiency = 0.5;
+      break;
+    case AV_CODEC_ID_MPEG4:
+    case AV_CODEC_ID_MPEG2VIDEO:
+      efficiency = 1.5;
+      break;
+    default:
+      break;
+  }
+  double bitrate = bpp * efficiency * width * height * frame_rate;
+  return FFMAX(static_cast<int64_t>(llrint(bitrate)), kMinBitrate);
+}
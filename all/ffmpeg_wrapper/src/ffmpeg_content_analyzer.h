@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+#include "ffmpeg_util.h"
+#include "ffmpeg_wrapper/video_converter.h"
+
+// 每个采样窗口解码的帧数
+constexpr int kContentWindowFrames = 30;
+
+// 内容复杂度，在缩小后的亮度图上计算，都是 0~255 范围内的平均值
+struct ContentComplexity {
+  double spatial{0};   // 相邻像素差，纹理、细节越多越大
+  double temporal{0};  // 相邻帧差，运动越剧烈越大
+  int64_t frames{0};   // 参与计算的帧数，为 0 表示分析失败
+};
+
+// 在 [start_time, end_time) 中均匀取 windows 个采样窗口，单位微秒，
+// end_time 为 INT64_MAX 时到文件结尾；每个窗口一个线程，各自打开输入，
+// 从窗口开始处单线程快速解码最多 frames_per_window 帧
+ContentComplexity AnalyzeContent(const std::string &input_file,
+                                 int64_t start_time, int64_t end_time,
+                                 int windows, int frames_per_window);
+
+// 分析请求中的输入文件和时间段，按 threads（未设置时为 CPU 核数）
+// 选择采样窗口数
+ContentComplexity AnalyzeContent(const VideoConverter::Request &request);
+// 采样窗口数，threads <= 0 时按 CPU 核数
+int ContentWindows(int threads);
+
+// 按复杂度估算输出的视频码率，单位 bit/s
+// codec 为空时按 H.264 估算，HEVC/VP9/AV1 等压缩率更高的编码相应降低
+int64_t EstimateBitrate(const ContentComplexity &content, const AVCodec *codec,
+                        int width, int height, double frame_rate);
@@ -0,0 +1,419 @@
+#include "ffmpeg_custom_io.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "libavutil/avstring.h"
+
+#ifdef __cplusplus
+}
+#endif
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#if !defined(_WIN32)
+#include <poll.h>
+#endif
+
+#include "ffmpeg_pipeline.h"
+
+namespace {
+
+// 解封装等待预读的数据、预读线程等待输入数据时检查中断的间隔，单位微秒
+constexpr int64_t kReadAheadPollInterval = 10000;
+
+struct ReadAheadChunk {
+  std::vector<uint8_t> data;
+  int size{0};
+  int pos{0};    // 已经被读走的字节数
+  int error{0};  // 读到末尾或出错时为对应的 AVERROR，之后不再有数据
+};
+// 块属于 ReadAhead，队列里只是借用
+void ReleaseQueueItem(ReadAheadChunk *&chunk) { chunk = nullptr; }
+
+// 固定数量的块在空闲和已填充两个队列之间循环，相当于一个环形缓冲区
+struct ReadAhead {
+  ReadAhead(size_t count, int chunk_size)
+      : free_chunks(count), filled_chunks(count) {
+    for (size_t i = 0; i < count; i++) {
+      chunks.push_back(std::make_unique<ReadAheadChunk>());
+      chunks.back()->data.resize(chunk_size);
+      free_chunks.Push(chunks.back().get());
+    }
+  }
+  ~ReadAhead() {
+    {
+      std::lock_guard<std::mutex> lock(stop_mutex);
+      stopping = true;
+    }
+    stop_cv.notify_one();
+    free_chunks.Close();
+    filled_chunks.Close();
+    if (thread.joinable()) {
+      thread.join();
+    }
+    if (custom_source) {
+      CloseCustomIo(&source);
+    } else {
+      avio_closep(&source);
+    }
+  }
+
+  AVIOContext *source{nullptr};
+  bool custom_source{false};
+  int pipe_fd{-1};  // "pipe:" 输入的描述符，没有数据时 poll 它
+  AVIOInterruptCB int_cb{nullptr, nullptr};
+  // 关闭时唤醒等待数据的预读线程
+  std::mutex stop_mutex;
+  std::condition_variable stop_cv;
+  bool stopping{false};
+  std::vector<std::unique_ptr<ReadAheadChunk>> chunks;
+  BoundedQueue<ReadAheadChunk *> free_chunks;
+  BoundedQueue<ReadAheadChunk *> filled_chunks;
+  ReadAheadChunk *current{nullptr};  // 解封装正在读的块
+  std::thread thread;
+};
+
+struct CustomIo {
+  VideoConverter::IoSource source;
+  VideoConverter::IoSink sink;
+  int64_t pos{0};  // 内存输入输出的当前位置
+  std::unique_ptr<ReadAhead> read_ahead;
+};
+
+int64_t SeekPosition(int64_t pos, int64_t size, int64_t offset, int whence) {
+  switch (whence) {
+    case SEEK_SET:
+      return offset;
+    case SEEK_CUR:
+      return pos + offset;
+    case SEEK_END:
+      return size + offset;
+    default:
+      return AVERROR(EINVAL);
+  }
+}
+
+int ReadMemory(void *opaque, uint8_t *buf, int buf_size) {
+  CustomIo *io = static_cast<CustomIo *>(opaque);
+  int64_t left = static_cast<int64_t>(io->source.size) - io->pos;
+  if (left <= 0) {
+    return AVERROR_EOF;
+  }
+  int size = static_cast<int>(FFMIN(left, buf_size));
+  memcpy(buf, io->source.data + io->pos, size);
+  io->pos += size;
+  return size;
+}
+
+int64_t SeekMemory(void *opaque, int64_t offset, int whence) {
+  CustomIo *io = static_cast<CustomIo *>(opaque);
+  int64_t size = static_cast<int64_t>(io->source.size);
+  whence &= ~AVSEEK_FORCE;
+  if (whence == AVSEEK_SIZE) {
+    return size;
+  }
+  int64_t pos = SeekPosition(io->pos, size, offset, whence);
+  if (pos < 0 || pos > size) {
+    return AVERROR(EINVAL);
+  }
+  io->pos = pos;
+  return pos;
+}
+
+int ReadCallback(void *opaque, uint8_t *buf, int buf_size) {
+  CustomIo *io = static_cast<CustomIo *>(opaque);
+  int ret = io->source.read(buf, buf_size);
+  if (ret == 0) {
+    return AVERROR_EOF;
+  }
+  if (ret == VideoConverter::kReadAgain) {
+    return AVERROR(EAGAIN);
+  }
+  return ret < 0 ? AVERROR(EIO) : ret;
+}
+
+int64_t SeekSource(void *opaque, int64_t offset, int whence) {
+  CustomIo *io = static_cast<CustomIo *>(opaque);
+  whence &= ~AVSEEK_FORCE;
+  int64_t ret = io->source.seek(
+      offset, whence == AVSEEK_SIZE ? VideoConverter::kSeekSize : whence);
+  return ret < 0 ? AVERROR(EIO) : ret;
+}
+
+int WriteBuffer(void *opaque, uint8_t *buf, int buf_size) {
+  CustomIo *io = static_cast<CustomIo *>(opaque);
+  std::vector<uint8_t> *buffer = io->sink.buffer;
+  size_t end = static_cast<size_t>(io->pos) + buf_size;
+  if (end > buffer->size()) {
+    buffer->resize(end);
+  }
+  memcpy(buffer->data() + io->pos, buf, buf_size);
+  io->pos = end;
+  return buf_size;
+}
+
+int64_t SeekBuffer(void *opaque, int64_t offset, int whence) {
+  CustomIo *io = static_cast<CustomIo *>(opaque);
+  int64_t size = static_cast<int64_t>(io->sink.buffer->size());
+  whence &= ~AVSEEK_FORCE;
+  if (whence == AVSEEK_SIZE) {
+    return size;
+  }
+  // 允许 seek 到末尾之后，写入时再补齐
+  int64_t pos = SeekPosition(io->pos, size, offset, whence);
+  if (pos < 0) {
+    return AVERROR(EINVAL);
+  }
+  io->pos = pos;
+  return pos;
+}
+
+int WriteCallback(void *opaque, uint8_t *buf, int buf_size) {
+  CustomIo *io = static_cast<CustomIo *>(opaque);
+  int ret = io->sink.write(buf, buf_size);
+  return ret < 0 ? AVERROR(EIO) : buf_size;
+}
+
+int64_t SeekSink(void *opaque, int64_t offset, int whence) {
+  CustomIo *io = static_cast<CustomIo *>(opaque);
+  whence &= ~AVSEEK_FORCE;
+  int64_t ret = io->sink.seek(
+      offset, whence == AVSEEK_SIZE ? VideoConverter::kSeekSize : whence);
+  return ret < 0 ? AVERROR(EIO) : ret;
+}
+
+// "pipe:N" 的描述符，与 FFmpeg 的 pipe 协议一样，没有编号时为 0
+int PipeDescriptor(const char *filename) {
+  if (!filename || !av_strstart(filename, "pipe:", &filename)) {
+    return -1;
+  }
+  char *end = nullptr;
+  long fd = strtol(filename, &end, 10);
+  return end == filename || *end ? 0 : static_cast<int>(fd);
+}
+
+// 停止或者 int_cb 中断时返回 true
+bool ReadAheadStopped(ReadAhead *ra) {
+  {
+    std::lock_guard<std::mutex> lock(ra->stop_mutex);
+    if (ra->stopping) {
+      return true;
+    }
+  }
+  return ra->int_cb.callback && ra->int_cb.callback(ra->int_cb.opaque);
+}
+
+// 暂时没有数据，等一个检查间隔；返回 false 表示已停止
+bool WaitForData(ReadAhead *ra) {
+#if !defined(_WIN32)
+  // 管道的读取不理会 AVIO_FLAG_NONBLOCK，缓冲区空时先 poll，有数据再读；
+  // Windows 上没有 poll，管道仍然阻塞读取
+  if (ra->pipe_fd >= 0) {
+    while (ra->source->buf_ptr >= ra->source->buf_end) {
+      pollfd p = {ra->pipe_fd, POLLIN, 0};
+      int ret = poll(&p, 1, static_cast<int>(kReadAheadPollInterval / 1000));
+      if (ret > 0 || (ret < 0 && errno != EINTR)) {
+        // 有数据、对端关闭或出错，都交给读取处理
+        break;
+      }
+      if (ReadAheadStopped(ra)) {
+        return false;
+      }
+    }
+    return true;
+  }
+#endif
+  std::unique_lock<std::mutex> lock(ra->stop_mutex);
+  if (ra->stop_cv.wait_for(lock,
+                           std::chrono::microseconds(kReadAheadPollInterval),
+                           [ra] { return ra->stopping; })) {
+    return false;
+  }
+  lock.unlock();
+  return !ReadAheadStopped(ra);
+}
+
+// 读到数据、末尾或出错时返回，停止时返回 AVERROR_EXIT
+int ReadSource(ReadAhead *ra, uint8_t *buf, int size) {
+#if !defined(_WIN32)
+  if (ra->pipe_fd >= 0 && !WaitForData(ra)) {
+    return AVERROR_EXIT;
+  }
+#endif
+  for (;;) {
+    int ret = avio_read_partial(ra->source, buf, size);
+    if (ret != AVERROR(EAGAIN)) {
+      return ret;
+    }
+    // 非阻塞读取暂时没有数据，不是末尾
+    ra->source->eof_reached = 0;
+    ra->source->error = 0;
+    if (!WaitForData(ra)) {
+      return AVERROR_EXIT;
+    }
+  }
+}
+
+// 有一点数据就返回，不等块填满，管道里刚到的数据能马上交给解封装
+void ReadAheadLoop(ReadAhead *ra) {
+  ReadAheadChunk *chunk = nullptr;
+  while (ra->free_chunks.Pop(&chunk)) {
+    int ret = ReadSource(ra, chunk->data.data(),
+                         static_cast<int>(chunk->data.size()));
+    chunk->pos = 0;
+    chunk->size = FFMAX(ret, 0);
+    chunk->error = ret > 0 ? 0 : (ret < 0 ? ret : AVERROR_EOF);
+    if (chunk->error && chunk->error != AVERROR_EOF &&
+        chunk->error != AVERROR_EXIT) {
+      PrintError("Read-ahead of streaming input", chunk->error);
+    }
+    if (!ra->filled_chunks.Push(chunk) || chunk->error) {
+      break;
+    }
+  }
+  ra->filled_chunks.Close();
+}
+
+int ReadAheadRead(void *opaque, uint8_t *buf, int buf_size) {
+  ReadAhead *ra = static_cast<CustomIo *>(opaque)->read_ahead.get();
+  for (;;) {
+    if (!ra->current) {
+      while (!ra->filled_chunks.PopFor(&ra->current,
+                                       kReadAheadPollInterval)) {
+        if (ra->filled_chunks.IsDrained()) {
+          return AVERROR_EOF;
+        }
+        if (ra->int_cb.callback && ra->int_cb.callback(ra->int_cb.opaque)) {
+          return AVERROR_EXIT;
+        }
+      }
+    }
+    ReadAheadChunk *chunk = ra->current;
+    if (chunk->pos < chunk->size) {
+      int size = FFMIN(chunk->size - chunk->pos, buf_size);
+      memcpy(buf, chunk->data.data() + chunk->pos, size);
+      chunk->pos += size;
+      return size;
+    }
+    // 末尾的块留着，之后再读也返回同样的错误
+    if (chunk->error) {
+      return chunk->error;
+    }
+    ra->current = nullptr;
+    ra->free_chunks.Push(chunk);
+  }
+}
+
+AVIOContext *AllocCustomIo(CustomIo *io, int buffer_size, bool write,
+                           int (*read_packet)(void *, uint8_t *, int),
+                           int (*write_packet)(void *, uint8_t *, int),
+                           int64_t (*seek)(void *, int64_t, int)) {
+  if (buffer_size <= 0) {
+    buffer_size = kDefaultIoBufferSize;
+  }
+  uint8_t *buffer = static_cast<uint8_t *>(av_malloc(buffer_size));
+  AVIOContext *pb = buffer ? avio_alloc_context(buffer, buffer_size, write, io,
+                                                read_packet, write_packet, seek)
+                           : nullptr;
+  if (!pb) {
+    av_free(buffer);
+    delete io;
+    PrintError("avio_alloc_context()", AVERROR(ENOMEM));
+  }
+  return pb;
+}
+
+}  // namespace
+
+AVIOContext *OpenCustomInput(const VideoConverter::IoSource &source,
+                             int buffer_size) {
+  if (source.data) {
+    CustomIo *io = new CustomIo;
+    io->source.data = source.data;
+    io->source.size = source.size;
+    AVIOContext *pb = AllocCustomIo(io, buffer_size, false, ReadMemory,
+                                    nullptr, SeekMemory);
+    if (pb) {
+      // 大块读取时直接拷到调用者的缓冲区，不经过 AVIOContext 的缓冲区
+      pb->direct = 1;
+    }
+    return pb;
+  }
+  if (source.read) {
+    CustomIo *io = new CustomIo;
+    io->source = source;
+    return AllocCustomIo(io, buffer_size, false, ReadCallback, nullptr,
+                         source.seek ? SeekSource : nullptr);
+  }
+  return nullptr;
+}
+
+AVIOContext *OpenReadAheadInput(AVIOContext *source, const char *filename,
+                                bool custom_source, int queue_size,
+                                int buffer_size,
+                                const AVIOInterruptCB &int_cb) {
+  if (buffer_size <= 0) {
+    buffer_size = kDefaultIoBufferSize;
+  }
+  CustomIo *io = new CustomIo;
+  io->read_ahead = std::make_unique<ReadAhead>(FFMAX(queue_size, 1),
+                                               buffer_size);
+  ReadAhead *ra = io->read_ahead.get();
+  ra->source = source;
+  ra->custom_source = custom_source;
+  if (!custom_source) {
+    ra->pipe_fd = PipeDescriptor(filename);
+  }
+  ra->int_cb = int_cb;
+  // 不能 seek，解封装器会按管道输入处理
+  AVIOContext *pb =
+      AllocCustomIo(io, buffer_size, false, ReadAheadRead, nullptr, nullptr);
+  if (pb) {
+    ra->thread = std::thread(ReadAheadLoop, ra);
+  }
+  return pb;
+}
+
+AVIOContext *OpenCustomOutput(const VideoConverter::IoSink &sink,
+                              int buffer_size) {
+  if (sink.buffer) {
+    CustomIo *io = new CustomIo;
+    io->sink.buffer = sink.buffer;
+    sink.buffer->clear();
+    return AllocCustomIo(io, buffer_size, true, nullptr, WriteBuffer,
+                         SeekBuffer);
+  }
+  if (sink.write) {
+    CustomIo *io = new CustomIo;
+    io->sink = sink;
+    return AllocCustomIo(io, buffer_size, true, nullptr, WriteCallback,
+                         sink.seek ? SeekSink : nullptr);
+  }
+  return nullptr;
+}
+
+int CloseCustomIo(AVIOContext **pb) {
+  if (!*pb) {
+    return 0;
+  }
+  int ret = 0;
+  if ((*pb)->write_flag) {
+    avio_flush(*pb);
+    ret = (*pb)->error;
+  }
+  delete static_cast<CustomIo *>((*pb)->opaque);
+  av_freep(&(*pb)->buffer);
+  avio_context_free(pb);
+  return ret;
+}
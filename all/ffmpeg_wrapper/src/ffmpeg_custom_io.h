@@ -0,0 +1,28 @@
+#pragma once
+
+#include "ffmpeg_util.h"
+#include "ffmpeg_wrapper/video_converter.h"
+
+// 自定义输入输出：内存缓冲区或者回调，通过 AVIOContext 交给 libavformat
+// buffer_size <= 0 时使用 kDefaultIoBufferSize
+constexpr int kDefaultIoBufferSize = 32 * 1024;
+
+// 没有设置输入数据或读取回调时返回空
+AVIOContext *OpenCustomInput(const VideoConverter::IoSource &source,
+                             int buffer_size);
+// 没有设置写入回调或缓冲区时返回空
+AVIOContext *OpenCustomOutput(const VideoConverter::IoSink &sink,
+                              int buffer_size);
+// 流式输入：预读线程从 source（管道、socket 或读取回调）读取数据，
+// 填充 queue_size 个 buffer_size 大小的块，解封装从块中取数据；
+// 读到末尾或出错后一直返回对应的错误，int_cb 中断时返回 AVERROR_EXIT
+// source 要以 AVIO_FLAG_NONBLOCK 打开（读取回调返回 kReadAgain），没有数据时
+// 预读线程定时检查 int_cb 和是否已关闭，关闭时不会卡在读取上；
+// filename 是 "pipe:" 时改为 poll 管道
+// 返回的 AVIOContext 不能 seek，接管 source，失败时也会关闭 source
+AVIOContext *OpenReadAheadInput(AVIOContext *source, const char *filename,
+                                bool custom_source, int queue_size,
+                                int buffer_size,
+                                const AVIOInterruptCB &int_cb);
+// 写入时先 flush，返回写入过程中的错误
+int CloseCustomIo(AVIOContext **pb);
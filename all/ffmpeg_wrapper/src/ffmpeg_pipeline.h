@@ -0,0 +1,188 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+#include "ffmpeg_util.h"
+
+// 流水线各阶段之间传递的数据都是引用计数的 AVPacket/AVFrame，
+// 出队后由调用方负责释放
+inline void ReleaseQueueItem(AVPacket *&pkt) { av_packet_free(&pkt); }
+inline void ReleaseQueueItem(AVFrame *&frame) { av_frame_free(&frame); }
+inline void AllocPoolItem(AVPacket **pkt) { *pkt = av_packet_alloc(); }
+inline void AllocPoolItem(AVFrame **frame) { *frame = av_frame_alloc(); }
+inline void UnrefPoolItem(AVPacket *pkt) { av_packet_unref(pkt); }
+inline void UnrefPoolItem(AVFrame *frame) { av_frame_unref(frame); }
+
+// AVPacket/AVFrame 结构体的对象池，避免流水线上每个数据包、每帧都分配一次
+// 数据缓冲区是引用计数的，由解封装器、解码器和滤镜各自的 AVBufferPool 复用
+// 可以在不同线程上 Get/Put
+template <typename T>
+class ObjectPool {
+ public:
+  // allocations 不为空时累加池中没有可用对象、需要新分配的次数
+  explicit ObjectPool(size_t capacity,
+                      std::atomic<int64_t> *allocations = nullptr)
+      : capacity_(capacity), allocations_(allocations) {}
+  ~ObjectPool() {
+    for (auto &item : items_) {
+      ReleaseQueueItem(item);
+    }
+  }
+
+  // 分配失败时返回 nullptr
+  T *Get() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!items_.empty()) {
+        T *item = items_.back();
+        items_.pop_back();
+        return item;
+      }
+    }
+    if (allocations_) {
+      allocations_->fetch_add(1, std::memory_order_relaxed);
+    }
+    T *item = nullptr;
+    AllocPoolItem(&item);
+    return item;
+  }
+  // 释放引用的数据后放回池中，池满时直接释放
+  void Put(T *item) {
+    if (!item) {
+      return;
+    }
+    UnrefPoolItem(item);
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (items_.size() < capacity_) {
+        items_.push_back(item);
+        return;
+      }
+    }
+    ReleaseQueueItem(item);
+  }
+
+ private:
+  const size_t capacity_;
+  std::atomic<int64_t> *allocations_{nullptr};
+  std::vector<T *> items_;
+  std::mutex mutex_;
+
+ private:
+  ObjectPool(const ObjectPool &) = delete;
+  ObjectPool &operator=(const ObjectPool &) = delete;
+};
+
+// 有界阻塞队列，用于连接流水线的相邻阶段
+// 生产者在队列满时阻塞（背压），消费者在队列空时阻塞
+template <typename T>
+class BoundedQueue {
+ public:
+  explicit BoundedQueue(size_t capacity)
+      : capacity_(capacity > 0 ? capacity : 1) {}
+  ~BoundedQueue() { Clear(); }
+
+  // 队列已关闭时返回 false，此时 item 的所有权仍归调用方
+  // wait_time 不为空时累加阻塞等待的时间，单位微秒
+  bool Push(T item, int64_t *wait_time = nullptr) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    Wait(not_full_, lock,
+         [this] { return closed_ || items_.size() < capacity_; }, wait_time);
+    if (closed_) {
+      return false;
+    }
+    items_.push_back(item);
+    not_empty_.notify_one();
+    return true;
+  }
+  // 队列为空且已关闭时返回 false
+  bool Pop(T *item, int64_t *wait_time = nullptr) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    Wait(not_empty_, lock, [this] { return closed_ || !items_.empty(); },
+         wait_time);
+    return PopLocked(item);
+  }
+  // 最多等待 timeout 微秒，超时或者队列为空且已关闭时返回 false
+  bool PopFor(T *item, int64_t timeout) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    not_empty_.wait_for(lock, std::chrono::microseconds(timeout),
+                        [this] { return closed_ || !items_.empty(); });
+    return PopLocked(item);
+  }
+  // 不阻塞，队列为空时立即返回 false
+  bool TryPop(T *item) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return PopLocked(item);
+  }
+  // 不再接受新数据，已入队的数据仍可以取出
+  void Close() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    closed_ = true;
+    not_full_.notify_all();
+    not_empty_.notify_all();
+  }
+  // 丢弃所有未处理的数据
+  void Clear() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto &item : items_) {
+      ReleaseQueueItem(item);
+    }
+    items_.clear();
+    not_full_.notify_all();
+  }
+
+  bool IsClosed() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return closed_;
+  }
+  bool IsDrained() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return closed_ && items_.empty();
+  }
+  size_t Size() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return items_.size();
+  }
+  size_t Capacity() const { return capacity_; }
+
+ private:
+  template <typename Pred>
+  static void Wait(std::condition_variable &cv,
+                   std::unique_lock<std::mutex> &lock, Pred pred,
+                   int64_t *wait_time) {
+    if (pred()) {
+      return;
+    }
+    int64_t start = wait_time ? av_gettime_relative() : 0;
+    cv.wait(lock, pred);
+    if (wait_time) {
+      *wait_time += av_gettime_relative() - start;
+    }
+  }
+  bool PopLocked(T *item) {
+    if (items_.empty()) {
+      return false;
+    }
+    *item = items_.front();
+    items_.pop_front();
+    not_full_.notify_one();
+    return true;
+  }
+
+ private:
+  const size_t capacity_;
+  std::deque<T> items_;
+  bool closed_{false};
+  mutable std::mutex mutex_;
+  std::condition_variable not_full_;
+  std::condition_variable not_empty_;
+
+ private:
+  BoundedQueue(const BoundedQueue &) = delete;
+  BoundedQueue &operator=(const BoundedQueue &) = delete;
+};
@@ -0,0 +1,51 @@
+#include "ffmpeg_preview_decode.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "libavutil/common.h"
+#include "libavutil/opt.h"
+
+#ifdef __cplusplus
+}
+#endif
+
+#include <cmath>
+
+void FitThumbnailSize(int width, int height, int max_width, int max_height,
+                      int *thumb_width, int *thumb_height) {
+  double scale = 1.0;
+  if (max_width > 0 && width > max_width) {
+    scale = FFMIN(scale, static_cast<double>(max_width) / width);
+  }
+  if (max_height > 0 && height > max_height) {
+    scale = FFMIN(scale, static_cast<double>(max_height) / height);
+  }
+  *thumb_width = FFMAX(static_cast<int>(lrint(width * scale)), 1);
+  *thumb_height = FFMAX(static_cast<int>(lrint(height * scale)), 1);
+}
+
+void SetPreviewDecoding(AVCodecContext *dec_ctx, const AVCodec *dec,
+                        int thumb_width, int thumb_height) {
+  dec_ctx->skip_frame = AVDISCARD_NONKEY;
+  dec_ctx->skip_loop_filter = AVDISCARD_ALL;
+  dec_ctx->flags2 |= AV_CODEC_FLAG2_FAST;
+  int lowres = 0;
+  while (lowres < dec->max_lowres &&
+         (dec_ctx->width >> (lowres + 1)) >= thumb_width &&
+         (dec_ctx->height >> (lowres + 1)) >= thumb_height) {
+    lowres++;
+  }
+  if (lowres > 0) {
+    av_opt_set_int(dec_ctx, "lowres", lowres, 0);
+  }
+}
+
+void SetPreviewDiscard(AVFormatContext *fmt_ctx, int video_stream_idx) {
+  for (unsigned int i = 0; i < fmt_ctx->nb_streams; i++) {
+    fmt_ctx->streams[i]->discard = static_cast<int>(i) == video_stream_idx
+                                       ? AVDISCARD_NONKEY
+                                       : AVDISCARD_ALL;
+  }
+}
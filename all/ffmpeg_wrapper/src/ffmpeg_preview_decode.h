@@ -0,0 +1,28 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "libavcodec/avcodec.h"
+#include "libavformat/avformat.h"
+
+#ifdef __cplusplus
+}
+#endif
+
+// 截图的预览模式，ffmpeg_wrapper 和 transcoder_client 的 VideoInfoCapture
+// 共用，只依赖 FFmpeg
+
+// 按比例缩小到 max_width x max_height 以内，不放大，0 表示不限制
+void FitThumbnailSize(int width, int height, int max_width, int max_height,
+                      int *thumb_width, int *thumb_height);
+
+// 预览解码：只解关键帧，跳过环路滤波；解码器支持 lowres 时，
+// 在不小于缩略图的前提下尽量降低解码输出的分辨率
+// 在 avcodec_open2 之前调用
+void SetPreviewDecoding(AVCodecContext *dec_ctx, const AVCodec *dec,
+                        int thumb_width, int thumb_height);
+
+// 预览时解封装就丢掉非关键帧和其它流的数据包
+void SetPreviewDiscard(AVFormatContext *fmt_ctx, int video_stream_idx);
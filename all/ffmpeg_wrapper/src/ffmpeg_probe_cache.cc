@@ -0,0 +1,528 @@
+#include "ffmpeg_probe_cache.h"
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <random>
+
+namespace {
+
+constexpr int kProbeFileVersion = 1;
+// 内容哈希只读开头和结尾，避免大文件整个读一遍
+constexpr int64_t kHashChunkSize = 64 * 1024;
+// 磁盘缓存可能损坏或被改写，读到的数量超过这个时当作无效
+// （FFmpeg 默认的 max_streams 是 1000）
+constexpr size_t kMaxStreams = 1000;
+// 每个关键帧至少占一个数字和一个换行
+constexpr size_t kMinKeyframeBytes = 2;
+
+// 读写磁盘缓存时流参数的顺序，加字段时在末尾追加并增加 kProbeFileVersion
+std::vector<int64_t *> StreamFields(ProbeStream *s) {
+  return {&s->codec_type,           &s->codec_id,
+          &s->codec_tag,            &s->format,
+          &s->bit_rate,             &s->bits_per_coded_sample,
+          &s->bits_per_raw_sample,  &s->profile,
+          &s->level,                &s->width,
+          &s->height,               &s->sar_num,
+          &s->sar_den,              &s->field_order,
+          &s->color_range,          &s->color_primaries,
+          &s->color_trc,            &s->color_space,
+          &s->chroma_location,      &s->video_delay,
+          &s->sample_rate,          &s->channels,
+          &s->channel_mask,         &s->frame_size,
+          &s->initial_padding,      &s->extradata_size,
+          &s->avg_frame_rate_num,   &s->avg_frame_rate_den,
+          &s->r_frame_rate_num,     &s->r_frame_rate_den,
+          &s->start_time,           &s->duration,
+          &s->nb_frames};
+}
+
+// FNV-1a
+void HashBytes(const uint8_t *data, size_t size, uint64_t *hash) {
+  for (size_t i = 0; i < size; i++) {
+    *hash ^= data[i];
+    *hash *= 0x100000001b3ULL;
+  }
+}
+
+// 临时文件名：进程的随机标识加进程内的序号，多个进程或线程同时写
+// 同一个缓存文件时不会写到同一个临时文件
+std::string UniqueTempPath(const std::string &path) {
+  static const uint64_t process_tag =
+      (static_cast<uint64_t>(std::random_device()()) << 32) ^
+      std::random_device()();
+  static std::atomic<uint64_t> sequence{0};
+  char suffix[48];
+  snprintf(suffix, sizeof(suffix), ".%016" PRIx64 ".%" PRIu64 ".tmp",
+           process_tag, sequence++);
+  return path + suffix;
+}
+
+bool HashContent(const std::string &path, int64_t size, uint64_t *hash) {
+  FILE *f = fopen(path.c_str(), "rb");
+  if (!f) {
+    return false;
+  }
+  *hash = 0xcbf29ce484222325ULL;
+  std::vector<uint8_t> buf(kHashChunkSize);
+  size_t n = fread(buf.data(), 1, buf.size(), f);
+  HashBytes(buf.data(), n, hash);
+  if (size > kHashChunkSize * 2) {
+    n = 0;
+    if (fseek(f, static_cast<long>(-kHashChunkSize), SEEK_END) == 0) {
+      n = fread(buf.data(), 1, buf.size(), f);
+    }
+    HashBytes(buf.data(), n, hash);
+  }
+  fclose(f);
+  return true;
+}
+
+void FillProbeInfo(const AVFormatContext *ic, bool header_complete,
+                   ProbeInfo *info) {
+  info->duration = ic->duration;
+  info->start_time = ic->start_time;
+  info->bit_rate = ic->bit_rate;
+  info->header_complete = header_complete;
+  info->streams.clear();
+  for (unsigned int i = 0; i < ic->nb_streams; i++) {
+    const AVStream *st = ic->streams[i];
+    const AVCodecParameters *par = st->codecpar;
+    ProbeStream s;
+    s.codec_type = par->codec_type;
+    s.codec_id = par->codec_id;
+    s.codec_tag = par->codec_tag;
+    s.format = par->format;
+    s.bit_rate = par->bit_rate;
+    s.bits_per_coded_sample = par->bits_per_coded_sample;
+    s.bits_per_raw_sample = par->bits_per_raw_sample;
+    s.profile = par->profile;
+    s.level = par->level;
+    s.width = par->width;
+    s.height = par->height;
+    s.sar_num = par->sample_aspect_ratio.num;
+    s.sar_den = par->sample_aspect_ratio.den;
+    s.field_order = par->field_order;
+    s.color_range = par->color_range;
+    s.color_primaries = par->color_primaries;
+    s.color_trc = par->color_trc;
+    s.color_space = par->color_space;
+    s.chroma_location = par->chroma_location;
+    s.video_delay = par->video_delay;
+    s.sample_rate = par->sample_rate;
+    s.channels = par->ch_layout.nb_channels;
+    s.channel_mask = par->ch_layout.order == AV_CHANNEL_ORDER_NATIVE
+                         ? static_cast<int64_t>(par->ch_layout.u.mask)
+                         : 0;
+    s.frame_size = par->frame_size;
+    s.initial_padding = par->initial_padding;
+    s.extradata_size = par->extradata_size;
+    s.avg_frame_rate_num = st->avg_frame_rate.num;
+    s.avg_frame_rate_den = st->avg_frame_rate.den;
+    s.r_frame_rate_num = st->r_frame_rate.num;
+    s.r_frame_rate_den = st->r_frame_rate.den;
+    s.start_time = st->start_time;
+    s.duration = st->duration;
+    s.nb_frames = st->nb_frames;
+    info->streams.push_back(s);
+  }
+}
+
+// 流的布局和头部给出的参数与缓存一致时，补上 avformat_find_stream_info
+// 才能得到的参数；不一致时不修改 ic，返回 false
+bool ApplyProbeInfo(const ProbeInfo &info, AVFormatContext *ic) {
+  if (!info.header_complete || (ic->ctx_flags & AVFMTCTX_NOHEADER) ||
+      info.streams.size() != ic->nb_streams) {
+    return false;
+  }
+  for (unsigned int i = 0; i < ic->nb_streams; i++) {
+    const ProbeStream &s = info.streams[i];
+    const AVCodecParameters *par = ic->streams[i]->codecpar;
+    if (s.codec_type != par->codec_type || s.codec_id != par->codec_id ||
+        s.extradata_size != par->extradata_size || s.width != par->width ||
+        s.height != par->height || s.sample_rate != par->sample_rate ||
+        s.channels != par->ch_layout.nb_channels) {
+      return false;
+    }
+  }
+
+  for (unsigned int i = 0; i < ic->nb_streams; i++) {
+    const ProbeStream &s = info.streams[i];
+    AVStream *st = ic->streams[i];
+    AVCodecParameters *par = st->codecpar;
+    par->format = static_cast<int>(s.format);
+    if (!par->bit_rate) {
+      par->bit_rate = s.bit_rate;
+    }
+    par->bits_per_coded_sample = static_cast<int>(s.bits_per_coded_sample);
+    par->bits_per_raw_sample = static_cast<int>(s.bits_per_raw_sample);
+    par->profile = static_cast<int>(s.profile);
+    par->level = static_cast<int>(s.level);
+    par->sample_aspect_ratio = {static_cast<int>(s.sar_num),
+                                static_cast<int>(s.sar_den)};
+    par->field_order = static_cast<AVFieldOrder>(s.field_order);
+    par->color_range = static_cast<AVColorRange>(s.color_range);
+    par->color_primaries = static_cast<AVColorPrimaries>(s.color_primaries);
+    par->color_trc = static_cast<AVColorTransferCharacteristic>(s.color_trc);
+    par->color_space = static_cast<AVColorSpace>(s.color_space);
+    par->chroma_location = static_cast<AVChromaLocation>(s.chroma_location);
+    par->video_delay = static_cast<int>(s.video_delay);
+    if (s.channel_mask && par->ch_layout.order != AV_CHANNEL_ORDER_NATIVE) {
+      av_channel_layout_uninit(&par->ch_layout);
+      av_channel_layout_from_mask(&par->ch_layout, s.channel_mask);
+    }
+    par->frame_size = static_cast<int>(s.frame_size);
+    par->initial_padding = static_cast<int>(s.initial_padding);
+    if (!st->avg_frame_rate.num) {
+      st->avg_frame_rate = {static_cast<int>(s.avg_frame_rate_num),
+                            static_cast<int>(s.avg_frame_rate_den)};
+    }
+    if (!st->r_frame_rate.num) {
+      st->r_frame_rate = {static_cast<int>(s.r_frame_rate_num),
+                          static_cast<int>(s.r_frame_rate_den)};
+    }
+    if (st->start_time == AV_NOPTS_VALUE) {
+      st->start_time = s.start_time;
+    }
+    if (st->duration == AV_NOPTS_VALUE) {
+      st->duration = s.duration;
+    }
+    if (!st->nb_frames) {
+      st->nb_frames = s.nb_frames;
+    }
+  }
+  if (ic->duration == AV_NOPTS_VALUE) {
+    ic->duration = info.duration;
+  }
+  if (ic->start_time == AV_NOPTS_VALUE) {
+    ic->start_time = info.start_time;
+  }
+  if (!ic->bit_rate) {
+    ic->bit_rate = info.bit_rate;
+  }
+  return true;
+}
+
+// avformat_find_stream_info 之前头部给出的参数
+struct HeaderStream {
+  AVCodecID codec_id;
+  int extradata_size;
+  int width;
+  int height;
+  int sample_rate;
+  int channels;
+};
+
+bool IsHeaderComplete(const AVFormatContext *ic,
+                      const std::vector<HeaderStream> &header) {
+  if ((ic->ctx_flags & AVFMTCTX_NOHEADER) ||
+      header.size() != ic->nb_streams) {
+    return false;
+  }
+  for (unsigned int i = 0; i < ic->nb_streams; i++) {
+    const HeaderStream &h = header[i];
+    const AVCodecParameters *par = ic->streams[i]->codecpar;
+    if (h.codec_id == AV_CODEC_ID_NONE || h.codec_id != par->codec_id ||
+        h.extradata_size != par->extradata_size) {
+      return false;
+    }
+    if (par->codec_type == AVMEDIA_TYPE_VIDEO &&
+        (h.width <= 0 || h.width != par->width || h.height != par->height)) {
+      return false;
+    }
+    if (par->codec_type == AVMEDIA_TYPE_AUDIO &&
+        (h.sample_rate <= 0 || h.sample_rate != par->sample_rate ||
+         h.channels != par->ch_layout.nb_channels)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+}  // namespace
+
+ProbeCache &ProbeCache::Instance() {
+  static ProbeCache cache;
+  return cache;
+}
+
+void ProbeCache::SetOptions(const std::string &directory, bool content_hash) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  directory_ = directory;
+  if (content_hash_ != content_hash) {
+    // 键的格式变了，原来的条目不会再命中
+    entries_.clear();
+    lru_.clear();
+  }
+  content_hash_ = content_hash;
+  if (!directory_.empty()) {
+    std::error_code ec;
+    std::filesystem::create_directories(directory_, ec);
+  }
+}
+
+bool ProbeCache::MakeKey(const std::string &path, std::string *key) const {
+  std::error_code ec;
+  std::filesystem::path file(path);
+  if (!std::filesystem::is_regular_file(file, ec)) {
+    return false;
+  }
+  auto size = std::filesystem::file_size(file, ec);
+  if (ec) {
+    return false;
+  }
+  auto mtime = std::filesystem::last_write_time(file, ec);
+  if (ec) {
+    return false;
+  }
+  auto absolute = std::filesystem::absolute(file, ec);
+  *key = (ec ? file : absolute).generic_string() + "|" +
+         std::to_string(size) + "|" +
+         std::to_string(mtime.time_since_epoch().count());
+
+  bool content_hash = false;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    content_hash = content_hash_;
+  }
+  if (content_hash) {
+    uint64_t hash = 0;
+    if (!HashContent(path, static_cast<int64_t>(size), &hash)) {
+      return false;
+    }
+    char hex[17];
+    snprintf(hex, sizeof(hex), "%016" PRIx64, hash);
+    *key += "|";
+    *key += hex;
+  }
+  return true;
+}
+
+bool ProbeCache::Lookup(const std::string &key, ProbeInfo *info) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = entries_.find(key);
+    if (it != entries_.end()) {
+      lru_.splice(lru_.begin(), lru_, it->second);
+      *info = it->second->second;
+      hits_++;
+      return true;
+    }
+  }
+  if (Load(key, info)) {
+    Insert(key, *info);
+    hits_++;
+    return true;
+  }
+  misses_++;
+  return false;
+}
+
+void ProbeCache::Store(const std::string &key, const ProbeInfo &info) {
+  ProbeInfo merged = info;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = entries_.find(key);
+    if (it != entries_.end() && it->second->second.has_keyframes &&
+        !merged.has_keyframes) {
+      merged.has_keyframes = true;
+      merged.keyframes = it->second->second.keyframes;
+    }
+  }
+  Insert(key, merged);
+  Save(key, merged);
+}
+
+void ProbeCache::StoreKeyframes(const std::string &key,
+                                const std::vector<int64_t> &keyframes) {
+  ProbeInfo info;
+  bool found = false;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = entries_.find(key);
+    if (it != entries_.end()) {
+      info = it->second->second;
+      found = true;
+    }
+  }
+  if (!found) {
+    Load(key, &info);
+  }
+  info.has_keyframes = true;
+  info.keyframes = keyframes;
+  Insert(key, info);
+  Save(key, info);
+}
+
+void ProbeCache::Insert(const std::string &key, const ProbeInfo &info) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = entries_.find(key);
+  if (it != entries_.end()) {
+    it->second->second = info;
+    lru_.splice(lru_.begin(), lru_, it->second);
+    return;
+  }
+  if (lru_.size() >= kMaxEntries) {
+    entries_.erase(lru_.back().first);
+    lru_.pop_back();
+  }
+  lru_.emplace_front(key, info);
+  entries_[key] = lru_.begin();
+}
+
+std::string ProbeCache::FilePath(const std::string &key) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (directory_.empty()) {
+    return std::string();
+  }
+  char name[32];
+  snprintf(name, sizeof(name), "%016" PRIx64 ".probe",
+           static_cast<uint64_t>(std::hash<std::string>()(key)));
+  return directory_ + "/" + name;
+}
+
+bool ProbeCache::Load(const std::string &key, ProbeInfo *info) const {
+  std::string path = FilePath(key);
+  if (path.empty()) {
+    return false;
+  }
+  std::error_code ec;
+  auto file_size = std::filesystem::file_size(path, ec);
+  if (ec) {
+    return false;
+  }
+  FILE *f = fopen(path.c_str(), "rb");
+  if (!f) {
+    return false;
+  }
+  bool ok = false;
+  do {
+    int version = 0;
+    if (fscanf(f, "probe %d\n", &version) != 1 ||
+        version != kProbeFileVersion) {
+      break;
+    }
+    // 第二行是完整的键，文件名哈希冲突时不会用错
+    std::string line(key.size() + 2, '\0');
+    if (!fgets(&line[0], static_cast<int>(line.size()), f) ||
+        strncmp(line.c_str(), key.c_str(), key.size()) ||
+        line[key.size()] != '\n') {
+      break;
+    }
+    ProbeInfo loaded;
+    int header_complete = 0;
+    int has_keyframes = 0;
+    size_t nb_streams = 0;
+    size_t nb_keyframes = 0;
+    if (fscanf(f, "%" SCNd64 " %" SCNd64 " %" SCNd64 " %d %zu",
+               &loaded.duration, &loaded.start_time, &loaded.bit_rate,
+               &header_complete, &nb_streams) != 5 ||
+        nb_streams > kMaxStreams) {
+      break;
+    }
+    loaded.header_complete = header_complete != 0;
+    bool streams_ok = true;
+    for (size_t i = 0; i < nb_streams && streams_ok; i++) {
+      ProbeStream s;
+      for (int64_t *field : StreamFields(&s)) {
+        if (fscanf(f, "%" SCNd64, field) != 1) {
+          streams_ok = false;
+          break;
+        }
+      }
+      loaded.streams.push_back(s);
+    }
+    if (!streams_ok ||
+        fscanf(f, "%d %zu", &has_keyframes, &nb_keyframes) != 2 ||
+        nb_keyframes > file_size / kMinKeyframeBytes) {
+      break;
+    }
+    loaded.has_keyframes = has_keyframes != 0;
+    // 边读边追加，数量与内容不符时不会先分配一大块内存
+    for (size_t i = 0; i < nb_keyframes; i++) {
+      int64_t pts = 0;
+      if (fscanf(f, "%" SCNd64, &pts) != 1) {
+        break;
+      }
+      loaded.keyframes.push_back(pts);
+    }
+    if (loaded.keyframes.size() != nb_keyframes) {
+      break;
+    }
+    *info = std::move(loaded);
+    ok = true;
+  } while (false);
+  fclose(f);
+  return ok;
+}
+
+void ProbeCache::Save(const std::string &key, const ProbeInfo &info) const {
+  std::string path = FilePath(key);
+  if (path.empty()) {
+    return;
+  }
+  // 先写临时文件再改名，其它进程不会读到写了一半的文件
+  std::string temp_path = UniqueTempPath(path);
+  FILE *f = fopen(temp_path.c_str(), "wb");
+  if (!f) {
+    AvLog(nullptr, AV_LOG_WARNING, "Cannot write probe cache %s: %s\n",
+          temp_path.c_str(), strerror(errno));
+    return;
+  }
+  fprintf(f, "probe %d\n%s\n", kProbeFileVersion, key.c_str());
+  fprintf(f, "%" PRId64 " %" PRId64 " %" PRId64 " %d %zu\n", info.duration,
+          info.start_time, info.bit_rate, info.header_complete ? 1 : 0,
+          info.streams.size());
+  for (const ProbeStream &stream : info.streams) {
+    ProbeStream s = stream;
+    for (int64_t *field : StreamFields(&s)) {
+      fprintf(f, "%" PRId64 " ", *field);
+    }
+    fprintf(f, "\n");
+  }
+  fprintf(f, "%d %zu\n", info.has_keyframes ? 1 : 0, info.keyframes.size());
+  for (int64_t pts : info.keyframes) {
+    fprintf(f, "%" PRId64 "\n", pts);
+  }
+  bool ok = fclose(f) == 0;
+  std::error_code ec;
+  if (ok) {
+    std::filesystem::rename(temp_path, path, ec);
+  }
+  if (!ok || ec) {
+    std::filesystem::remove(temp_path, ec);
+  }
+}
+
+int FindStreamInfoCached(AVFormatContext *ic, const std::string &filename,
+                         AVDictionary **options) {
+  ProbeCache &cache = ProbeCache::Instance();
+  std::string key;
+  bool cacheable = cache.MakeKey(filename, &key);
+  if (cacheable) {
+    ProbeInfo info;
+    if (cache.Lookup(key, &info) && ApplyProbeInfo(info, ic)) {
+      AvLog(nullptr, AV_LOG_VERBOSE, "%s: using cached stream info\n",
+            filename.c_str());
+      return 0;
+    }
+  }
+
+  std::vector<HeaderStream> header;
+  for (unsigned int i = 0; i < ic->nb_streams; i++) {
+    const AVCodecParameters *par = ic->streams[i]->codecpar;
+    header.push_back({par->codec_id, par->extradata_size, par->width,
+                      par->height, par->sample_rate,
+                      par->ch_layout.nb_channels});
+  }
+  int ret = avformat_find_stream_info(ic, options);
+  if (ret >= 0 && cacheable) {
+    ProbeInfo info;
+    FillProbeInfo(ic, IsHeaderComplete(ic, header), &info);
+    cache.Store(key, info);
+  }
+  return ret;
+}
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "ffmpeg_util.h"
+
+// 一个流的探测结果，都存成整数，方便按固定顺序读写
+struct ProbeStream {
+  int64_t codec_type{AVMEDIA_TYPE_UNKNOWN};
+  int64_t codec_id{AV_CODEC_ID_NONE};
+  int64_t codec_tag{0};
+  int64_t format{-1};
+  int64_t bit_rate{0};
+  int64_t bits_per_coded_sample{0};
+  int64_t bits_per_raw_sample{0};
+  int64_t profile{FF_PROFILE_UNKNOWN};
+  int64_t level{FF_LEVEL_UNKNOWN};
+  int64_t width{0};
+  int64_t height{0};
+  int64_t sar_num{0};
+  int64_t sar_den{1};
+  int64_t field_order{AV_FIELD_UNKNOWN};
+  int64_t color_range{AVCOL_RANGE_UNSPECIFIED};
+  int64_t color_primaries{AVCOL_PRI_UNSPECIFIED};
+  int64_t color_trc{AVCOL_TRC_UNSPECIFIED};
+  int64_t color_space{AVCOL_SPC_UNSPECIFIED};
+  int64_t chroma_location{AVCHROMA_LOC_UNSPECIFIED};
+  int64_t video_delay{0};
+  int64_t sample_rate{0};
+  int64_t channels{0};
+  int64_t channel_mask{0};  // 不是按声道掩码描述的布局时为 0
+  int64_t frame_size{0};
+  int64_t initial_padding{0};
+  int64_t extradata_size{0};
+  int64_t avg_frame_rate_num{0};
+  int64_t avg_frame_rate_den{1};
+  int64_t r_frame_rate_num{0};
+  int64_t r_frame_rate_den{1};
+  int64_t start_time{AV_NOPTS_VALUE};  // 流的时间基
+  int64_t duration{AV_NOPTS_VALUE};    // 流的时间基
+  int64_t nb_frames{0};
+};
+
+// 一个文件的探测结果
+struct ProbeInfo {
+  int64_t duration{AV_NOPTS_VALUE};  // 微秒
+  int64_t start_time{AV_NOPTS_VALUE};
+  int64_t bit_rate{0};
+  std::vector<ProbeStream> streams;
+  // 打开文件后头部就给出了所有流和参数，avformat_find_stream_info
+  // 只是补充解码才能得到的参数（像素格式、帧率等），可以用缓存代替
+  bool header_complete{false};
+  // 整个文件视频关键帧的 pts，相对文件开始，微秒
+  bool has_keyframes{false};
+  std::vector<int64_t> keyframes;
+};
+
+// 探测结果缓存，进程内共享，线程安全
+// 按（路径，大小，修改时间[，开头和结尾各 64KB 的哈希]）区分文件，
+// 文件改动后自然失效；设置了目录时同时存到磁盘，进程重启或者
+// 其它进程也可以用
+class ProbeCache {
+ public:
+  static constexpr size_t kMaxEntries = 1024;
+
+  static ProbeCache &Instance();
+
+  // directory 为空时只在内存中缓存
+  void SetOptions(const std::string &directory, bool content_hash);
+  // 只缓存本地的普通文件，其它返回 false
+  bool MakeKey(const std::string &path, std::string *key) const;
+  bool Lookup(const std::string &key, ProbeInfo *info);
+  // 已缓存的关键帧不会被没有关键帧的结果覆盖
+  void Store(const std::string &key, const ProbeInfo &info);
+  void StoreKeyframes(const std::string &key,
+                      const std::vector<int64_t> &keyframes);
+
+  int64_t hits() const { return hits_; }
+  int64_t misses() const { return misses_; }
+
+ private:
+  ProbeCache() = default;
+  std::string FilePath(const std::string &key) const;
+  bool Load(const std::string &key, ProbeInfo *info) const;
+  void Save(const std::string &key, const ProbeInfo &info) const;
+  void Insert(const std::string &key, const ProbeInfo &info);
+
+  mutable std::mutex mutex_;
+  std::string directory_;
+  bool content_hash_{false};
+  // 最近用过的在前面，超出 kMaxEntries 时丢掉最后一个
+  std::list<std::pair<std::string, ProbeInfo>> lru_;
+  std::unordered_map<std::string,
+                     std::list<std::pair<std::string, ProbeInfo>>::iterator>
+      entries_;
+  std::atomic<int64_t> hits_{0};
+  std::atomic<int64_t> misses_{0};
+};
+
+// 代替 avformat_find_stream_info：缓存中有头部完整的结果并且与刚打开的
+// 流一致时直接套用，不再读取和解码；否则探测后写入缓存
+// filename 不是本地文件（自定义输入、网络流等）时等同于
+// avformat_find_stream_info
+int FindStreamInfoCached(AVFormatContext *ic, const std::string &filename,
+                         AVDictionary **options);
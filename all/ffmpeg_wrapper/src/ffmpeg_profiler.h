@@ -0,0 +1,155 @@
+#pragma once
+
+#include <atomic>
+#include <bit>
+#include <string>
+
+#include "ffmpeg_util.h"
+#include "ffmpeg_wrapper/video_converter.h"
+
+enum ProfileStage {
+  kDemuxStage,
+  kDecodeStage,
+  kFilterStage,
+  kEncodeStage,
+  kMuxStage,
+  kStageCount,
+};
+
+// 一个阶段的耗时统计，每个阶段只在一个线程上记录，但可以在其它线程上读取，
+// 所以计数都用 relaxed 原子变量
+class StageProfiler {
+ public:
+  void Record(int64_t elapsed, int64_t frames, int64_t bytes) {
+    calls_.fetch_add(1, std::memory_order_relaxed);
+    frames_.fetch_add(frames, std::memory_order_relaxed);
+    bytes_.fetch_add(bytes, std::memory_order_relaxed);
+    total_time_.fetch_add(elapsed, std::memory_order_relaxed);
+    buckets_[BucketIndex(elapsed)].fetch_add(1, std::memory_order_relaxed);
+  }
+  void AddBlockedTime(int64_t t) {
+    blocked_time_.fetch_add(t, std::memory_order_relaxed);
+  }
+
+  void Collect(VideoConverter::StageStats *stats) const {
+    stats->calls = calls_.load(std::memory_order_relaxed);
+    stats->frames = frames_.load(std::memory_order_relaxed);
+    stats->bytes = bytes_.load(std::memory_order_relaxed);
+    stats->total_time = total_time_.load(std::memory_order_relaxed);
+    stats->blocked_time = blocked_time_.load(std::memory_order_relaxed);
+
+    int64_t counts[kBuckets];
+    int64_t total = 0;
+    for (int i = 0; i < kBuckets; i++) {
+      counts[i] = buckets_[i].load(std::memory_order_relaxed);
+      total += counts[i];
+    }
+    stats->p50 = Percentile(counts, total, 50);
+    stats->p95 = Percentile(counts, total, 95);
+    stats->p99 = Percentile(counts, total, 99);
+  }
+
+ private:
+  // 对数分桶，每个 2 的幂区间再分 4 个桶，误差不超过 25%
+  static constexpr int kSubBuckets = 4;
+  static constexpr int kBuckets = 128;
+
+  static int BucketIndex(int64_t v) {
+    if (v < kSubBuckets) {
+      return v > 0 ? static_cast<int>(v) : 0;
+    }
+    int e = std::bit_width(static_cast<uint64_t>(v)) - 1;
+    int sub = static_cast<int>(v >> (e - 2)) - kSubBuckets;
+    int index = kSubBuckets + (e - 2) * kSubBuckets + sub;
+    return index < kBuckets ? index : kBuckets - 1;
+  }
+  // 桶的上界
+  static int64_t BucketValue(int index) {
+    if (index < kSubBuckets) {
+      return index;
+    }
+    int e = (index - kSubBuckets) / kSubBuckets + 2;
+    int sub = (index - kSubBuckets) % kSubBuckets;
+    return (static_cast<int64_t>(kSubBuckets + sub + 1) << (e - 2)) - 1;
+  }
+  static int64_t Percentile(const int64_t *counts, int64_t total, int p) {
+    if (total <= 0) {
+      return 0;
+    }
+    int64_t rank = (total * p + 99) / 100;
+    int64_t seen = 0;
+    for (int i = 0; i < kBuckets; i++) {
+      seen += counts[i];
+      if (seen >= rank) {
+        return BucketValue(i);
+      }
+    }
+    return BucketValue(kBuckets - 1);
+  }
+
+ private:
+  std::atomic<int64_t> calls_{0};
+  std::atomic<int64_t> frames_{0};
+  std::atomic<int64_t> bytes_{0};
+  std::atomic<int64_t> total_time_{0};
+  std::atomic<int64_t> blocked_time_{0};
+  std::atomic<int64_t> buckets_[kBuckets]{};
+};
+
+// 一路输入或输出流各阶段的统计
+// 输入流记录 demux/decode/filter（送入滤镜），
+// 输出流记录 filter（取出滤镜结果）/encode/mux
+struct StreamProfiler {
+  bool output{false};
+  int file_index{0};
+  int stream_index{0};
+  std::string media_type;
+  StageProfiler stages[kStageCount];
+};
+
+// 未开启统计时 profiler 为空，只多一次判断
+class ScopedStageTimer {
+ public:
+  ScopedStageTimer(StreamProfiler *profiler, ProfileStage stage)
+      : stage_(profiler ? &profiler->stages[stage] : nullptr),
+        start_(stage_ ? av_gettime_relative() : 0) {}
+  ~ScopedStageTimer() {
+    if (stage_) {
+      int64_t end = paused_at_ ? paused_at_ : av_gettime_relative();
+      stage_->Record(end - start_, frames_, bytes_);
+    }
+  }
+
+  void AddFrames(int64_t frames) { frames_ += frames; }
+  void AddBytes(int64_t bytes) { bytes_ += bytes; }
+  // 暂停期间的时间不计入这个阶段
+  void Pause() {
+    if (stage_) {
+      paused_at_ = av_gettime_relative();
+    }
+  }
+  void Resume() {
+    if (stage_ && paused_at_) {
+      start_ += av_gettime_relative() - paused_at_;
+      paused_at_ = 0;
+    }
+  }
+
+ private:
+  StageProfiler *stage_{nullptr};
+  int64_t start_{0};
+  int64_t paused_at_{0};
+  int64_t frames_{0};
+  int64_t bytes_{0};
+
+ private:
+  ScopedStageTimer(const ScopedStageTimer &) = delete;
+  ScopedStageTimer &operator=(const ScopedStageTimer &) = delete;
+};
+
+inline void AddBlockedTime(StreamProfiler *profiler, ProfileStage stage,
+                           int64_t t) {
+  if (profiler && t > 0) {
+    profiler->stages[stage].AddBlockedTime(t);
+  }
+}
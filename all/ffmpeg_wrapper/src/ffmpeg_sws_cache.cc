@@ -0,0 +1,50 @@
+#include "ffmpeg_sws_cache.h"
+
+SwsContextCache &SwsContextCache::Instance() {
+  static SwsContextCache cache;
+  return cache;
+}
+
+SwsContextCache::~SwsContextCache() {
+  for (auto &item : idle_) {
+    sws_freeContext(item.second);
+  }
+}
+
+SwsContext *SwsContextCache::Acquire(const SwsContextKey &key) {
+  SwsContext *reuse = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto it = idle_.begin(); it != idle_.end(); ++it) {
+      if (it->first == key) {
+        SwsContext *ctx = it->second;
+        idle_.erase(it);
+        hits_++;
+        return ctx;
+      }
+    }
+    misses_++;
+    if (idle_.size() >= kMaxIdle) {
+      reuse = idle_.back().second;
+      idle_.pop_back();
+    }
+  }
+  // 初始化比较耗时，不占着锁
+  return sws_getCachedContext(reuse, key.src_width, key.src_height,
+                              key.src_format, key.dst_width, key.dst_height,
+                              key.dst_format, key.flags, nullptr, nullptr,
+                              nullptr);
+}
+
+void SwsContextCache::Release(const SwsContextKey &key, SwsContext *ctx) {
+  SwsContext *evicted = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    idle_.emplace_front(key, ctx);
+    if (idle_.size() > kMaxIdle) {
+      evicted = idle_.back().second;
+      idle_.pop_back();
+    }
+  }
+  sws_freeContext(evicted);
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "libavutil/pixfmt.h"
+#include "libswscale/swscale.h"
+
+#ifdef __cplusplus
+}
+#endif
+
+#include <atomic>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <utility>
+
+// 缩放上下文的参数，相同参数的 SwsContext 可以复用
+struct SwsContextKey {
+  int src_width{0};
+  int src_height{0};
+  AVPixelFormat src_format{AV_PIX_FMT_NONE};
+  int dst_width{0};
+  int dst_height{0};
+  AVPixelFormat dst_format{AV_PIX_FMT_NONE};
+  int flags{0};
+
+  // 这个文件也编进 C++17 的 transcoder_client，不用 = default
+  bool operator==(const SwsContextKey &other) const {
+    return src_width == other.src_width && src_height == other.src_height &&
+           src_format == other.src_format && dst_width == other.dst_width &&
+           dst_height == other.dst_height && dst_format == other.dst_format &&
+           flags == other.flags;
+  }
+};
+
+// 进程内共享的 SwsContext 缓存，线程安全
+// SwsContext 不能多个线程同时使用，借出后只属于借用者，用完归还；
+// 空闲的上下文最多保留 kMaxIdle 个，超出时回收最久未用的，
+// 交给 sws_getCachedContext 按新参数重建
+class SwsContextCache {
+ public:
+  static constexpr size_t kMaxIdle = 16;
+
+  static SwsContextCache &Instance();
+  ~SwsContextCache();
+
+  // 失败时返回空
+  SwsContext *Acquire(const SwsContextKey &key);
+  void Release(const SwsContextKey &key, SwsContext *ctx);
+
+  int64_t hits() const { return hits_; }
+  int64_t misses() const { return misses_; }
+
+ private:
+  SwsContextCache() = default;
+
+  std::mutex mutex_;
+  // 最近归还的在前面
+  std::list<std::pair<SwsContextKey, SwsContext *>> idle_;
+  std::atomic<int64_t> hits_{0};
+  std::atomic<int64_t> misses_{0};
+};
+
+// 在作用域内从缓存借用一个 SwsContext
+class ScopedSwsContext {
+ public:
+  explicit ScopedSwsContext(const SwsContextKey &key)
+      : key_(key), ctx_(SwsContextCache::Instance().Acquire(key)) {}
+  ~ScopedSwsContext() {
+    if (ctx_) {
+      SwsContextCache::Instance().Release(key_, ctx_);
+    }
+  }
+  ScopedSwsContext(const ScopedSwsContext &) = delete;
+  ScopedSwsContext &operator=(const ScopedSwsContext &) = delete;
+
+  SwsContext *get() const { return ctx_; }
+
+ private:
+  SwsContextKey key_;
+  SwsContext *ctx_{nullptr};
+};
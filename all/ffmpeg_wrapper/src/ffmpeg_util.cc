@@ -102,6 +102,18 @@ AVDictionary *filter_codec_opts(AVDictionary *opts, enum AVCodecID codec_id,
   return ret;
 }
 
+const AVCodec *FindVideoEncoder(const std::string &name) {
+  const AVCodec *codec = avcodec_find_encoder_by_name(name.c_str());
+  if (!codec) {
+    const AVCodecDescriptor *desc =
+        avcodec_descriptor_get_by_name(name.c_str());
+    if (desc) {
+      codec = avcodec_find_encoder(desc->id);
+    }
+  }
+  return codec;
+}
+
 AVDictionary **setup_find_stream_info_opts(AVFormatContext *s,
                                            AVDictionary *codec_opts) {
   int i;
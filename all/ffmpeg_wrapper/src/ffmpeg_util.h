@@ -17,6 +17,7 @@ extern "C" {
 #include "libavutil/pixfmt.h"
 #include "libavutil/rational.h"
 #include "libavutil/threadmessage.h"
+#include "libavutil/time.h"
 #include "libavutil/timestamp.h"
 #include "libswresample/swresample.h"
 
@@ -90,6 +91,9 @@ AVDictionary *filter_codec_opts(AVDictionary *opts, enum AVCodecID codec_id,
                                 AVFormatContext *s, AVStream *st,
                                 const AVCodec *codec);
 
+// 按编码器名或者编码格式名查找编码器，如 "libx264"、"h264"
+const AVCodec *FindVideoEncoder(const std::string &name);
+
 AVDictionary **setup_find_stream_info_opts(AVFormatContext *s,
                                            AVDictionary *codec_opts);
 
@@ -123,21 +127,32 @@ void AvLog(void *avcl, int log_level, const std::string &format, Args... args) {
 }
 
 namespace {
+// 返回的字符串在每个线程的环形缓冲区里，多个转码实例并发调用互不影响，
+// 同一条日志里调用多次也不会互相覆盖
+constexpr int kStrBufCount = 8;
+
+template <size_t Size>
+char *NextStrBuf() {
+  thread_local char bufs[kStrBufCount][Size];
+  thread_local int index = 0;
+  char *buf = bufs[index];
+  index = (index + 1) % kStrBufCount;
+  memset(buf, 0, Size);
+  return buf;
+}
+
 const char *AvErr2Str(int errnum) {
-  static char av_err_buf[AV_ERROR_MAX_STRING_SIZE] = {0};
-  memset(av_err_buf, 0, AV_ERROR_MAX_STRING_SIZE);
+  char *av_err_buf = NextStrBuf<AV_ERROR_MAX_STRING_SIZE>();
   av_make_error_string(av_err_buf, AV_ERROR_MAX_STRING_SIZE, errnum);
   return av_err_buf;
 }
 const char *AvTs2TimeStr(int64_t ts, AVRational *tb) {
-  static char av_str_buf[AV_TS_MAX_STRING_SIZE] = {0};
-  memset(av_str_buf, 0, AV_TS_MAX_STRING_SIZE);
+  char *av_str_buf = NextStrBuf<AV_TS_MAX_STRING_SIZE>();
   av_ts_make_time_string(av_str_buf, ts, tb);
   return av_str_buf;
 }
 const char *AvTs2Str(int64_t ts) {
-  static char av_str_buf[AV_TS_MAX_STRING_SIZE] = {0};
-  memset(av_str_buf, 0, AV_TS_MAX_STRING_SIZE);
+  char *av_str_buf = NextStrBuf<AV_TS_MAX_STRING_SIZE>();
   av_ts_make_string(av_str_buf, ts);
   return av_str_buf;
 }
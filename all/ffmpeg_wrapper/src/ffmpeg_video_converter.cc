@@ -50,6 +50,8 @@ extern "C" {
 }
 #endif
 
+#include "ffmpeg_custom_io.h"
+#include "ffmpeg_probe_cache.h"
 #include "ffmpeg_util.h"
 
 #if defined(WIN32)
@@ -66,52 +68,65 @@ namespace {
 const char *const forced_keyframes_const_names[] = {
     "n", "n_forced", "prev_forced_n", "prev_forced_t", "t", nullptr};
 
+// 流水线模式下各阶段队列的默认长度
+constexpr int kDefaultThreadQueueSize = 8;
+// 流式输入探测格式和流信息最多读的数据量和时长，默认值是 5MB 和 5 秒，
+// 管道输入要等这么多数据到达才开始转码
+constexpr int64_t kStreamingProbeSize = 64 * 1024;
+constexpr int64_t kStreamingAnalyzeDuration = 500000;
+// 未压缩的帧占用内存较大，编码队列不宜过长
+constexpr size_t kEncodeQueueSize = 4;
+constexpr size_t kMuxQueueSize = 64;
+// 封装队列满时加上正在处理的数据包
+constexpr size_t kPacketPoolSize = kMuxQueueSize + 16;
+
+// 单位微秒，输入返回 EAGAIN 又没有就绪通知时的重试间隔
+constexpr int64_t kInputRetryInterval = 10000;
+// 单位微秒，等待解封装线程通知的最长时间
+constexpr int64_t kMaxInputWait = 100000;
+
 }
 
 // hw
 namespace {
-int nb_hw_devices{0};
-HWDevice **hw_devices{nullptr};
-HWDevice *filter_hw_device{nullptr};
-
-HWDevice *hw_device_get_by_type(AVHWDeviceType type) {
+HWDevice *hw_device_get_by_type(HWDeviceList *hw, AVHWDeviceType type) {
   HWDevice *found = nullptr;
-  for (int i = 0; i < nb_hw_devices; i++) {
-    if (hw_devices[i]->type == type) {
+  for (int i = 0; i < hw->nb_hw_devices; i++) {
+    if (hw->hw_devices[i]->type == type) {
       if (found) {
         return nullptr;
       }
-      found = hw_devices[i];
+      found = hw->hw_devices[i];
     }
   }
   return found;
 }
 
-HWDevice *hw_device_get_by_name(const char *name) {
-  for (int i = 0; i < nb_hw_devices; i++) {
-    if (!strcmp(hw_devices[i]->name, name)) {
-      return hw_devices[i];
+HWDevice *hw_device_get_by_name(HWDeviceList *hw, const char *name) {
+  for (int i = 0; i < hw->nb_hw_devices; i++) {
+    if (!strcmp(hw->hw_devices[i]->name, name)) {
+      return hw->hw_devices[i];
     }
   }
   return nullptr;
 }
 
-HWDevice *hw_device_add(void) {
-  int err =
-      av_reallocp_array(&hw_devices, nb_hw_devices + 1, sizeof(*hw_devices));
+HWDevice *hw_device_add(HWDeviceList *hw) {
+  int err = av_reallocp_array(&hw->hw_devices, hw->nb_hw_devices + 1,
+                              sizeof(*hw->hw_devices));
   if (err) {
-    nb_hw_devices = 0;
+    hw->nb_hw_devices = 0;
     return nullptr;
   }
-  hw_devices[nb_hw_devices] =
+  hw->hw_devices[hw->nb_hw_devices] =
       static_cast<HWDevice *>(av_mallocz(sizeof(HWDevice)));
-  if (!hw_devices[nb_hw_devices]) {
+  if (!hw->hw_devices[hw->nb_hw_devices]) {
     return nullptr;
   }
-  return hw_devices[nb_hw_devices++];
+  return hw->hw_devices[hw->nb_hw_devices++];
 }
 
-char *hw_device_default_name(AVHWDeviceType type) {
+char *hw_device_default_name(HWDeviceList *hw, AVHWDeviceType type) {
   // Make an automatic name of the form "type%d".  We arbitrarily
   // limit at 1000 anonymous devices of the same type - there is
   // probably something else very wrong if you get to this limit.
@@ -125,7 +140,7 @@ char *hw_device_default_name(AVHWDeviceType type) {
   int index = 0;
   for (index = 0; index < index_limit; index++) {
     snprintf(name, index_pos + 4, "%s%d", type_name, index);
-    if (!hw_device_get_by_name(name)) break;
+    if (!hw_device_get_by_name(hw, name)) break;
   }
   if (index >= index_limit) {
     av_freep(&name);
@@ -134,7 +149,8 @@ char *hw_device_default_name(AVHWDeviceType type) {
   return name;
 }
 
-int hw_device_init_from_string(const char *arg, HWDevice **dev_out) {
+int hw_device_init_from_string(HWDeviceList *hw, const char *arg,
+                               HWDevice **dev_out) {
   // "type=name"
   // "type=name,key=value,key2=value2"
   // "type=name:device,key=value,key2=value2"
@@ -174,14 +190,14 @@ int hw_device_init_from_string(const char *arg, HWDevice **dev_out) {
       err = AVERROR(ENOMEM);
       goto fail;
     }
-    if (hw_device_get_by_name(name)) {
+    if (hw_device_get_by_name(hw, name)) {
       errmsg = "named device already exists";
       goto invalid;
     }
 
     p += 1 + k;
   } else {
-    name = hw_device_default_name(type);
+    name = hw_device_default_name(hw, type);
     if (!name) {
       err = AVERROR(ENOMEM);
       goto fail;
@@ -224,7 +240,7 @@ int hw_device_init_from_string(const char *arg, HWDevice **dev_out) {
   } else if (*p == '@') {
     // Derive from existing device.
 
-    src = hw_device_get_by_name(p + 1);
+    src = hw_device_get_by_name(hw, p + 1);
     if (!src) {
       errmsg = "invalid source device name";
       goto invalid;
@@ -251,7 +267,7 @@ int hw_device_init_from_string(const char *arg, HWDevice **dev_out) {
     goto invalid;
   }
 
-  dev = hw_device_add();
+  dev = hw_device_add(hw);
   if (!dev) {
     err = AVERROR(ENOMEM);
     goto fail;
@@ -283,13 +299,13 @@ fail:
   goto done;
 }
 
-int hw_device_init_from_type(enum AVHWDeviceType type, const char *device,
-                             HWDevice **dev_out) {
+int hw_device_init_from_type(HWDeviceList *hw, enum AVHWDeviceType type,
+                             const char *device, HWDevice **dev_out) {
   AVBufferRef *device_ref = nullptr;
   HWDevice *dev;
   int err;
 
-  char *name = hw_device_default_name(type);
+  char *name = hw_device_default_name(hw, type);
   if (!name) {
     err = AVERROR(ENOMEM);
     goto fail;
@@ -301,7 +317,7 @@ int hw_device_init_from_type(enum AVHWDeviceType type, const char *device,
     goto fail;
   }
 
-  dev = hw_device_add();
+  dev = hw_device_add(hw);
   if (!dev) {
     err = AVERROR(ENOMEM);
     goto fail;
@@ -322,17 +338,17 @@ fail:
   return err;
 }
 
-void hw_device_free_all(void) {
-  for (int i = 0; i < nb_hw_devices; i++) {
-    av_freep(&hw_devices[i]->name);
-    av_buffer_unref(&hw_devices[i]->device_ref);
-    av_freep(&hw_devices[i]);
+void hw_device_free_all(HWDeviceList *hw) {
+  for (int i = 0; i < hw->nb_hw_devices; i++) {
+    av_freep(&hw->hw_devices[i]->name);
+    av_buffer_unref(&hw->hw_devices[i]->device_ref);
+    av_freep(&hw->hw_devices[i]);
   }
-  av_freep(&hw_devices);
-  nb_hw_devices = 0;
+  av_freep(&hw->hw_devices);
+  hw->nb_hw_devices = 0;
 }
 
-HWDevice *hw_device_match_by_codec(const AVCodec *codec) {
+HWDevice *hw_device_match_by_codec(HWDeviceList *hw, const AVCodec *codec) {
   for (int i = 0;; i++) {
     const AVCodecHWConfig *config = avcodec_get_hw_config(codec, i);
     if (!config) {
@@ -341,14 +357,14 @@ HWDevice *hw_device_match_by_codec(const AVCodec *codec) {
     if (!(config->methods & AV_CODEC_HW_CONFIG_METHOD_HW_DEVICE_CTX)) {
       continue;
     }
-    HWDevice *dev = hw_device_get_by_type(config->device_type);
+    HWDevice *dev = hw_device_get_by_type(hw, config->device_type);
     if (dev) {
       return dev;
     }
   }
 }
 
-int hw_device_setup_for_decode(InputStream *ist) {
+int hw_device_setup_for_decode(HWDeviceList *hw, InputStream *ist) {
   const AVCodecHWConfig *config;
   enum AVHWDeviceType type;
   HWDevice *dev = nullptr;
@@ -356,13 +372,13 @@ int hw_device_setup_for_decode(InputStream *ist) {
   bool auto_device = false;
 
   if (ist->hwaccel_device) {
-    dev = hw_device_get_by_name(ist->hwaccel_device);
+    dev = hw_device_get_by_name(hw, ist->hwaccel_device);
     if (!dev) {
       if (ist->hwaccel_id == HWACCEL_AUTO) {
         auto_device = true;
       } else if (ist->hwaccel_id == HWACCEL_GENERIC) {
         type = ist->hwaccel_device_type;
-        err = hw_device_init_from_type(type, ist->hwaccel_device, &dev);
+        err = hw_device_init_from_type(hw, type, ist->hwaccel_device, &dev);
       } else {
         // This will be dealt with by API-specific initialisation
         // (using hwaccel_device), so nothing further needed here.
@@ -386,7 +402,7 @@ int hw_device_setup_for_decode(InputStream *ist) {
       auto_device = true;
     } else if (ist->hwaccel_id == HWACCEL_GENERIC) {
       type = ist->hwaccel_device_type;
-      dev = hw_device_get_by_type(type);
+      dev = hw_device_get_by_type(hw, type);
 
       // When "-qsv_device device" is used, an internal QSV device named
       // as "__qsv_device" is created. Another QSV device is created too
@@ -397,14 +413,14 @@ int hw_device_setup_for_decode(InputStream *ist) {
       // call hw_device_get_by_name("__qsv_device") to select the internal QSV
       // device.
       if (!dev && type == AV_HWDEVICE_TYPE_QSV) {
-        dev = hw_device_get_by_name("__qsv_device");
+        dev = hw_device_get_by_name(hw, "__qsv_device");
       }
 
       if (!dev) {
-        err = hw_device_init_from_type(type, nullptr, &dev);
+        err = hw_device_init_from_type(hw, type, nullptr, &dev);
       }
     } else {
-      dev = hw_device_match_by_codec(ist->dec);
+      dev = hw_device_match_by_codec(hw, ist->dec);
       if (!dev) {
         // No device for this codec, but not using generic hwaccel
         // and therefore may well not need one - ignore.
@@ -424,7 +440,7 @@ int hw_device_setup_for_decode(InputStream *ist) {
         break;
       }
       type = config->device_type;
-      dev = hw_device_get_by_type(type);
+      dev = hw_device_get_by_type(hw, type);
       if (dev) {
         AvLog(ist->dec_ctx, AV_LOG_INFO,
               "Using auto "
@@ -439,7 +455,7 @@ int hw_device_setup_for_decode(InputStream *ist) {
       }
       type = config->device_type;
       // Try to make a new device of this type.
-      err = hw_device_init_from_type(type, ist->hwaccel_device, &dev);
+      err = hw_device_init_from_type(hw, type, ist->hwaccel_device, &dev);
       if (err < 0) {
         // Can't make a device of this type.
         continue;
@@ -483,7 +499,7 @@ int hw_device_setup_for_decode(InputStream *ist) {
   return 0;
 }
 
-int hw_device_setup_for_encode(OutputStream *ost) {
+int hw_device_setup_for_encode(HWDeviceList *hw, OutputStream *ost) {
   const AVCodecHWConfig *config;
   HWDevice *dev = nullptr;
   AVBufferRef *frames_ref = nullptr;
@@ -519,7 +535,7 @@ int hw_device_setup_for_encode(OutputStream *ost) {
     }
 
     if (!dev && config->methods & AV_CODEC_HW_CONFIG_METHOD_HW_DEVICE_CTX) {
-      dev = hw_device_get_by_type(config->device_type);
+      dev = hw_device_get_by_type(hw, config->device_type);
     }
   }
 
@@ -589,23 +605,23 @@ int hwaccel_decode_init(AVCodecContext *avctx) {
   return 0;
 }
 
-int hw_device_setup_for_filter(FilterGraph *fg) {
+int hw_device_setup_for_filter(HWDeviceList *hw, FilterGraph *fg) {
   HWDevice *dev;
 
   // Pick the last hardware device if the user doesn't pick the device for
   // filters explicitly with the filter_hw_device option.
-  if (filter_hw_device) {
-    dev = filter_hw_device;
-  } else if (nb_hw_devices > 0) {
-    dev = hw_devices[nb_hw_devices - 1];
+  if (hw->filter_hw_device) {
+    dev = hw->filter_hw_device;
+  } else if (hw->nb_hw_devices > 0) {
+    dev = hw->hw_devices[hw->nb_hw_devices - 1];
 
-    if (nb_hw_devices > 1) {
+    if (hw->nb_hw_devices > 1) {
       AvLog(nullptr, AV_LOG_WARNING,
             "There are %d hardware devices. device "
             "%s of type %s is picked for filters by default. Set hardware "
             "device explicitly with the filter_hw_device option if device "
             "%s is not usable for filters.\n",
-            nb_hw_devices, dev->name, av_hwdevice_get_type_name(dev->type),
+            hw->nb_hw_devices, dev->name, av_hwdevice_get_type_name(dev->type),
             dev->name);
     }
   } else {
@@ -731,32 +747,69 @@ std::vector<std::string> FfmpegVideoConverter::AvailableFileFormats() {
 FfmpegVideoConverter::FfmpegVideoConverter(
     const VideoConverter::Request &request, VideoConverter::Delegate *delegate,
     VideoConverter::AsyncCallFuncType call_fun)
-    : BaseVideoConverter(request, delegate, call_fun) {
-  oo.format = request.output_file_format;
-  oo.vbitrate = request.output_video_bitrate;
-  oo.abitrate = request.output_audio_bitrate;
-  oo.codec_names.clear();
-  oo.codec_names.push_back({kVideoStream, -1, request.video_encoder});
-  oo.codec_names.push_back({kAudioStream, -1, request.audio_encoder});
+    : BaseVideoConverter(request, delegate, call_fun),
+      packet_pool_(kPacketPoolSize, &allocations_) {
+  if (request.outputs.empty()) {
+    VideoConverter::OutputSpec output;
+    output.output_file = request.output_file;
+    output.output_file_format = request.output_file_format;
+    output.video_encoder = request.video_encoder;
+    output.audio_encoder = request.audio_encoder;
+    output.output_video_width = request.output_video_width;
+    output.output_video_height = request.output_video_height;
+    output.output_video_bitrate = request.output_video_bitrate;
+    output.output_audio_bitrate = request.output_audio_bitrate;
+    outputs_.push_back(output);
+  } else {
+    outputs_ = request.outputs;
+    output_file_ = outputs_.front().output_file;
+  }
+  ApplyOutputSpec(outputs_.front());
+  // 开始时间用输入 seek 定位到前一个关键帧，只从关键帧开始解码，
+  // 再由 trim 滤镜精确裁掉开始时间之前的帧；作为输出选项时会从文件头
+  // 开始解封装和解码所有帧再丢弃
   if (request.output_video_start_time > 0) {
-    oo.start_time = request.output_video_start_time * 1000;
+    SetTimeWindow(request.output_video_start_time * 1000LL, INT64_MAX);
   }
   if (request.output_video_record_time > 0) {
-    oo.recording_time = request.output_video_record_time * 1000;
-  }
-  int w = request.output_video_width;
-  int h = request.output_video_height;
-  if (w > 0 || h > 0) {
-    oo.video_filters.clear();
-    std::stringstream ss;
-    ss << "scale=" << (w > 0 ? w : -1) << ":" << (h > 0 ? h : -1);
-    oo.video_filters = ss.str();
+    oo.recording_time = request.output_video_record_time * 1000LL;
   }
   auto threads = request.threads;
   if (threads > 0) {
     io.threads = threads;
     oo.threads = threads;
   }
+  // 滤镜图默认跟随编码器的线程数，不设置时 8K 缩小到 1080p 这类缩放
+  // 只用一个线程，会成为瓶颈
+  int filter_threads = request.filter_threads;
+  if (filter_threads <= 0) {
+    int budget = threads > 0
+                     ? threads
+                     : static_cast<int>(std::thread::hardware_concurrency());
+    filter_threads = FFMAX(1, budget / static_cast<int>(outputs_.size()));
+  }
+  filter_nbthreads = av_asprintf("%d", filter_threads);
+  filter_complex_nbthreads = filter_threads;
+  pipelined_ = request.pipelined;
+  profile_ = request.profile;
+  auto_stream_copy_ = request.auto_stream_copy;
+  io_source_ = request.input;
+  if (request.outputs.empty()) {
+    io_sink_ = request.output;
+  }
+  io_buffer_size_ = request.io_buffer_size;
+  oo.vpreset = request.video_preset;
+  oo.vcrf = request.video_crf;
+  content_adaptive_ = request.content_adaptive != 0;
+  streaming_input_ = request.streaming_input;
+  probe_cache_ = request.probe_cache;
+  if (request.thread_queue_size > 0) {
+    io.thread_queue_size = request.thread_queue_size;
+  }
+  streaming_format_ = request.streaming_format;
+  fragment_duration_ = FFMAX(request.fragment_duration, 1) * 1000LL;
+  progress_interval_ =
+      request.progress_rate > 0 ? 1000000 / request.progress_rate : -1;
 }
 
 FfmpegVideoConverter::~FfmpegVideoConverter() {
@@ -775,21 +828,57 @@ void FfmpegVideoConverter::Start() {
 }
 void FfmpegVideoConverter::Stop() {
   received_sigterm = true;
+  notify_input_ready();
   if (worker_) {
     worker_->join();
   }
 }
 
+void FfmpegVideoConverter::SetTimeWindow(int64_t start_time,
+                                         int64_t recording_time) {
+  io.start_time = start_time;
+  io.accurate_seek = true;
+  oo.start_time = AV_NOPTS_VALUE;
+  oo.recording_time = recording_time;
+}
+void FfmpegVideoConverter::DisableStreams(bool video, bool audio) {
+  oo.video_disable = video;
+  oo.audio_disable = audio;
+}
+void FfmpegVideoConverter::SetPass(int pass, PassStats *stats) {
+  pass_ = pass;
+  pass_stats_ = stats;
+}
+void FfmpegVideoConverter::EnablePsnr() { do_psnr = true; }
+void FfmpegVideoConverter::SetContentComplexity(
+    const ContentComplexity &content) {
+  content_ = content;
+  content_ready_ = true;
+}
+VideoQuality FfmpegVideoConverter::GetVideoQuality() const {
+  VideoQuality quality;
+  quality.frames = video_frames_;
+  double scale = video_psnr_scale_;
+  if (scale > 0) {
+    quality.psnr = -10.0 * log10(video_psnr_error_ / scale);
+  }
+  return quality;
+}
+
 bool FfmpegVideoConverter::Convert(const std::string &input,
                                    const std::string &output) {
   bool ret = false;
   do {
     input_file_ = input;
     output_file_ = output;
-    OpenInputFile();
+    if (!OpenInputFile()) {
+      break;
+    }
     ApplySyncOffsets();
     InitComplexFilters();
-    OpenOutputFile();
+    if (!OpenOutputFile()) {
+      break;
+    }
     check_filter_outputs();
 
     for (int i = 0; i < nb_output_files; i++) {
@@ -822,13 +911,17 @@ bool FfmpegVideoConverter::Convert(const std::string &input,
       ret = false;
       break;
     }
+    // 写数据包或文件尾失败时输出不完整，被 Stop() 中断的也不算完成
+    ret = main_return_code == 0 && !received_sigterm;
   } while (false);
 
-  ret = true;
   cleanup(ret);
+  succeeded_ = ret;
   return ret;
 }
 
+bool FfmpegVideoConverter::Succeeded() const { return succeeded_; }
+
 bool FfmpegVideoConverter::OpenInputFile() {
   // 初始化配置选项
   io.Init();
@@ -843,12 +936,148 @@ bool FfmpegVideoConverter::InitComplexFilters() {
   return ret == 0;
 }
 bool FfmpegVideoConverter::OpenOutputFile() {
-  // 初始化配置选项
-  oo.Init();
-  int ret = open_output_file(output_file_.c_str());
-  oo.UnInit();
-  // 重置配置选项
-  return ret == 0;
+  AnalyzeContent();
+  // 每路输出一个 OutputFile，解码器和输入流是共用的，
+  // 解码后的帧会送给每路输出各自的滤镜图
+  for (const auto &output : outputs_) {
+    ApplyOutputSpec(output);
+    ApplyContentBitrate(output);
+    // 初始化配置选项
+    oo.Init();
+    int ret = open_output_file(output.output_file.c_str());
+    oo.UnInit();
+    // 重置配置选项
+    if (ret != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+void FfmpegVideoConverter::ApplyOutputSpec(
+    const VideoConverter::OutputSpec &spec) {
+  oo.format = spec.output_file_format;
+  oo.vbitrate = spec.output_video_bitrate;
+  oo.vmaxrate = 0;
+  oo.abitrate = spec.output_audio_bitrate;
+  oo.codec_names.clear();
+  oo.codec_names.push_back({kVideoStream, -1, spec.video_encoder});
+  oo.codec_names.push_back({kAudioStream, -1, spec.audio_encoder});
+  int w = spec.output_video_width;
+  int h = spec.output_video_height;
+  oo.video_filters.clear();
+  if (w > 0 || h > 0) {
+    std::stringstream ss;
+    ss << "scale=" << (w > 0 ? w : -1) << ":" << (h > 0 ? h : -1);
+    oo.video_filters = ss.str();
+  }
+}
+
+void FfmpegVideoConverter::AnalyzeContent() {
+  if (!content_adaptive_ || content_ready_ || oo.video_disable) {
+    return;
+  }
+  content_ready_ = true;
+  if (io_source_.data || io_source_.read || streaming_input_) {
+    AvLog(nullptr, AV_LOG_WARNING,
+          "Content-adaptive bitrate needs to reopen the input, "
+          "ignored for custom or streaming input.\n");
+    return;
+  }
+  int64_t start = io.start_time == AV_NOPTS_VALUE ? 0 : io.start_time;
+  int64_t end = INT64_MAX;
+  if (io.recording_time != INT64_MAX) {
+    end = start + io.recording_time;
+  } else if (oo.recording_time != INT64_MAX) {
+    end = start + oo.recording_time;
+  }
+  // 采样窗口之间并行，不超过转码的线程预算
+  int64_t begin = av_gettime_relative();
+  content_ = ::AnalyzeContent(input_file_, start, end,
+                              ContentWindows(static_cast<int>(io.threads)),
+                              kContentWindowFrames);
+  AvLog(nullptr, AV_LOG_INFO,
+        "Content of %s: spatial %.2f, temporal %.2f, %lld frames in %.1f "
+        "ms.\n",
+        input_file_.c_str(), content_.spatial, content_.temporal,
+        content_.frames, (av_gettime_relative() - begin) / 1000.0);
+}
+
+void FfmpegVideoConverter::ApplyContentBitrate(
+    const VideoConverter::OutputSpec &spec) {
+  if (!content_adaptive_ || !content_ready_ || content_.frames <= 0) {
+    return;
+  }
+  InputStream *ist = nullptr;
+  for (int i = 0; i < nb_input_streams && !ist; i++) {
+    if (input_streams[i]->st->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
+      ist = input_streams[i];
+    }
+  }
+  if (!ist || ist->st->codecpar->width <= 0 ||
+      ist->st->codecpar->height <= 0) {
+    return;
+  }
+  // 只设置了宽或高时按源的宽高比计算另一边
+  int src_width = ist->st->codecpar->width;
+  int src_height = ist->st->codecpar->height;
+  int width = spec.output_video_width;
+  int height = spec.output_video_height;
+  if (width <= 0 && height <= 0) {
+    width = src_width;
+    height = src_height;
+  } else if (width <= 0) {
+    width = static_cast<int>(av_rescale(height, src_width, src_height));
+  } else if (height <= 0) {
+    height = static_cast<int>(av_rescale(width, src_height, src_width));
+  }
+  AVRational rate =
+      av_guess_frame_rate(input_files[ist->file_index]->ctx, ist->st, nullptr);
+  double frame_rate = rate.num > 0 && rate.den > 0 ? av_q2d(rate) : 25.0;
+
+  int64_t bitrate = EstimateBitrate(
+      content_, FindVideoEncoder(spec.video_encoder), width, height,
+      frame_rate);
+  if (!spec.output_video_bitrate.empty()) {
+    double limit = av_strtod(spec.output_video_bitrate.c_str(), nullptr);
+    if (limit > 0) {
+      bitrate = FFMIN(bitrate, static_cast<int64_t>(limit));
+    }
+  }
+  if (oo.vcrf >= 0) {
+    oo.vmaxrate = bitrate;
+  } else {
+    oo.vbitrate = std::to_string(bitrate);
+  }
+  AvLog(nullptr, AV_LOG_INFO, "Content-adaptive %s: %dx%d@%.2f, %lld bit/s\n",
+        spec.output_file.c_str(), width, height, frame_rate, bitrate);
+}
+
+int FfmpegVideoConverter::open_input_avio(const char *filename,
+                                          const AVIOInterruptCB &int_cb) {
+  AVIOContext *pb = OpenCustomInput(io_source_, io_buffer_size_);
+  if (streaming_input_) {
+    // 管道、socket 由预读线程读取，解封装和探测只从预读的块中取数据，
+    // 不会因为数据还没到达阻塞在系统调用里
+    bool custom = pb != nullptr;
+    if (!custom) {
+      // 没有数据时立即返回 EAGAIN，由预读线程等待，停止时不会卡在读取上
+      int ret = avio_open2(&pb, filename, AVIO_FLAG_READ | AVIO_FLAG_NONBLOCK,
+                           &int_cb, nullptr);
+      if (ret < 0) {
+        PrintError(filename, ret);
+        return ret;
+      }
+    }
+    int queue_size = io.thread_queue_size > 0 ? io.thread_queue_size
+                                              : kDefaultThreadQueueSize;
+    pb = OpenReadAheadInput(pb, filename, custom, queue_size, io_buffer_size_,
+                            int_cb);
+    if (!pb) {
+      return AVERROR(ENOMEM);
+    }
+  }
+  input_avio_ = pb;
+  return 0;
 }
 
 int FfmpegVideoConverter::open_input_file(const char *filename) {
@@ -933,6 +1162,27 @@ int FfmpegVideoConverter::open_input_file(const char *filename) {
     scan_all_pmts_set = true;
   }
 
+  if (streaming_input_) {
+    // 收到开头的一点数据就开始转码，不按默认的 5MB/5 秒探测
+    av_dict_set_int(&io.format_opts, "probesize", kStreamingProbeSize,
+                    AV_DICT_DONT_OVERWRITE);
+    av_dict_set_int(&io.format_opts, "analyzeduration",
+                    kStreamingAnalyzeDuration, AV_DICT_DONT_OVERWRITE);
+  }
+
+  // 自定义输入，avformat_close_input 不会释放 pb，在 cleanup 中释放
+  if (!input_avio_) {
+    int ret = open_input_avio(filename, ic->interrupt_callback);
+    if (ret < 0) {
+      avformat_free_context(ic);
+      return ret;
+    }
+    if (input_avio_) {
+      ic->pb = input_avio_;
+      ic->flags |= AVFMT_FLAG_CUSTOM_IO;
+    }
+  }
+
   /* open the input file with generic avformat function */
   int err = avformat_open_input(&ic, filename, file_iformat, &io.format_opts);
   if (err < 0) {
@@ -957,7 +1207,10 @@ int FfmpegVideoConverter::open_input_file(const char *filename) {
 
     /* If not enough info to get the stream parameters, we decode the
            first frames to get it. (used in mpeg case for example) */
-    int ret = avformat_find_stream_info(ic, opts);
+    // 自定义输入时 filename 只是格式提示，不能按文件缓存
+    int ret = probe_cache_ && !input_avio_
+                  ? FindStreamInfoCached(ic, filename, opts)
+                  : avformat_find_stream_info(ic, opts);
 
     for (int i = 0; i < orig_nb_streams; i++) {
       av_dict_free(&opts[i]);
@@ -1054,6 +1307,7 @@ int FfmpegVideoConverter::open_input_file(const char *filename) {
   f->rate_emu = io.rate_emu;
   f->accurate_seek = io.accurate_seek;
   f->loop = io.loop;
+  f->thread_queue_size = io.thread_queue_size;
   f->duration = 0;
   f->time_base = {1, 1};
 
@@ -1387,6 +1641,7 @@ bool FfmpegVideoConverter::check_output_constraints(InputStream *ist,
 
 bool FfmpegVideoConverter::do_streamcopy(InputStream *ist, OutputStream *ost,
                                          const AVPacket *pkt) {
+  auto lock = lock_muxer();
   OutputFile *of = output_files[ost->file_index];
   InputFile *f = input_files[ist->file_index];
   int64_t start_time = (of->start_time == AV_NOPTS_VALUE) ? 0 : of->start_time;
@@ -1607,6 +1862,11 @@ int FfmpegVideoConverter::open_output_file(const char *filename) {
 
   AVFormatContext *oc = nullptr;
   const char *output_format = oo.format.empty() ? nullptr : oo.format.c_str();
+  if (streaming_format_ == "hls") {
+    output_format = "hls";
+  } else if (streaming_format_ == "fmp4" && !output_format) {
+    output_format = "mp4";
+  }
   int err =
       avformat_alloc_output_context2(&oc, nullptr, output_format, filename);
   if (!oc) {
@@ -2075,14 +2335,21 @@ int FfmpegVideoConverter::open_output_file(const char *filename) {
     // assert_file_overwrite(filename);
 
     /* open the file */
-    if ((err = avio_open2(&oc->pb, filename, AVIO_FLAG_WRITE,
-                          &oc->interrupt_callback, &of->opts)) < 0) {
+    if (!output_avio_ &&
+        (output_avio_ = OpenCustomOutput(io_sink_, io_buffer_size_))) {
+      oc->pb = output_avio_;
+      oc->flags |= AVFMT_FLAG_CUSTOM_IO;
+    } else if ((err = avio_open2(&oc->pb, filename, AVIO_FLAG_WRITE,
+                                 &oc->interrupt_callback, &of->opts)) < 0) {
       return -1;
     }
   } else if (strcmp(oc->oformat->name, "image2") == 0 &&
              !av_filename_number_test(filename)) {
     // assert_file_overwrite(filename);
   }
+  if (streaming_format_ == "hls" || streaming_format_ == "fmp4") {
+    init_streaming_output(of, filename);
+  }
 
   if (oo.mux_preload) {
     av_dict_set_int(&of->opts, "preload", oo.mux_preload * AV_TIME_BASE, 0);
@@ -2502,6 +2769,11 @@ OutputStream *FfmpegVideoConverter::new_video_stream(AVFormatContext *oc,
     /* two pass mode */
     int do_pass = 0;
     // MATCH_PER_STREAM_OPT(pass, i, do_pass, oc, st);
+    if (pass_ && pass_stats_ && !pass_stream_assigned_) {
+      pass_stream_assigned_ = true;
+      do_pass = pass_;
+      ost->pass_stats = pass_stats_;
+    }
     if (do_pass) {
       if (do_pass & 1) {
         video_enc->flags |= AV_CODEC_FLAG_PASS1;
@@ -2519,7 +2791,22 @@ OutputStream *FfmpegVideoConverter::new_video_stream(AVFormatContext *oc,
       return nullptr;
     }
 
-    if (do_pass) {
+    if (do_pass && ost->pass_stats) {
+      // 统计数据不写日志文件，第一遍在编码时收集到内存中
+      if (!strcmp(ost->enc->name, "libx264")) {
+        av_dict_set(&ost->encoder_opts, "stats",
+                    ost->pass_stats->file.c_str(), AV_DICT_DONT_OVERWRITE);
+      } else if (video_enc->flags & AV_CODEC_FLAG_PASS2) {
+        if (ost->pass_stats->data.empty()) {
+          AvLog(nullptr, AV_LOG_FATAL, "No statistics for pass-2 encoding\n");
+          return nullptr;
+        }
+        video_enc->stats_in = av_strdup(ost->pass_stats->data.c_str());
+        if (!video_enc->stats_in) {
+          return nullptr;
+        }
+      }
+    } else if (do_pass) {
       char logfilename[1024] = {0};
       FILE *f = nullptr;
 
@@ -2559,6 +2846,10 @@ OutputStream *FfmpegVideoConverter::new_video_stream(AVFormatContext *oc,
     // st);
     if (ost->forced_keyframes) {
       ost->forced_keyframes = av_strdup(ost->forced_keyframes);
+    } else if (!streaming_format_.empty()) {
+      // 流式输出的每个分片都从关键帧开始
+      ost->forced_keyframes = av_asprintf("expr:gte(t,n_forced*%g)",
+                                          fragment_duration_ / 1000000.0);
     }
 
     // MATCH_PER_STREAM_OPT(force_fps, i, ost->force_fps, oc, st);
@@ -2750,6 +3041,18 @@ OutputStream *FfmpegVideoConverter::new_output_stream(AVFormatContext *oc,
           ost->file_index, ost->index);
     return nullptr;
   }
+  if (source_index >= 0 && ost->encoding_needed &&
+      can_stream_copy(oc, ost, input_streams[source_index])) {
+    AvLog(nullptr, AV_LOG_INFO,
+          "Stream #%d:%d already matches the requested codec %s, "
+          "copying instead of re-encoding.\n",
+          ost->file_index, ost->index, ost->enc->name);
+    ost->enc = nullptr;
+    ost->stream_copy = true;
+    ost->encoding_needed = false;
+    copied_streams_.push_back(std::to_string(ost->file_index) + ":" +
+                              std::to_string(ost->index));
+  }
 
   ost->enc_ctx = avcodec_alloc_context3(ost->enc);
   if (!ost->enc_ctx) {
@@ -3035,6 +3338,53 @@ const AVCodec *FfmpegVideoConverter::find_codec_or_die(const char *name,
   return codec;
 }
 
+bool FfmpegVideoConverter::can_stream_copy(AVFormatContext *oc,
+                                           OutputStream *ost,
+                                           InputStream *ist) {
+  if (!auto_stream_copy_ || !ost->enc) {
+    return false;
+  }
+  const AVCodecParameters *par = ist->st->codecpar;
+  AVMediaType type = par->codec_type;
+  if (type != ost->st->codecpar->codec_type ||
+      (type != AVMEDIA_TYPE_VIDEO && type != AVMEDIA_TYPE_AUDIO)) {
+    return false;
+  }
+  if (par->codec_id != ost->enc->id ||
+      !avformat_query_codec(oc->oformat, par->codec_id,
+                            FF_COMPLIANCE_NORMAL)) {
+    return false;
+  }
+  // 裁剪时间需要在关键帧之间切开，只能重新编码
+  if (io.start_time != AV_NOPTS_VALUE || io.recording_time != INT64_MAX ||
+      io.stop_time != INT64_MAX || oo.start_time != AV_NOPTS_VALUE ||
+      oo.recording_time != INT64_MAX || oo.stop_time != INT64_MAX) {
+    return false;
+  }
+
+  if (type == AVMEDIA_TYPE_VIDEO &&
+      (!oo.video_filters.empty() || !oo.frame_rate.empty() ||
+       !oo.max_frame_rate.empty() || !oo.frame_aspect_ratio.empty() ||
+       oo.max_frames != INT64_MAX)) {
+    return false;
+  }
+  // 指定了编码参数就是要重新编码
+  if (type == AVMEDIA_TYPE_VIDEO && (!oo.vpreset.empty() || oo.vcrf >= 0)) {
+    return false;
+  }
+  // 要求的码率不低于源码率时重新编码不会更好
+  const std::string &bitrate =
+      type == AVMEDIA_TYPE_VIDEO ? oo.vbitrate : oo.abitrate;
+  if (!bitrate.empty()) {
+    char *tail = nullptr;
+    double requested = av_strtod(bitrate.c_str(), &tail);
+    if (!tail || *tail || par->bit_rate <= 0 || requested < par->bit_rate) {
+      return false;
+    }
+  }
+  return true;
+}
+
 bool FfmpegVideoConverter::choose_encoder(AVFormatContext *s,
                                           OutputStream *ost) {
   AVMediaType type = ost->st->codecpar->codec_type;
@@ -3581,6 +3931,8 @@ void FfmpegVideoConverter::update_benchmark(const char *fmt, ...) {
 }
 
 void FfmpegVideoConverter::close_output_stream(OutputStream *ost) {
+  // 流水线模式下可能在编码线程上调用，转码线程同时在读 finished
+  auto lock = lock_muxer();
   OutputFile *of = output_files[ost->file_index];
   AVRational time_base =
       ost->stream_copy ? ost->mux_timebase : ost->enc_ctx->time_base;
@@ -3638,6 +3990,8 @@ finish:
 }
 
 int FfmpegVideoConverter::need_output(void) {
+  // 封装线程同时在写输出文件和输出流的状态
+  auto lock = lock_muxer();
   for (int i = 0; i < nb_output_streams; i++) {
     OutputStream *ost = output_streams[i];
     OutputFile *of = output_files[ost->file_index];
@@ -3665,6 +4019,7 @@ int FfmpegVideoConverter::need_output(void) {
  * @return  selected output stream, or nullptr if none available
  */
 OutputStream *FfmpegVideoConverter::choose_output(void) {
+  auto lock = lock_muxer();
   int64_t opts_min = INT64_MAX;
   OutputStream *ost_min = nullptr;
 
@@ -3709,6 +4064,14 @@ int FfmpegVideoConverter::transcode(void) {
     ret = -1;
     goto fail;
   }
+  if (profile_) {
+    init_profilers();
+  }
+
+  if (pipelined_ && !start_pipeline()) {
+    ret = -1;
+    goto fail;
+  }
 
   timer_start = av_gettime_relative();
 
@@ -3729,6 +4092,12 @@ int FfmpegVideoConverter::transcode(void) {
 
     /* dump report by using the output first video and audio streams */
     print_report(false, timer_start, cur_time);
+    post_progress(false, timer_start, cur_time);
+  }
+
+  // 解封装线程可能还阻塞在队列上，先停止读取
+  for (int i = 0; i < nb_input_files; i++) {
+    stop_demux_stage(input_files[i]);
   }
 
   /* at the end of stream, we must flush the decoder buffers */
@@ -3738,6 +4107,8 @@ int FfmpegVideoConverter::transcode(void) {
       process_input_packet(ist, nullptr, 0);
     }
   }
+  // 等编码、封装线程处理完队列中剩余的数据，编码器由当前线程冲刷
+  stop_pipeline(received_sigterm);
   flush_encoders();
 
   // term_exit();
@@ -3745,19 +4116,32 @@ int FfmpegVideoConverter::transcode(void) {
   /* write the trailer if needed */
   for (int i = 0; i < nb_output_files; i++) {
     ret = of_write_trailer(output_files[i]);
-    if (ret < 0 && exit_on_error) {
-      return -1;
+    if (ret < 0) {
+      PrintError(output_files[i]->ctx->url, ret);
+      main_return_code = 1;
+      if (exit_on_error) {
+        return -1;
+      }
     }
   }
 
   /* dump report by using the first video and audio streams */
-  print_report(true, timer_start, av_gettime_relative());
+  {
+    int64_t cur_time = av_gettime_relative();
+    print_report(true, timer_start, cur_time);
+    post_progress(true, timer_start, cur_time);
+  }
+  if (nb_stalls_) {
+    AvLog(nullptr, AV_LOG_VERBOSE,
+          "Waited for input %lld times, %0.3fs in total.\n",
+          nb_stalls_.load(), stall_time_ / 1000000.0);
+  }
 
   /* close the output files */
   for (int i = 0; i < nb_output_files; i++) {
     os = output_files[i]->ctx;
     if (os && os->oformat && !(os->oformat->flags & AVFMT_NOFILE)) {
-      if ((ret = avio_closep(&os->pb)) < 0) {
+      if ((ret = close_output_pb(output_files[i])) < 0) {
         if (exit_on_error) {
           return -1;
         }
@@ -3795,7 +4179,7 @@ int FfmpegVideoConverter::transcode(void) {
     }
   }
 
-  hw_device_free_all();
+  hw_device_free_all(&hw_devices);
 
   /* finished ! */
   ret = 0;
@@ -4048,7 +4432,7 @@ int FfmpegVideoConverter::init_input_stream(int ist_index, char *error,
       av_dict_set(&ist->decoder_opts, "threads", "1", 0);
     }
 
-    int ret = hw_device_setup_for_decode(ist);
+    int ret = hw_device_setup_for_decode(&hw_devices, ist);
     if (ret < 0) {
       return ret;
     }
@@ -4564,7 +4948,7 @@ int FfmpegVideoConverter::init_output_stream(OutputStream *ost, AVFrame *frame,
     if (!av_dict_get(ost->encoder_opts, "threads", nullptr, 0))
       av_dict_set(&ost->encoder_opts, "threads", "auto", 0);
 
-    ret = hw_device_setup_for_encode(ost);
+    ret = hw_device_setup_for_encode(&hw_devices, ost);
     if (ret < 0) {
       snprintf(error, error_len,
                "Device setup failed for "
@@ -4679,6 +5063,8 @@ int FfmpegVideoConverter::init_output_stream(OutputStream *ost, AVFrame *frame,
     return ret;
   }
 
+  // 流水线模式下视频流在编码线程上初始化，与其它流的封装并发
+  auto lock = lock_muxer();
   ost->initialized = true;
 
   if (!of_check_init(output_files[ost->file_index])) {
@@ -4808,7 +5194,13 @@ int FfmpegVideoConverter::process_input(int file_index) {
       }
     }
 
+    // 解封装线程已经读到文件末尾，seek 之后重新启动
+    bool restart_demux = ifile->demux_stage != nullptr;
+    stop_demux_stage(ifile);
     ret = seek_to_start(ifile, is);
+    if (restart_demux && !start_demux_stage(ifile)) {
+      ret = AVERROR(ENOMEM);
+    }
     if (ret < 0) {
       AvLog(nullptr, AV_LOG_WARNING, "Seek to start failed.\n");
     } else {
@@ -5280,6 +5672,8 @@ int FfmpegVideoConverter::send_frame_to_filters(InputStream *ist,
                                                 AVFrame *decoded_frame) {
   int ret = -1;
   av_assert1(ist->nb_filters > 0); /* ensure ret is initialized */
+  ScopedStageTimer timer(ist->profiler, kFilterStage);
+  timer.AddFrames(1);
   for (int i = 0; i < ist->nb_filters; i++) {
     ret = ifilter_send_frame(ist->filters[i], decoded_frame,
                              i < ist->nb_filters - 1);
@@ -5299,7 +5693,13 @@ int FfmpegVideoConverter::decode_audio(InputStream *ist, AVPacket *pkt,
   AVCodecContext *avctx = ist->dec_ctx;
 
   update_benchmark(nullptr);
-  int ret = decode(avctx, decoded_frame, got_output, pkt);
+  int ret;
+  {
+    ScopedStageTimer timer(ist->profiler, kDecodeStage);
+    ret = decode(avctx, decoded_frame, got_output, pkt);
+    timer.AddFrames(*got_output);
+    timer.AddBytes(pkt ? pkt->size : 0);
+  }
   update_benchmark("decode_audio %d.%d", ist->file_index, ist->st->index);
   if (ret < 0) {
     *decode_failed = true;
@@ -5383,8 +5783,13 @@ int FfmpegVideoConverter::decode_video(InputStream *ist, AVPacket *pkt,
   // The old code used to set dts on the drain packet, which does not work
   // with the new API anymore.
   if (eof) {
-    void *neww = av_realloc_array(ist->dts_buffer, ist->nb_dts_buffer + 1,
-                                  sizeof(ist->dts_buffer[0]));
+    // 按倍数扩容，冲刷解码器时不用每次都重新分配
+    size_t min_size = (ist->nb_dts_buffer + 1) * sizeof(ist->dts_buffer[0]);
+    if (min_size > ist->dts_buffer_size) {
+      allocations_++;
+    }
+    void *neww =
+        av_fast_realloc(ist->dts_buffer, &ist->dts_buffer_size, min_size);
     if (!neww) {
       return AVERROR(ENOMEM);
     }
@@ -5393,7 +5798,13 @@ int FfmpegVideoConverter::decode_video(InputStream *ist, AVPacket *pkt,
   }
 
   update_benchmark(nullptr);
-  int ret = decode(ist->dec_ctx, decoded_frame, got_output, pkt);
+  int ret;
+  {
+    ScopedStageTimer timer(ist->profiler, kDecodeStage);
+    ret = decode(ist->dec_ctx, decoded_frame, got_output, pkt);
+    timer.AddFrames(*got_output);
+    timer.AddBytes(pkt ? pkt->size : 0);
+  }
   update_benchmark("decode_video %d.%d", ist->file_index, ist->st->index);
   if (ret < 0) {
     *decode_failed = true;
@@ -5821,6 +6232,7 @@ bool FfmpegVideoConverter::do_audio_out(OutputFile *of, OutputStream *ost,
 
 bool FfmpegVideoConverter::do_subtitle_out(OutputFile *of, OutputStream *ost,
                                            AVSubtitle *sub) {
+  auto lock = lock_muxer();
   int subtitle_out_max_size = 1024 * 1024;
   int subtitle_out_size;
   AVPacket *pkt = ost->pkt;
@@ -6059,13 +6471,14 @@ bool FfmpegVideoConverter::do_video_out(OutputFile *of, OutputStream *ost,
     nb_frames_dup += nb_frames - (nb0_frames && ost->last_dropped) -
                      (nb_frames > nb0_frames);
     AvLog(nullptr, AV_LOG_VERBOSE, "*** %lld dup!\n", nb_frames - 1);
-    if (nb_frames_dup > dup_warning) {
+    uint64_t warning = dup_warning;
+    if (static_cast<uint64_t>(nb_frames_dup) > warning &&
+        dup_warning.compare_exchange_strong(warning, warning * 10)) {
       AvLog(nullptr, AV_LOG_WARNING,
             "More than %"
             "llu"
             " frames duplicated\n",
-            dup_warning);
-      dup_warning *= 10;
+            warning);
     }
   }
   ost->last_dropped = nb_frames == nb0_frames && next_picture;
@@ -6146,7 +6559,10 @@ bool FfmpegVideoConverter::do_video_out(OutputFile *of, OutputStream *ost,
     if (ret < 0) return false;
 
     ost->sync_opts++;
-    ost->frame_number++;
+    {
+      auto lock = lock_muxer();
+      ost->frame_number++;
+    }
   }
 
   av_frame_unref(ost->last_frame);
@@ -6183,7 +6599,6 @@ int FfmpegVideoConverter::reap_filters(int flush) {
     OutputStream *ost = output_streams[i];
     OutputFile *of = output_files[ost->file_index];
     AVFilterContext *filter;
-    AVCodecContext *enc = ost->enc_ctx;
     int ret = 0;
 
     if (!ost->filter || !ost->filter->graph->graph) continue;
@@ -6204,8 +6619,12 @@ int FfmpegVideoConverter::reap_filters(int flush) {
     filtered_frame = ost->filtered_frame;
 
     while (1) {
-      ret = av_buffersink_get_frame_flags(filter, filtered_frame,
-                                          AV_BUFFERSINK_FLAG_NO_REQUEST);
+      {
+        ScopedStageTimer timer(ost->profiler, kFilterStage);
+        ret = av_buffersink_get_frame_flags(filter, filtered_frame,
+                                            AV_BUFFERSINK_FLAG_NO_REQUEST);
+        timer.AddFrames(ret >= 0);
+      }
       if (ret < 0) {
         if (ret != AVERROR(EAGAIN) && ret != AVERROR_EOF) {
           AvLog(nullptr, AV_LOG_WARNING,
@@ -6213,7 +6632,11 @@ int FfmpegVideoConverter::reap_filters(int flush) {
                 AvErr2Str(ret));
         } else if (flush && ret == AVERROR_EOF) {
           if (av_buffersink_get_type(filter) == AVMEDIA_TYPE_VIDEO) {
-            do_video_out(of, ost, nullptr);
+            if (ost->encode_stage) {
+              send_to_encode_stage(ost, nullptr);
+            } else {
+              do_video_out(of, ost, nullptr);
+            }
           }
         }
         break;
@@ -6223,30 +6646,14 @@ int FfmpegVideoConverter::reap_filters(int flush) {
         continue;
       }
 
-      switch (av_buffersink_get_type(filter)) {
-        case AVMEDIA_TYPE_VIDEO:
-          if (!ost->frame_aspect_ratio.num)
-            enc->sample_aspect_ratio = filtered_frame->sample_aspect_ratio;
-
-          do_video_out(of, ost, filtered_frame);
-          break;
-        case AVMEDIA_TYPE_AUDIO:
-          if (!(enc->codec->capabilities & AV_CODEC_CAP_PARAM_CHANGE) &&
-              enc->ch_layout.nb_channels !=
-                  filtered_frame->ch_layout.nb_channels) {
-            AvLog(nullptr, AV_LOG_ERROR,
-                  "Audio filter graph output is not normalized and encoder "
-                  "does not support parameter changes\n");
-            break;
-          }
-          do_audio_out(of, ost, filtered_frame);
-          break;
-        default:
-          // TODO support subtitle filters
-          av_assert0(0);
-          break;
+      if (ost->encode_stage) {
+        ret = send_to_encode_stage(ost, filtered_frame);
+        if (ret < 0) {
+          return ret;
+        }
+        continue;
       }
-
+      encode_filtered_frame(of, ost, filtered_frame);
       av_frame_unref(filtered_frame);
     }
   }
@@ -6254,6 +6661,39 @@ int FfmpegVideoConverter::reap_filters(int flush) {
   return 0;
 }
 
+bool FfmpegVideoConverter::encode_filtered_frame(OutputFile *of,
+                                                 OutputStream *ost,
+                                                 AVFrame *frame) {
+  AVCodecContext *enc = ost->enc_ctx;
+
+  if (!frame) {
+    // end, flushing
+    return do_video_out(of, ost, nullptr);
+  }
+
+  switch (enc->codec_type) {
+    case AVMEDIA_TYPE_VIDEO:
+      if (!ost->frame_aspect_ratio.num)
+        enc->sample_aspect_ratio = frame->sample_aspect_ratio;
+
+      return do_video_out(of, ost, frame);
+    case AVMEDIA_TYPE_AUDIO:
+      if (!(enc->codec->capabilities & AV_CODEC_CAP_PARAM_CHANGE) &&
+          enc->ch_layout.nb_channels != frame->ch_layout.nb_channels) {
+        AvLog(nullptr, AV_LOG_ERROR,
+              "Audio filter graph output is not normalized and encoder "
+              "does not support parameter changes\n");
+        return true;
+      }
+      return do_audio_out(of, ost, frame);
+    default:
+      // TODO support subtitle filters
+      av_assert0(0);
+      break;
+  }
+  return true;
+}
+
 /**
  * Perform a step of transcoding for the specified filter graph.
  *
@@ -6308,18 +6748,13 @@ int FfmpegVideoConverter::transcode_from_filter(FilterGraph *graph,
  * @return  0 for success, <0 for error
  */
 int FfmpegVideoConverter::transcode_step(void) {
-  {
-    VideoConverter::Response r;
-    this->PostConvertProgress(r);
-  }
-  
   int ret;
 
   OutputStream *ost = choose_output();
   if (!ost) {
     if (got_eagain()) {
       reset_eagain();
-      av_usleep(10000);
+      wait_for_input();
       return 0;
     }
     AvLog(nullptr, AV_LOG_VERBOSE, "No more inputs to read from, finishing.\n");
@@ -6496,13 +6931,53 @@ int FfmpegVideoConverter::get_input_packet(InputFile *f, AVPacket **pkt) {
       pts = av_rescale(ist->dts, 1000000, AV_TIME_BASE);
       now = (av_gettime_relative() - ist->start) * scale + stream_ts_offset;
       if (pts > now) {
+        // 按照读取速率，要到这个时间才能继续读
+        int64_t wakeup_time =
+            av_gettime_relative() + static_cast<int64_t>((pts - now) / scale);
+        input_wakeup_time_ = FFMIN(input_wakeup_time_, wakeup_time);
         return AVERROR(EAGAIN);
       }
     }
   }
 
   *pkt = f->pkt;
-  return av_read_frame(f->ctx, *pkt);
+  if (f->demux_stage) {
+    AVPacket *queued = nullptr;
+    bool got_packet = f->non_blocking ? f->demux_stage->queue.TryPop(&queued)
+                                      : f->demux_stage->queue.Pop(&queued);
+    if (!got_packet && f->non_blocking) {
+      // 清除旧的通知后再试一次，之后入队的数据包一定会唤醒 wait_for_input()
+      {
+        std::lock_guard<std::mutex> lock(input_ready_mutex_);
+        input_ready_ = false;
+      }
+      got_packet = f->demux_stage->queue.TryPop(&queued);
+    }
+    if (!got_packet) {
+      if (f->demux_stage->queue.IsDrained()) {
+        return f->demux_stage->read_ret.load();
+      }
+      input_notify_pending_ = true;
+      return AVERROR(EAGAIN);
+    }
+    av_packet_move_ref(*pkt, queued);
+    f->demux_stage->packet_pool.Put(queued);
+    return 0;
+  }
+  int64_t start = profile_ ? av_gettime_relative() : 0;
+  int ret = av_read_frame(f->ctx, *pkt);
+  if (ret >= 0) {
+    if (StreamProfiler *profiler = demux_profiler(f, *pkt)) {
+      profiler->stages[kDemuxStage].Record(av_gettime_relative() - start, 1,
+                                           (*pkt)->size);
+    }
+  }
+  if (ret == AVERROR(EAGAIN)) {
+    // demuxer 没有就绪通知，只能稍后重试
+    input_wakeup_time_ = FFMIN(input_wakeup_time_,
+                               av_gettime_relative() + kInputRetryInterval);
+  }
+  return ret;
 }
 bool FfmpegVideoConverter::got_eagain() {
   for (int i = 0; i < nb_output_streams; i++) {
@@ -6522,6 +6997,34 @@ void FfmpegVideoConverter::reset_eagain() {
   }
 }
 
+void FfmpegVideoConverter::wait_for_input(void) {
+  int64_t start = av_gettime_relative();
+  int64_t wakeup_time = input_wakeup_time_;
+  if (wakeup_time == INT64_MAX) {
+    wakeup_time =
+        start + (input_notify_pending_ ? kMaxInputWait : kInputRetryInterval);
+  }
+
+  if (wakeup_time > start) {
+    std::unique_lock<std::mutex> lock(input_ready_mutex_);
+    input_ready_cv_.wait_for(
+        lock, std::chrono::microseconds(wakeup_time - start),
+        [this] { return input_ready_ || received_sigterm; });
+    input_ready_ = false;
+  }
+  input_wakeup_time_ = INT64_MAX;
+  input_notify_pending_ = false;
+
+  stall_time_ += av_gettime_relative() - start;
+  nb_stalls_++;
+}
+
+void FfmpegVideoConverter::notify_input_ready(void) {
+  std::lock_guard<std::mutex> lock(input_ready_mutex_);
+  input_ready_ = true;
+  input_ready_cv_.notify_one();
+}
+
 bool FfmpegVideoConverter::flush_encoders(void) {
   int ret;
 
@@ -6593,6 +7096,8 @@ bool FfmpegVideoConverter::update_video_stats(OutputStream *ost,
   int64_t frame_number;
   double ti1, bitrate, avg_bitrate;
 
+  // 转码线程打印进度时会读这些字段
+  auto lock = lock_muxer();
   ost->quality = sd ? AV_RL32(sd) : -1;
   ost->pict_type =
       sd ? static_cast<AVPictureType>(sd[4]) : AV_PICTURE_TYPE_NONE;
@@ -6603,6 +7108,15 @@ bool FfmpegVideoConverter::update_video_stats(OutputStream *ost,
     else
       ost->error[i] = -1;
   }
+  video_frames_++;
+  if (sd && (enc->flags & AV_CODEC_FLAG_PSNR)) {
+    // Y 全尺寸，U/V 按 4:2:0 各四分之一
+    double scale = enc->width * enc->height * 255.0 * 255.0;
+    for (int i = 0; i < FFMIN(sd[5], 3); i++) {
+      video_psnr_error_ += ost->error[i];
+      video_psnr_scale_ += i ? scale / 4 : scale;
+    }
+  }
 
   if (!write_vstats) return true;
 
@@ -6661,6 +7175,9 @@ int FfmpegVideoConverter::encode_frame(OutputFile *of, OutputStream *ost,
 
   update_benchmark(nullptr);
 
+  // 非流水线模式下 submit_encoded_packet() 直接封装，不计入编码耗时
+  ScopedStageTimer timer(ost->profiler, kEncodeStage);
+  timer.AddFrames(!!frame);
   ret = avcodec_send_frame(enc, frame);
   if (ret < 0 && !(ret == AVERROR_EOF && !frame)) {
     AvLog(nullptr, AV_LOG_ERROR, "Error submitting %s frame to the encoder\n",
@@ -6672,17 +7189,25 @@ int FfmpegVideoConverter::encode_frame(OutputFile *of, OutputStream *ost,
     ret = avcodec_receive_packet(enc, pkt);
     update_benchmark("%s_%s %d.%d", action, type_desc, ost->file_index,
                      ost->index);
+    if (ret >= 0) {
+      timer.AddBytes(pkt->size);
+    }
 
     /* if two pass, output log on success and EOF */
     if ((ret >= 0 || ret == AVERROR_EOF) && ost->logfile && enc->stats_out) {
       fprintf(ost->logfile, "%s", enc->stats_out);
     }
+    if ((ret >= 0 || ret == AVERROR_EOF) && ost->pass_stats &&
+        (enc->flags & AV_CODEC_FLAG_PASS1) && enc->stats_out) {
+      ost->pass_stats->data += enc->stats_out;
+    }
 
     if (ret == AVERROR(EAGAIN)) {
       av_assert0(frame);  // should never happen during flushing
       return 0;
     } else if (ret == AVERROR_EOF) {
-      output_packet(of, pkt, ost, 1);
+      timer.Pause();
+      submit_encoded_packet(of, ost, pkt, true);
       return ret;
     } else if (ret < 0) {
       AvLog(nullptr, AV_LOG_ERROR, "%s encoding failed\n", type_desc);
@@ -6700,7 +7225,11 @@ int FfmpegVideoConverter::encode_frame(OutputFile *of, OutputStream *ost,
             AvTs2TimeStr(pkt->duration, &enc->time_base));
     }
 
-    av_packet_rescale_ts(pkt, enc->time_base, ost->mux_timebase);
+    // 流水线模式下在封装线程上转换时间基，of_check_init() 可能会修改
+    // mux_timebase
+    if (!mux_stage_) {
+      av_packet_rescale_ts(pkt, enc->time_base, ost->mux_timebase);
+    }
 
     if (debug_ts) {
       av_log(nullptr, AV_LOG_INFO,
@@ -6718,14 +7247,336 @@ int FfmpegVideoConverter::encode_frame(OutputFile *of, OutputStream *ost,
 
     ost->packets_encoded++;
 
-    output_packet(of, pkt, ost, 0);
+    timer.Pause();
+    submit_encoded_packet(of, ost, pkt, false);
+    timer.Resume();
   }
 
   av_assert0(0);
 }
 
+bool FfmpegVideoConverter::submit_encoded_packet(OutputFile *of,
+                                                 OutputStream *ost,
+                                                 AVPacket *pkt, bool eof) {
+  if (!mux_stage_) {
+    return output_packet(of, pkt, ost, eof);
+  }
+
+  EncodedPacket item{of, ost, packet_pool_.Get(), eof};
+  if (!item.pkt) {
+    av_packet_unref(pkt);
+    return false;
+  }
+  av_packet_move_ref(item.pkt, pkt);
+  int64_t wait_time = 0;
+  bool pushed =
+      mux_stage_->queue.Push(item, ost->profiler ? &wait_time : nullptr);
+  AddBlockedTime(ost->profiler, kEncodeStage, wait_time);
+  if (!pushed) {
+    packet_pool_.Put(item.pkt);
+    return false;
+  }
+  return true;
+}
+
+/*
+ * Pipelined mode:
+ *   demux thread (per input file) -> packet queue ->
+ *   decode + filter (transcode thread) -> frame queue ->
+ *   encode thread (per encoded output stream) -> packet queue ->
+ *   mux thread
+ */
+bool FfmpegVideoConverter::start_pipeline(void) {
+  mux_stage_ = std::make_unique<MuxStage>(kMuxQueueSize);
+  mux_stage_->thread =
+      std::thread(&FfmpegVideoConverter::mux_thread, this, mux_stage_.get());
+
+  int nb_encode_stages = 0;
+  for (int i = 0; i < nb_output_streams; i++) {
+    OutputStream *ost = output_streams[i];
+    if (!ost->encoding_needed || !ost->filter) {
+      continue;
+    }
+    if (!start_encode_stage(ost)) {
+      return false;
+    }
+    nb_encode_stages++;
+  }
+
+  for (int i = 0; i < nb_input_files; i++) {
+    InputFile *f = input_files[i];
+    f->non_blocking = nb_input_files > 1;
+    if (!start_demux_stage(f)) {
+      return false;
+    }
+  }
+
+  AvLog(nullptr, AV_LOG_VERBOSE,
+        "Pipelined transcode: %d demux, %d encode and 1 mux threads.\n",
+        nb_input_files, nb_encode_stages);
+  return true;
+}
+
+void FfmpegVideoConverter::stop_pipeline(bool abort) {
+  for (int i = 0; i < nb_input_files; i++) {
+    stop_demux_stage(input_files[i]);
+  }
+  for (int i = 0; i < nb_output_streams; i++) {
+    stop_encode_stage(output_streams[i], abort);
+  }
+  if (mux_stage_) {
+    if (abort) {
+      mux_stage_->queue.Clear();
+    }
+    mux_stage_->queue.Close();
+    mux_stage_->thread.join();
+    mux_stage_.reset();
+  }
+}
+
+bool FfmpegVideoConverter::start_demux_stage(InputFile *f) {
+  int queue_size = f->thread_queue_size > 0 ? f->thread_queue_size
+                                            : kDefaultThreadQueueSize;
+  f->demux_stage = new (std::nothrow) DemuxStage(queue_size, &allocations_);
+  if (!f->demux_stage) {
+    return false;
+  }
+  f->demux_stage->thread =
+      std::thread(&FfmpegVideoConverter::demux_thread, this, f);
+  return true;
+}
+
+void FfmpegVideoConverter::stop_demux_stage(InputFile *f) {
+  if (!f || !f->demux_stage) {
+    return;
+  }
+  // 后面读到的数据包都不再需要
+  f->demux_stage->queue.Close();
+  f->demux_stage->queue.Clear();
+  {
+    std::lock_guard<std::mutex> lock(f->demux_stage->retry_mutex);
+    f->demux_stage->stopping = true;
+  }
+  f->demux_stage->retry_cv.notify_one();
+  f->demux_stage->thread.join();
+  delete f->demux_stage;
+  f->demux_stage = nullptr;
+}
+
+bool FfmpegVideoConverter::start_encode_stage(OutputStream *ost) {
+  ost->encode_stage =
+      new (std::nothrow) EncodeStage(kEncodeQueueSize, &allocations_);
+  if (!ost->encode_stage) {
+    return false;
+  }
+  ost->encode_stage->thread =
+      std::thread(&FfmpegVideoConverter::encode_thread, this, ost);
+  return true;
+}
+
+void FfmpegVideoConverter::stop_encode_stage(OutputStream *ost, bool abort) {
+  if (!ost || !ost->encode_stage) {
+    return;
+  }
+  if (abort) {
+    ost->encode_stage->queue.Clear();
+  }
+  ost->encode_stage->queue.Close();
+  ost->encode_stage->thread.join();
+  delete ost->encode_stage;
+  ost->encode_stage = nullptr;
+}
+
+void FfmpegVideoConverter::demux_thread(InputFile *f) {
+  DemuxStage *stage = f->demux_stage;
+  while (true) {
+    AVPacket *pkt = stage->packet_pool.Get();
+    if (!pkt) {
+      stage->read_ret = AVERROR(ENOMEM);
+      break;
+    }
+    int64_t start = profile_ ? av_gettime_relative() : 0;
+    int ret = av_read_frame(f->ctx, pkt);
+    if (ret == AVERROR(EAGAIN)) {
+      // demuxer 没有就绪通知，等到重试时间或者停止
+      stage->packet_pool.Put(pkt);
+      int64_t wait_start = av_gettime_relative();
+      bool stopping = false;
+      {
+        std::unique_lock<std::mutex> lock(stage->retry_mutex);
+        stopping = stage->retry_cv.wait_for(
+            lock, std::chrono::microseconds(kInputRetryInterval),
+            [stage] { return stage->stopping; });
+      }
+      stall_time_ += av_gettime_relative() - wait_start;
+      nb_stalls_++;
+      if (stopping) {
+        break;
+      }
+      continue;
+    }
+    if (ret < 0) {
+      stage->packet_pool.Put(pkt);
+      stage->read_ret = ret;
+      break;
+    }
+    StreamProfiler *profiler = demux_profiler(f, pkt);
+    if (profiler) {
+      profiler->stages[kDemuxStage].Record(av_gettime_relative() - start, 1,
+                                           pkt->size);
+    }
+    // 队列满时在这里等待解码阶段
+    int64_t wait_time = 0;
+    bool pushed = stage->queue.Push(pkt, profiler ? &wait_time : nullptr);
+    AddBlockedTime(profiler, kDemuxStage, wait_time);
+    if (!pushed) {
+      stage->packet_pool.Put(pkt);
+      break;
+    }
+    notify_input_ready();
+  }
+  stage->queue.Close();
+  notify_input_ready();
+}
+
+void FfmpegVideoConverter::encode_thread(OutputStream *ost) {
+  EncodeStage *stage = ost->encode_stage;
+  OutputFile *of = output_files[ost->file_index];
+  AVFrame *frame = nullptr;
+  int64_t wait_time = 0;
+  // 等待滤镜输出的时间记为编码阶段的阻塞时间
+  while (stage->queue.Pop(&frame, ost->profiler ? &wait_time : nullptr)) {
+    AddBlockedTime(ost->profiler, kEncodeStage, wait_time);
+    wait_time = 0;
+    encode_filtered_frame(of, ost, frame);
+    stage->frame_pool.Put(frame);
+  }
+}
+
+void FfmpegVideoConverter::mux_thread(MuxStage *stage) {
+  EncodedPacket item{};
+  while (stage->queue.Pop(&item)) {
+    {
+      std::lock_guard<std::recursive_mutex> lock(mux_mutex_);
+      OutputStream *ost = item.ost;
+      if (!item.eof) {
+        av_packet_rescale_ts(item.pkt, ost->enc_ctx->time_base,
+                             ost->mux_timebase);
+      }
+      output_packet(item.of, item.pkt, ost, item.eof);
+    }
+    packet_pool_.Put(item.pkt);
+  }
+}
+
+int FfmpegVideoConverter::send_to_encode_stage(OutputStream *ost,
+                                               AVFrame *frame) {
+  AVFrame *queued = nullptr;
+  if (frame) {
+    queued = ost->encode_stage->frame_pool.Get();
+    if (!queued) {
+      av_frame_unref(frame);
+      return AVERROR(ENOMEM);
+    }
+    av_frame_move_ref(queued, frame);
+  }
+  // 队列满时在这里等待编码阶段
+  int64_t wait_time = 0;
+  if (!ost->encode_stage->queue.Push(queued,
+                                     ost->profiler ? &wait_time : nullptr)) {
+    ost->encode_stage->frame_pool.Put(queued);
+  }
+  AddBlockedTime(ost->profiler, kFilterStage, wait_time);
+  return 0;
+}
+
+std::unique_lock<std::recursive_mutex>
+FfmpegVideoConverter::lock_muxer(void) {
+  if (!mux_stage_) {
+    return std::unique_lock<std::recursive_mutex>();
+  }
+  return std::unique_lock<std::recursive_mutex>(mux_mutex_);
+}
+
+void FfmpegVideoConverter::update_pipeline_stats(VideoConverter::Response *r) {
+  if (!mux_stage_) {
+    return;
+  }
+  r->demux_queue_depth = 0;
+  for (int i = 0; i < nb_input_files; i++) {
+    if (input_files[i]->demux_stage) {
+      r->demux_queue_depth +=
+          static_cast<int>(input_files[i]->demux_stage->queue.Size());
+    }
+  }
+  r->encode_queue_depth = 0;
+  for (int i = 0; i < nb_output_streams; i++) {
+    if (output_streams[i]->encode_stage) {
+      r->encode_queue_depth +=
+          static_cast<int>(output_streams[i]->encode_stage->queue.Size());
+    }
+  }
+  r->mux_queue_depth = static_cast<int>(mux_stage_->queue.Size());
+}
+
+void FfmpegVideoConverter::init_profilers(void) {
+  std::lock_guard<std::mutex> lock(profile_mutex_);
+  profilers_.clear();
+  for (int i = 0; i < nb_input_streams; i++) {
+    InputStream *ist = input_streams[i];
+    if (ist->discard) {
+      continue;
+    }
+    auto profiler = std::make_unique<StreamProfiler>();
+    profiler->file_index = ist->file_index;
+    profiler->stream_index = ist->st->index;
+    const char *type = av_get_media_type_string(ist->st->codecpar->codec_type);
+    profiler->media_type = type ? type : "unknown";
+    ist->profiler = profiler.get();
+    profilers_.push_back(std::move(profiler));
+  }
+  for (int i = 0; i < nb_output_streams; i++) {
+    OutputStream *ost = output_streams[i];
+    auto profiler = std::make_unique<StreamProfiler>();
+    profiler->output = true;
+    profiler->file_index = ost->file_index;
+    profiler->stream_index = ost->index;
+    const char *type = av_get_media_type_string(ost->st->codecpar->codec_type);
+    profiler->media_type = type ? type : "unknown";
+    ost->profiler = profiler.get();
+    profilers_.push_back(std::move(profiler));
+  }
+}
+
+StreamProfiler *FfmpegVideoConverter::demux_profiler(InputFile *f,
+                                                     AVPacket *pkt) {
+  if (!profile_ || pkt->stream_index >= f->nb_streams) {
+    return nullptr;
+  }
+  return input_streams[f->ist_index + pkt->stream_index]->profiler;
+}
+
+VideoConverter::Profile FfmpegVideoConverter::GetProfile() const {
+  VideoConverter::Profile profile;
+  std::lock_guard<std::mutex> lock(profile_mutex_);
+  for (const auto &profiler : profilers_) {
+    VideoConverter::StreamProfile stream;
+    stream.output = profiler->output;
+    stream.file_index = profiler->file_index;
+    stream.stream_index = profiler->stream_index;
+    stream.media_type = profiler->media_type;
+    profiler->stages[kDemuxStage].Collect(&stream.demux);
+    profiler->stages[kDecodeStage].Collect(&stream.decode);
+    profiler->stages[kFilterStage].Collect(&stream.filter);
+    profiler->stages[kEncodeStage].Collect(&stream.encode);
+    profiler->stages[kMuxStage].Collect(&stream.mux);
+    profile.streams.push_back(stream);
+  }
+  return profile;
+}
+
 HWDevice *FfmpegVideoConverter::hw_device_get_by_name(const char *name) {
-  return ::hw_device_get_by_name(name);
+  return ::hw_device_get_by_name(&hw_devices, name);
 }
 
 void FfmpegVideoConverter::close_all_output_streams(OutputStream *ost,
@@ -6789,7 +7640,7 @@ bool FfmpegVideoConverter::of_write_packet(OutputFile *of, AVPacket *pkt,
     if (ret < 0) {
       return false;
     }
-    tmp_pkt = av_packet_alloc();
+    tmp_pkt = packet_pool_.Get();
     if (!tmp_pkt) {
       return false;
     }
@@ -6876,7 +7727,12 @@ bool FfmpegVideoConverter::of_write_packet(OutputFile *of, AVPacket *pkt,
           AvTs2TimeStr(pkt->duration, &ost->st->time_base), pkt->size);
   }
 
-  ret = av_interleaved_write_frame(s, pkt);
+  {
+    ScopedStageTimer timer(ost->profiler, kMuxStage);
+    timer.AddFrames(1);
+    timer.AddBytes(pkt->size);
+    ret = av_interleaved_write_frame(s, pkt);
+  }
   if (ret < 0) {
     PrintError("av_interleaved_write_frame()", ret);
     main_return_code = 1;
@@ -6934,7 +7790,7 @@ bool FfmpegVideoConverter::of_check_init(OutputFile *of) {
     while (av_fifo_read(ost->muxing_queue, &pkt, 1) >= 0) {
       ost->muxing_queue_data_size -= pkt->size;
       of_write_packet(of, pkt, ost, 1);
-      av_packet_free(&pkt);
+      packet_pool_.Put(pkt);
     }
   }
 
@@ -6968,13 +7824,206 @@ void FfmpegVideoConverter::of_close(OutputFile **pof) {
 
   s = of->ctx;
   if (s && s->oformat && !(s->oformat->flags & AVFMT_NOFILE))
-    avio_closep(&s->pb);
+    close_output_pb(of);
   avformat_free_context(s);
   av_dict_free(&of->opts);
+  delete of->streaming;
 
   av_freep(pof);
 }
 
+void FfmpegVideoConverter::init_streaming_output(OutputFile *of,
+                                                 const char *filename) {
+  AVFormatContext *oc = of->ctx;
+  StreamingOutput *out = new StreamingOutput;
+  out->converter = this;
+  out->output_file = filename;
+  of->streaming = out;
+
+  if (streaming_format_ == "hls") {
+    // a/b.m3u8 -> a/b_init.mp4, a/b_0.m4s, a/b_1.m4s ...
+    std::string path = filename;
+    size_t slash = path.find_last_of("/\\");
+    size_t dot = path.find_last_of('.');
+    std::string base = dot == std::string::npos ||
+                               (slash != std::string::npos && dot < slash)
+                           ? path
+                           : path.substr(0, dot);
+    std::string name =
+        slash == std::string::npos ? base : base.substr(slash + 1);
+    out->init_file = base + "_init.mp4";
+
+    av_dict_set(&of->opts, "hls_segment_type", "fmp4", 0);
+    av_dict_set(&of->opts, "hls_time",
+                std::to_string(fragment_duration_ / 1000000.0).c_str(), 0);
+    // 播放列表保留所有分片，转码结束时加上 EXT-X-ENDLIST
+    av_dict_set(&of->opts, "hls_list_size", "0", 0);
+    av_dict_set(&of->opts, "hls_playlist_type", "event", 0);
+    av_dict_set(&of->opts, "hls_flags", "independent_segments", 0);
+    av_dict_set(&of->opts, "hls_fmp4_init_filename",
+                (name + "_init.mp4").c_str(), 0);
+    av_dict_set(&of->opts, "hls_segment_filename",
+                (base + "_%d.m4s").c_str(), 0);
+
+    out->io_open = oc->io_open;
+    out->io_close2 = oc->io_close2;
+    oc->opaque = out;
+    oc->io_open = streaming_io_open;
+    oc->io_close2 = streaming_io_close2;
+    return;
+  }
+
+  // 分片 MP4，每个关键帧开始一个新分片，分片不短于 fragment_duration_
+  av_dict_set(&of->opts, "movflags",
+              "+frag_keyframe+empty_moov+default_base_moof", AV_DICT_APPEND);
+  av_dict_set_int(&of->opts, "min_frag_duration", fragment_duration_, 0);
+  if (!oc->pb) {
+    return;
+  }
+  constexpr int kFragmentBufferSize = 64 * 1024;
+  uint8_t *buffer = static_cast<uint8_t *>(av_malloc(kFragmentBufferSize));
+  AVIOContext *pb = buffer ? avio_alloc_context(buffer, kFragmentBufferSize,
+                                                1, out, nullptr, nullptr,
+                                                nullptr)
+                           : nullptr;
+  if (!pb) {
+    av_free(buffer);
+    AvLog(nullptr, AV_LOG_WARNING,
+          "%s: cannot report fragments, no memory.\n", filename);
+    return;
+  }
+  pb->write_data_type = write_fragment;
+  pb->seekable = 0;
+  out->file = oc->pb;
+  oc->pb = pb;
+}
+
+int FfmpegVideoConverter::close_output_pb(OutputFile *of) {
+  AVFormatContext *s = of->ctx;
+  StreamingOutput *out = of->streaming;
+  if (out && !out->file) {
+    // HLS 的文件尾已经写完最后的播放列表并改名
+    finish_listed_segments(out);
+  }
+  if (!out || !out->file) {
+    return close_avio(&s->pb);
+  }
+  // 分片 MP4 的 pb 是包在文件外面的一层，最后一个分片在这里结束
+  if (s->pb) {
+    avio_flush(s->pb);
+    av_freep(&s->pb->buffer);
+    avio_context_free(&s->pb);
+  }
+  if (out->in_fragment) {
+    avio_flush(out->file);
+    finish_segment(out, out->output_file, out->fragment_start,
+                   out->pos - out->fragment_start);
+    out->in_fragment = false;
+  }
+  return close_avio(&out->file);
+}
+
+int FfmpegVideoConverter::close_avio(AVIOContext **pb) {
+  if (*pb && *pb == output_avio_) {
+    output_avio_ = nullptr;
+    return CloseCustomIo(pb);
+  }
+  return avio_closep(pb);
+}
+
+void FfmpegVideoConverter::finish_segment(StreamingOutput *out,
+                                          const std::string &file,
+                                          int64_t offset, int64_t size) {
+  VideoConverter::Response r;
+  r.output_file = out->output_file;
+  r.segment_file = file;
+  r.segment_index = out->next_index++;
+  r.segment_offset = offset;
+  r.segment_size = size;
+  AvLog(nullptr, AV_LOG_VERBOSE,
+        "Segment %d of %s finished: %s, %lld bytes at %lld.\n",
+        r.segment_index, out->output_file.c_str(), file.c_str(),
+        static_cast<long long>(size), static_cast<long long>(offset));
+  PostConvertSegment(r);
+}
+
+void FfmpegVideoConverter::finish_listed_segments(StreamingOutput *out) {
+  for (const auto &segment : out->listed) {
+    out->converter->finish_segment(out, segment.first, 0, segment.second);
+  }
+  out->listed.clear();
+}
+
+int FfmpegVideoConverter::streaming_io_open(AVFormatContext *s,
+                                            AVIOContext **pb, const char *url,
+                                            int flags,
+                                            AVDictionary **options) {
+  // hls 内部的 mp4 封装器和 hls 共用 opaque
+  StreamingOutput *out = static_cast<StreamingOutput *>(s->opaque);
+  // hlsenc 关闭临时播放列表后紧接着改名，再打开下一个文件时改名已经完成
+  finish_listed_segments(out);
+  int ret = out->io_open(s, pb, url, flags, options);
+  if (ret >= 0 && (flags & AVIO_FLAG_WRITE)) {
+    out->urls[*pb] = url;
+  }
+  return ret;
+}
+
+int FfmpegVideoConverter::streaming_io_close2(AVFormatContext *s,
+                                              AVIOContext *pb) {
+  StreamingOutput *out = static_cast<StreamingOutput *>(s->opaque);
+  std::string url;
+  int64_t size = 0;
+  auto it = out->urls.find(pb);
+  if (it != out->urls.end()) {
+    url = it->second;
+    size = avio_tell(pb);
+    out->urls.erase(it);
+  }
+  int ret = out->io_close2(s, pb);
+  if (url.empty() || url == out->init_file) {
+    return ret;
+  }
+  if (url == out->output_file) {
+    // 播放列表更新后才回调，这时列表中已经有新完成的分片
+    out->listed.insert(out->listed.end(), out->finished.begin(),
+                       out->finished.end());
+    out->finished.clear();
+    finish_listed_segments(out);
+  } else if (url == out->output_file + ".tmp") {
+    // 临时播放列表还没有改名，这时回调消费者读到的还是旧列表
+    out->listed.insert(out->listed.end(), out->finished.begin(),
+                       out->finished.end());
+    out->finished.clear();
+  } else {
+    out->finished.emplace_back(url, size);
+  }
+  return ret;
+}
+
+int FfmpegVideoConverter::write_fragment(void *opaque, uint8_t *buf,
+                                         int buf_size, AVIODataMarkerType type,
+                                         int64_t time) {
+  StreamingOutput *out = static_cast<StreamingOutput *>(opaque);
+  // 新分片（moof）或文件尾开始时，上一个分片已经完整写入
+  bool fragment_start = type == AVIO_DATA_MARKER_SYNC_POINT ||
+                        type == AVIO_DATA_MARKER_BOUNDARY_POINT;
+  if ((fragment_start || type == AVIO_DATA_MARKER_TRAILER) &&
+      out->in_fragment) {
+    avio_flush(out->file);
+    out->converter->finish_segment(out, out->output_file, out->fragment_start,
+                                   out->pos - out->fragment_start);
+    out->in_fragment = false;
+  }
+  if (fragment_start) {
+    out->fragment_start = out->pos;
+    out->in_fragment = true;
+  }
+  avio_write(out->file, buf, buf_size);
+  out->pos += buf_size;
+  return out->file->error < 0 ? out->file->error : buf_size;
+}
+
 // FIXME: YUV420P etc. are actually supported with full color range,
 // yet the latter information isn't available here.
 const AVPixelFormat *FfmpegVideoConverter::get_compliance_normal_pix_fmts(
@@ -7959,6 +9008,17 @@ int FfmpegVideoConverter::configure_filtergraph(FilterGraph *fg) {
   const char *graph_desc =
       simple ? fg->outputs[0]->ost->avfilter : fg->graph_desc;
 
+  if (fg->graph) {
+    // 重建滤镜图之前，等编码线程处理完旧滤镜图输出的帧
+    for (i = 0; i < fg->nb_outputs; i++) {
+      OutputStream *ost = fg->outputs[i]->ost;
+      if (ost && ost->encode_stage) {
+        stop_encode_stage(ost, false);
+        if (!start_encode_stage(ost)) return AVERROR(ENOMEM);
+      }
+    }
+  }
+
   cleanup_filtergraph(fg);
   if (!(fg->graph = avfilter_graph_alloc())) return AVERROR(ENOMEM);
 
@@ -7968,7 +9028,12 @@ int FfmpegVideoConverter::configure_filtergraph(FilterGraph *fg) {
     const AVDictionaryEntry *e = nullptr;
 
     if (filter_nbthreads) {
-      ret = av_opt_set(fg->graph, "threads", filter_nbthreads, 0);
+      // 音频滤镜没有分片线程，不需要线程池
+      ret = av_opt_set(fg->graph, "threads",
+                       fg->outputs[0]->type == AVMEDIA_TYPE_AUDIO
+                           ? "1"
+                           : filter_nbthreads,
+                       0);
       if (ret < 0) goto fail;
     } else {
       e = av_dict_get(ost->encoder_opts, "threads", nullptr, 0);
@@ -8000,7 +9065,7 @@ int FfmpegVideoConverter::configure_filtergraph(FilterGraph *fg) {
       0)
     goto fail;
 
-  ret = hw_device_setup_for_filter(fg);
+  ret = hw_device_setup_for_filter(&hw_devices, fg);
   if (ret < 0) goto fail;
 
   if (simple && (!inputs || inputs->next || !outputs || outputs->next)) {
@@ -8160,20 +9225,114 @@ bool FfmpegVideoConverter::filtergraph_is_simple(FilterGraph *fg) {
   return !fg->graph_desc;
 }
 
+void FfmpegVideoConverter::get_progress(int64_t timer_start, int64_t cur_time,
+                                        VideoConverter::Response *r) {
+  // 流水线模式下封装线程在写 oc->pb、结束时间戳和帧数
+  auto lock = lock_muxer();
+  double t = (cur_time - timer_start) / 1000000.0;
+  AVFormatContext *oc = output_files[0]->ctx;
+  int64_t total_size = avio_size(oc->pb);
+  int64_t pts = INT64_MIN + 1;
+  bool vid = false;
+
+  if (total_size <=
+      0)  // FIXME improve avio_size() so it works with non seekable output too
+    total_size = avio_tell(oc->pb);
+
+  for (int i = 0; i < nb_output_streams; i++) {
+    OutputStream *ost = output_streams[i];
+    if (!vid && ost->enc_ctx->codec_type == AVMEDIA_TYPE_VIDEO) {
+      r->frames = ost->frame_number;
+      r->fps = t > 1 ? r->frames / t : 0;
+      vid = true;
+    }
+    /* compute min output value */
+    if (av_stream_get_end_pts(ost->st) != AV_NOPTS_VALUE) {
+      pts = FFMAX(pts, av_rescale_q(av_stream_get_end_pts(ost->st),
+                                    ost->st->time_base, {1, AV_TIME_BASE}));
+      if (copy_ts) {
+        if (copy_ts_first_pts == AV_NOPTS_VALUE && pts > 1)
+          copy_ts_first_pts = pts;
+        if (copy_ts_first_pts != AV_NOPTS_VALUE) pts -= copy_ts_first_pts;
+      }
+    }
+  }
+
+  r->out_time = pts;
+  r->output_bytes = total_size;
+  r->bitrate = pts && total_size >= 0 ? total_size * 8 / (pts / 1000.0) : -1;
+  r->speed = t != 0.0 ? (double)pts / AV_TIME_BASE / t : -1;
+}
+
+int64_t FfmpegVideoConverter::expected_duration(void) {
+  int64_t duration = INT64_MAX;
+  for (int i = 0; i < nb_input_files; i++) {
+    InputFile *f = input_files[i];
+    if (f->ctx->duration == AV_NOPTS_VALUE || f->ctx->duration <= 0) {
+      continue;
+    }
+    int64_t d = f->ctx->duration;
+    if (f->start_time != AV_NOPTS_VALUE) {
+      d -= f->start_time;
+    }
+    if (f->recording_time != INT64_MAX) {
+      d = FFMIN(d, f->recording_time);
+    }
+    duration = duration == INT64_MAX ? d : FFMAX(duration, d);
+  }
+  if (duration == INT64_MAX) {
+    return INT64_MAX;
+  }
+  OutputFile *of = output_files[0];
+  if (of->start_time != AV_NOPTS_VALUE) {
+    duration -= of->start_time;
+  }
+  if (of->recording_time != INT64_MAX) {
+    duration = FFMIN(duration, of->recording_time);
+  }
+  return duration > 0 ? duration : INT64_MAX;
+}
+
+void FfmpegVideoConverter::post_progress(bool is_last_report,
+                                         int64_t timer_start,
+                                         int64_t cur_time) {
+  if (progress_interval_ < 0) {
+    return;
+  }
+  // 按 progress_rate 限频，避免每一步都往 UI 线程投递
+  if (!is_last_report && last_progress_time_ != -1 &&
+      cur_time - last_progress_time_ < progress_interval_) {
+    return;
+  }
+  last_progress_time_ = cur_time;
+
+  VideoConverter::Response r;
+  r.output_file = output_file_;
+  get_progress(timer_start, cur_time, &r);
+  update_pipeline_stats(&r);
+  r.stall_time = stall_time_;
+  r.allocations = allocations_.load();
+  r.out_time = FFMAX(r.out_time, 0);
+  int64_t duration = expected_duration();
+  if (duration != INT64_MAX) {
+    r.percent = FFMIN(100.0, r.out_time * 100.0 / duration);
+    if (r.speed > 0) {
+      r.eta = static_cast<int64_t>(FFMAX(duration - r.out_time, 0) / r.speed);
+    }
+  }
+  this->PostConvertProgress(r);
+}
+
 void FfmpegVideoConverter::print_report(bool is_last_report,
                                         int64_t timer_start, int64_t cur_time) {
   AVBPrint buf, buf_script;
   OutputStream *ost;
-  AVFormatContext *oc;
   int64_t total_size;
   AVCodecContext *enc;
   int vid, i;
   double bitrate;
   double speed;
-  int64_t pts = INT64_MIN + 1;
-  static int64_t last_time = -1;
-  static int first_report = 1;
-  static int qp_histogram[52];
+  int64_t pts;
   int hours, mins, secs, us;
   const char *hours_sign;
   int ret;
@@ -8184,23 +9343,26 @@ void FfmpegVideoConverter::print_report(bool is_last_report,
   }
 
   if (!is_last_report) {
-    if (last_time == -1) {
-      last_time = cur_time;
+    if (report_last_time == -1) {
+      report_last_time = cur_time;
     }
-    if (((cur_time - last_time) < stats_period && !first_report) ||
+    if (((cur_time - report_last_time) < stats_period && !first_report) ||
         (first_report && nb_output_dumped < nb_output_files))
       return;
-    last_time = cur_time;
+    report_last_time = cur_time;
   }
 
   t = (cur_time - timer_start) / 1000000.0;
 
-  oc = output_files[0]->ctx;
-
-  total_size = avio_size(oc->pb);
-  if (total_size <=
-      0)  // FIXME improve avio_size() so it works with non seekable output too
-    total_size = avio_tell(oc->pb);
+  // 与 get_progress 一样，下面读的帧数和编码质量在流水线模式下由
+  // 编码和封装线程更新
+  auto lock = lock_muxer();
+  VideoConverter::Response progress;
+  get_progress(timer_start, cur_time, &progress);
+  total_size = progress.output_bytes;
+  pts = progress.out_time;
+  bitrate = progress.bitrate;
+  speed = progress.speed;
 
   vid = 0;
   av_bprint_init(&buf, 0, AV_BPRINT_SIZE_AUTOMATIC);
@@ -8267,18 +9429,6 @@ void FfmpegVideoConverter::print_report(bool is_last_report,
       }
       vid = 1;
     }
-    static int64_t copy_ts_first_pts = AV_NOPTS_VALUE;
-    /* compute min output value */
-    if (av_stream_get_end_pts(ost->st) != AV_NOPTS_VALUE) {
-      pts = FFMAX(pts, av_rescale_q(av_stream_get_end_pts(ost->st),
-                                    ost->st->time_base, {1, AV_TIME_BASE}));
-      if (copy_ts) {
-        if (copy_ts_first_pts == AV_NOPTS_VALUE && pts > 1)
-          copy_ts_first_pts = pts;
-        if (copy_ts_first_pts != AV_NOPTS_VALUE) pts -= copy_ts_first_pts;
-      }
-    }
-
     if (is_last_report) nb_frames_drop += ost->last_dropped;
   }
 
@@ -8290,9 +9440,6 @@ void FfmpegVideoConverter::print_report(bool is_last_report,
   mins %= 60;
   hours_sign = (pts < 0) ? "-" : "";
 
-  bitrate = pts && total_size >= 0 ? total_size * 8 / (pts / 1000.0) : -1;
-  speed = t != 0.0 ? (double)pts / AV_TIME_BASE / t : -1;
-
   if (total_size < 0)
     av_bprintf(&buf, "size=N/A time=");
   else
@@ -8327,11 +9474,13 @@ void FfmpegVideoConverter::print_report(bool is_last_report,
                hours, mins, secs, us);
   }
 
-  if (nb_frames_dup || nb_frames_drop)
-    av_bprintf(&buf, " dup=%" PRId64 " drop=%" PRId64, nb_frames_dup,
-               nb_frames_drop);
-  av_bprintf(&buf_script, "dup_frames=%" PRId64 "\n", nb_frames_dup);
-  av_bprintf(&buf_script, "drop_frames=%" PRId64 "\n", nb_frames_drop);
+  int64_t frames_dup = nb_frames_dup;
+  int64_t frames_drop = nb_frames_drop;
+  if (frames_dup || frames_drop)
+    av_bprintf(&buf, " dup=%" PRId64 " drop=%" PRId64, frames_dup,
+               frames_drop);
+  av_bprintf(&buf_script, "dup_frames=%" PRId64 "\n", frames_dup);
+  av_bprintf(&buf_script, "drop_frames=%" PRId64 "\n", frames_drop);
 
   if (speed < 0) {
     av_bprintf(&buf, " speed=N/A");
@@ -8523,7 +9672,16 @@ void FfmpegVideoConverter::InputOption::UnInit() {
 FfmpegVideoConverter::OutputOption::~OutputOption() { UnInit(); }
 
 void FfmpegVideoConverter::OutputOption::Init() {
-  if (!vbitrate.empty()) {
+  if (!vpreset.empty()) {
+    av_dict_set(&codec_opts, "preset:v", vpreset.c_str(), 0);
+  }
+  if (vcrf >= 0) {
+    av_dict_set_int(&codec_opts, "crf:v", vcrf, 0);
+    if (vmaxrate > 0) {
+      av_dict_set_int(&codec_opts, "maxrate:v", vmaxrate, 0);
+      av_dict_set_int(&codec_opts, "bufsize:v", vmaxrate * 2, 0);
+    }
+  } else if (!vbitrate.empty()) {
     av_dict_set(&codec_opts, "b:v",
                 (vbitrate.empty() ? nullptr : vbitrate.c_str()), 0);
   }
@@ -8587,6 +9745,8 @@ int64_t getmaxrss(void) {
 }  // namespace
 
 void FfmpegVideoConverter::cleanup(bool success) {
+  stop_pipeline(true);
+
   if (do_benchmark) {
     int maxrss = getmaxrss() / 1024;
     AvLog(NULL, AV_LOG_INFO, "bench: maxrss=%ikB\n", maxrss);
@@ -8677,6 +9837,7 @@ void FfmpegVideoConverter::cleanup(bool success) {
     av_packet_free(&input_files[i]->pkt);
     av_freep(&input_files[i]);
   }
+  CloseCustomIo(&input_avio_);
   for (int i = 0; i < nb_input_streams; i++) {
     InputStream *ist = input_streams[i];
 
@@ -8722,8 +9883,16 @@ void FfmpegVideoConverter::cleanup(bool success) {
 
 void FfmpegVideoConverter::Run(void *arg) {
   auto converter = static_cast<FfmpegVideoConverter *>(arg);
-  converter->Convert(converter->input_file_, converter->output_file_);
+  bool succeeded =
+      converter->Convert(converter->input_file_, converter->output_file_);
   VideoConverter::Response r;
   r.output_file = converter->output_file_;
+  r.succeeded = succeeded;
+  for (const auto &output : converter->outputs_) {
+    r.output_files.push_back(output.output_file);
+  }
+  r.stall_time = converter->stall_time_;
+  r.allocations = converter->allocations_.load();
+  r.copied_streams = converter->copied_streams_;
   converter->PostConvertEnd(r);
 }
@@ -25,11 +25,17 @@ extern "C" {
 }
 #endif
 
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
 #include <string>
 #include <thread>
 #include <unordered_map>
 #include <vector>
 
+#include "ffmpeg_content_analyzer.h"
+#include "ffmpeg_pipeline.h"
+#include "ffmpeg_profiler.h"
 #include "ffmpeg_util.h"
 
 enum VideoSyncMethod {
@@ -47,12 +53,31 @@ enum HWAccelID {
   HWACCEL_GENERIC,
 };
 
+// 两遍编码的统计数据，第一遍写入，第二遍读取
+struct PassStats {
+  std::string data;  // 编码器输出的 stats_out，保存在内存中
+  std::string file;  // libx264 只能通过文件读写统计数据
+};
+
+// 视频编码质量，EnablePsnr() 之后编码器输出每帧的误差，所有视频输出流合计
+struct VideoQuality {
+  int64_t frames{0};  // 已编码的视频帧数
+  double psnr{-1};    // dB，编码器不输出误差时为 -1
+};
+
 struct HWDevice {
   const char *name;
   AVHWDeviceType type;
   AVBufferRef *device_ref;
 };
 
+// 每个转码实例各自的硬件设备列表
+struct HWDeviceList {
+  int nb_hw_devices{0};
+  HWDevice **hw_devices{nullptr};
+  HWDevice *filter_hw_device{nullptr};
+};
+
 /* select an input stream for an output stream */
 struct StreamMap {
   int disabled; /* 1 is this mapping is disabled by a negative map */
@@ -244,10 +269,16 @@ struct InputStream {
 
   int64_t *dts_buffer;
   int nb_dts_buffer;
+  unsigned int dts_buffer_size; /* allocated size in bytes */
 
   bool got_output;
+
+  StreamProfiler *profiler;  // 开启统计时不为空
 };
 
+struct DemuxStage;
+struct EncodeStage;
+
 struct InputFile {
   AVFormatContext *ctx;
   bool eof_reached;     /* true if eof reached */
@@ -274,6 +305,11 @@ struct InputFile {
   bool accurate_seek;
 
   AVPacket *pkt;
+
+  /* pipelined mode: packets are read by a dedicated demux thread */
+  DemuxStage *demux_stage;
+  bool non_blocking;
+  int thread_queue_size;
 };
 
 enum forced_keyframes_const {
@@ -362,6 +398,7 @@ struct OutputStream {
 
   char *logfile_prefix{nullptr};
   FILE *logfile{nullptr};
+  PassStats *pass_stats{nullptr};
 
   OutputFilter *filter;
   char *avfilter;
@@ -426,6 +463,40 @@ struct OutputStream {
 
   /* frame encode sum of squared error values */
   int64_t error[4];
+
+  /* pipelined mode: filtered frames are encoded on a dedicated thread */
+  EncodeStage *encode_stage;
+  StreamProfiler *profiler;  // 开启统计时不为空
+};
+
+class FfmpegVideoConverter;
+
+// 流式输出的一路输出文件
+// HLS 通过 io_open/io_close2 记录关闭的分片文件，播放列表写完后回调；
+// event 类型的播放列表先写 .m3u8.tmp 再改名，改名之后才回调；
+// 分片 MP4 在文件的 AVIOContext 外面包一层，根据 movenc 写入的数据标记
+// 找出每个分片的边界
+struct StreamingOutput {
+  FfmpegVideoConverter *converter{nullptr};
+  std::string output_file;
+  int next_index{0};
+
+  // HLS
+  std::string init_file;
+  int (*io_open)(AVFormatContext *s, AVIOContext **pb, const char *url,
+                 int flags, AVDictionary **options){nullptr};
+  int (*io_close2)(AVFormatContext *s, AVIOContext *pb){nullptr};
+  std::unordered_map<AVIOContext *, std::string> urls;
+  // 已关闭、等播放列表更新后回调的分片及其大小
+  std::vector<std::pair<std::string, int64_t>> finished;
+  // 已写入临时播放列表、等改名后（下一次 io_open 或者写完文件尾）回调的分片
+  std::vector<std::pair<std::string, int64_t>> listed;
+
+  // 分片 MP4
+  AVIOContext *file{nullptr};
+  int64_t pos{0};
+  int64_t fragment_start{0};
+  bool in_fragment{false};
 };
 
 struct OutputFile {
@@ -444,6 +515,54 @@ struct OutputFile {
   bool shortest;
 
   bool header_written;
+
+  StreamingOutput *streaming;  // 流式输出时不为空
+};
+
+// 流水线模式下的解封装阶段，每个输入文件一个线程
+struct DemuxStage {
+  DemuxStage(size_t queue_size, std::atomic<int64_t> *allocations)
+      : packet_pool(queue_size + 2, allocations), queue(queue_size) {}
+
+  ObjectPool<AVPacket> packet_pool;
+  BoundedQueue<AVPacket *> queue;
+  std::thread thread;
+  // av_read_frame() 的最后一个错误码，队列取空后返回给解码阶段
+  std::atomic_int read_ret{0};
+  // 读到 EAGAIN 时在这里等到重试时间，停止时提前唤醒
+  std::mutex retry_mutex;
+  std::condition_variable retry_cv;
+  bool stopping{false};
+};
+
+// 编码阶段，每个需要编码的输出流一个线程，音视频编码互不等待
+// 队列中的空帧表示视频流结束
+struct EncodeStage {
+  EncodeStage(size_t queue_size, std::atomic<int64_t> *allocations)
+      : frame_pool(queue_size + 2, allocations), queue(queue_size) {}
+
+  ObjectPool<AVFrame> frame_pool;
+  BoundedQueue<AVFrame *> queue;
+  std::thread thread;
+};
+
+// 编码器输出的数据包，时间基仍是编码器的时间基，由封装阶段转换
+struct EncodedPacket {
+  OutputFile *of;
+  OutputStream *ost;
+  AVPacket *pkt;
+  bool eof;
+};
+inline void ReleaseQueueItem(EncodedPacket &item) {
+  av_packet_free(&item.pkt);
+}
+
+// 封装阶段，所有输出文件共用一个线程
+struct MuxStage {
+  explicit MuxStage(size_t queue_size) : queue(queue_size) {}
+
+  BoundedQueue<EncodedPacket> queue;
+  std::thread thread;
 };
 
 class FfmpegVideoConverter : public BaseVideoConverter {
@@ -460,6 +579,22 @@ class FfmpegVideoConverter : public BaseVideoConverter {
 
   void Start() override;
   void Stop() override;
+  VideoConverter::Profile GetProfile() const override;
+
+  // 只转码输入文件的一个时间窗口，单位微秒，start_time 通过输入 seek 定位
+  void SetTimeWindow(int64_t start_time, int64_t recording_time);
+  // 不输出视频流或音频流
+  void DisableStreams(bool video, bool audio);
+  // 两遍编码的第几遍（1 或 2），只作用于第一路视频输出流
+  void SetPass(int pass, PassStats *stats);
+  // 编码器输出每帧的误差（AV_CODEC_FLAG_PSNR），用于比较编码参数
+  void EnablePsnr();
+  // 转码结束后调用
+  VideoQuality GetVideoQuality() const;
+  // 转码结束后调用，出错或者被 Stop() 中断时为 false，输出文件不完整
+  bool Succeeded() const;
+  // 使用外部（整个文件）的内容分析结果，不再自己分析
+  void SetContentComplexity(const ContentComplexity &content);
 
  private:
   bool Convert(const std::string &input, const std::string &output);
@@ -469,10 +604,16 @@ class FfmpegVideoConverter : public BaseVideoConverter {
   bool ApplySyncOffsets();
   bool InitComplexFilters();
   bool OpenOutputFile();
+  void ApplyOutputSpec(const VideoConverter::OutputSpec &spec);
+  // 按内容复杂度推算码率，在打开输出文件之前调用
+  void AnalyzeContent();
+  void ApplyContentBitrate(const VideoConverter::OutputSpec &spec);
 
  private:
   // input file
   int open_input_file(const char *filename);
+  // 打开自定义输入或流式输入的 AVIOContext，都不是时 input_avio_ 保持为空
+  int open_input_avio(const char *filename, const AVIOInterruptCB &int_cb);
   bool add_input_streams(AVFormatContext *ic);
   bool check_output_constraints(InputStream *ist, OutputStream *ost);
   bool do_streamcopy(InputStream *ist, OutputStream *ost, const AVPacket *pkt);
@@ -498,6 +639,9 @@ class FfmpegVideoConverter : public BaseVideoConverter {
   const AVCodec *find_codec_or_die(const char *name, enum AVMediaType type,
                                    bool encoder);
   bool choose_encoder(AVFormatContext *s, OutputStream *ost);
+  // 源流已经是目标编码且不需要缩放、裁剪和降码率时直接复制
+  bool can_stream_copy(AVFormatContext *oc, OutputStream *ost,
+                       InputStream *ist);
   int get_preset_file_2(const char *preset_name, const char *codec_name,
                         AVIOContext **s);
   char *get_line(AVIOContext *s, AVBPrint *bprint);
@@ -571,10 +715,34 @@ class FfmpegVideoConverter : public BaseVideoConverter {
   int get_input_packet(InputFile *f, AVPacket **pkt);
   bool got_eagain();
   void reset_eagain();
+  void wait_for_input(void);
+  void notify_input_ready(void);
   bool flush_encoders(void);
   bool update_video_stats(OutputStream *ost, const AVPacket *pkt,
                           int write_vstats);
   int encode_frame(OutputFile *of, OutputStream *ost, AVFrame *frame);
+  bool encode_filtered_frame(OutputFile *of, OutputStream *ost,
+                             AVFrame *frame);
+
+  // pipeline
+  bool start_pipeline(void);
+  void stop_pipeline(bool abort);
+  bool start_demux_stage(InputFile *f);
+  void stop_demux_stage(InputFile *f);
+  bool start_encode_stage(OutputStream *ost);
+  void stop_encode_stage(OutputStream *ost, bool abort);
+  void demux_thread(InputFile *f);
+  void encode_thread(OutputStream *ost);
+  void mux_thread(MuxStage *stage);
+  int send_to_encode_stage(OutputStream *ost, AVFrame *frame);
+  bool submit_encoded_packet(OutputFile *of, OutputStream *ost, AVPacket *pkt,
+                             bool eof);
+  std::unique_lock<std::recursive_mutex> lock_muxer(void);
+  void update_pipeline_stats(VideoConverter::Response *r);
+
+  // profile
+  void init_profilers(void);
+  StreamProfiler *demux_profiler(InputFile *f, AVPacket *pkt);
 
   // hw
   HWDevice *hw_device_get_by_name(const char *name);
@@ -627,8 +795,30 @@ class FfmpegVideoConverter : public BaseVideoConverter {
   bool filtergraph_is_simple(FilterGraph *fg);
   void print_report(bool is_last_report, int64_t timer_start, int64_t cur_time);
   void print_final_stats(int64_t total_size);
+  // 帧数、帧率、输出时长、大小、码率和速度，print_report 和进度回调共用
+  void get_progress(int64_t timer_start, int64_t cur_time,
+                    VideoConverter::Response *r);
+  // 输出的预计总时长，单位微秒，未知时返回 INT64_MAX
+  int64_t expected_duration(void);
+  void post_progress(bool is_last_report, int64_t timer_start,
+                     int64_t cur_time);
 
   static int decode_interrupt_cb(void *ctx);
+
+  // 流式输出
+  void init_streaming_output(OutputFile *of, const char *filename);
+  int close_output_pb(OutputFile *of);
+  // 自定义输出的 pb 用 CloseCustomIo 释放
+  int close_avio(AVIOContext **pb);
+  static void finish_listed_segments(StreamingOutput *out);
+  void finish_segment(StreamingOutput *out, const std::string &file,
+                      int64_t offset, int64_t size);
+  static int streaming_io_open(AVFormatContext *s, AVIOContext **pb,
+                               const char *url, int flags,
+                               AVDictionary **options);
+  static int streaming_io_close2(AVFormatContext *s, AVIOContext *pb);
+  static int write_fragment(void *opaque, uint8_t *buf, int buf_size,
+                            AVIODataMarkerType type, int64_t time);
     
   void cleanup(bool succ);
 
@@ -671,6 +861,11 @@ class FfmpegVideoConverter : public BaseVideoConverter {
   int abort_on_flags{0};
   int print_stats{-1};
   int64_t stats_period{500000};
+  // print_report 的状态
+  int64_t report_last_time{-1};
+  int first_report{1};
+  int qp_histogram[52]{};
+  int64_t copy_ts_first_pts{AV_NOPTS_VALUE};
   int qp_hist{0};
   AVIOContext *progress_avio{nullptr};
   float max_error_rate{2.0f / 3};
@@ -682,11 +877,11 @@ class FfmpegVideoConverter : public BaseVideoConverter {
 
   // TODO:用输入参数来支持option
   // const OptionDef options[];
-  HWDevice *filter_hw_device;
+  HWDeviceList hw_devices;
 
   bool want_sdp{true};
   unsigned nb_output_dumped;
-  int main_return_code;
+  int main_return_code{0};
 
   // 输入选项
   struct InputOption {
@@ -856,6 +1051,10 @@ class FfmpegVideoConverter : public BaseVideoConverter {
     //
     std::string vbitrate;
     std::string abitrate;
+    // 编码器支持时生效，设置 vcrf 时按固定质量编码，不再设置码率
+    std::string vpreset;
+    int vcrf{-1};
+    int64_t vmaxrate{0};  // 单位 bit/s，固定质量编码时的码率上限
     int64_t threads{0};
 
     // video size
@@ -869,9 +1068,10 @@ class FfmpegVideoConverter : public BaseVideoConverter {
   bool find_stream_info{true};
   std::atomic_bool received_sigterm{false};
 
-  int64_t nb_frames_dup{0};
-  uint64_t dup_warning{1000};
-  int64_t nb_frames_drop{0};
+  // 流水线模式下各编码线程累加，转码线程输出进度时读取
+  std::atomic<int64_t> nb_frames_dup{0};
+  std::atomic<uint64_t> dup_warning{1000};
+  std::atomic<int64_t> nb_frames_drop{0};
   int64_t decode_error_stat[2]{0};
 
   FILE *vstats_file{nullptr};
@@ -887,4 +1087,71 @@ class FfmpegVideoConverter : public BaseVideoConverter {
   //
   std::unique_ptr<std::thread> worker_;
   static void Run(void *converter);
+
+  // 所有输出，每路一个 OutputFile
+  std::vector<VideoConverter::OutputSpec> outputs_;
+  bool auto_stream_copy_{true};
+  // 自动改为直接复制的输出流，"输出文件序号:流序号"
+  std::vector<std::string> copied_streams_;
+  // 自定义输入输出，不为空时替代 input_file_/output_file_ 的文件读写
+  VideoConverter::IoSource io_source_;
+  VideoConverter::IoSink io_sink_;
+  int io_buffer_size_{0};
+  AVIOContext *input_avio_{nullptr};
+  // 管道、socket 等不能 seek 的输入，边到达边转码
+  bool streaming_input_{false};
+  // 用缓存的探测结果代替 avformat_find_stream_info
+  bool probe_cache_{true};
+  // 按内容复杂度选码率
+  bool content_adaptive_{false};
+  bool content_ready_{false};
+  ContentComplexity content_;
+  AVIOContext *output_avio_{nullptr};
+  // 流式输出，"fmp4" 或 "hls"，为空时不是流式输出
+  std::string streaming_format_;
+  int64_t fragment_duration_{0};  // 微秒
+  // Convert() 的结果，见 Succeeded()
+  std::atomic_bool succeeded_{false};
+  // 两遍编码
+  int pass_{0};
+  PassStats *pass_stats_{nullptr};
+  bool pass_stream_assigned_{false};
+  // 编码器输出的误差平方和及对应的满量程，用来计算平均 PSNR
+  // 每路视频输出流一个编码线程，都累加到这里
+  std::atomic<int64_t> video_frames_{0};
+  std::atomic<double> video_psnr_error_{0};
+  std::atomic<double> video_psnr_scale_{0};
+
+  // 各阶段耗时统计，转码结束后仍然保留
+  bool profile_{false};
+  mutable std::mutex profile_mutex_;
+  std::vector<std::unique_ptr<StreamProfiler>> profilers_;
+
+  // 新分配 AVPacket/AVFrame 及缓冲区的次数，稳定运行后不应再增长
+  std::atomic<int64_t> allocations_{0};
+  // 编码后的数据包，流水线的封装队列和写文件头之前的 muxing_queue 共用
+  ObjectPool<AVPacket> packet_pool_;
+
+  // 流水线模式
+  bool pipelined_{false};
+  // 进度回调的最小间隔，单位微秒，<0 表示不回调
+  int64_t progress_interval_{100000};
+  int64_t last_progress_time_{-1};
+  std::unique_ptr<MuxStage> mux_stage_;
+  // 流水线运行时保护封装器及输出流的封装状态，以及转码线程读取的进度
+  // （frame_number、finished、编码质量等）；同一线程可能嵌套加锁
+  std::recursive_mutex mux_mutex_;
+
+  // 所有输出流都在等待输入时，transcode_step() 在这里睡眠，
+  // 直到有输入数据或者到达预计可读的时间
+  std::mutex input_ready_mutex_;
+  std::condition_variable input_ready_cv_;
+  bool input_ready_{false};
+  // 最早可以重新读取输入的时间，av_gettime_relative() 时钟
+  int64_t input_wakeup_time_{INT64_MAX};
+  // 有解封装线程会在数据就绪时通知
+  bool input_notify_pending_{false};
+  // 单位微秒，等待输入的累计时间，包括解封装线程等待 demuxer 就绪的时间
+  std::atomic<int64_t> stall_time_{0};
+  std::atomic<int64_t> nb_stalls_{0};
 };
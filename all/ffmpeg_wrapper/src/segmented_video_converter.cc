@@ -0,0 +1,888 @@
+#include "segmented_video_converter.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+
+#include "ffmpeg_probe_cache.h"
+#include "ffmpeg_util.h"
+#include "ffmpeg_video_converter.h"
+
+namespace {
+
+// 单位微秒，自动分段时每段的最短时长，太短的分段拼接和启动的开销不划算
+constexpr int64_t kMinSegmentDuration = 60 * AV_TIME_BASE;
+
+// 按顺序读取多个文件中同一类型的流，时间戳加上各文件的偏移量，
+// 用于把分段转码的结果拼接起来
+struct ConcatInput {
+  AVMediaType type{AVMEDIA_TYPE_UNKNOWN};
+  std::vector<std::string> files;
+  std::vector<int64_t> offsets;  // 微秒
+  size_t current{0};
+
+  AVFormatContext *ctx{nullptr};
+  int stream_index{-1};
+  AVStream *out_stream{nullptr};
+  AVPacket *pkt{nullptr};
+  bool has_packet{false};
+  int64_t last_dts{AV_NOPTS_VALUE};  // out_stream 时间基
+};
+
+int OpenConcatFile(ConcatInput *in) {
+  const char *filename = in->files[in->current].c_str();
+  int ret = avformat_open_input(&in->ctx, filename, nullptr, nullptr);
+  if (ret < 0) {
+    PrintError(filename, ret);
+    return ret;
+  }
+  ret = avformat_find_stream_info(in->ctx, nullptr);
+  if (ret < 0) {
+    PrintError(filename, ret);
+    avformat_close_input(&in->ctx);
+    return ret;
+  }
+  ret = av_find_best_stream(in->ctx, in->type, -1, -1, nullptr, 0);
+  if (ret < 0) {
+    AvLog(nullptr, AV_LOG_ERROR, "%s: no %s stream.\n", filename,
+          av_get_media_type_string(in->type));
+    avformat_close_input(&in->ctx);
+    return ret;
+  }
+  in->stream_index = ret;
+  return 0;
+}
+
+void CloseConcatInput(ConcatInput *in) {
+  avformat_close_input(&in->ctx);
+  av_packet_free(&in->pkt);
+  in->has_packet = false;
+}
+
+// 读取下一个数据包，所有文件都读完后 has_packet 为 false
+int ReadConcatPacket(ConcatInput *in) {
+  in->has_packet = false;
+  while (in->current < in->files.size()) {
+    if (!in->ctx) {
+      int ret = OpenConcatFile(in);
+      if (ret < 0) {
+        return ret;
+      }
+    }
+    int ret = av_read_frame(in->ctx, in->pkt);
+    if (ret < 0) {
+      if (ret != AVERROR_EOF) {
+        PrintError(in->files[in->current].c_str(), ret);
+      }
+      avformat_close_input(&in->ctx);
+      in->current++;
+      continue;
+    }
+    if (in->pkt->stream_index != in->stream_index) {
+      av_packet_unref(in->pkt);
+      continue;
+    }
+
+    AVRational out_tb = in->out_stream->time_base;
+    av_packet_rescale_ts(in->pkt, in->ctx->streams[in->stream_index]->time_base,
+                         out_tb);
+    // 分段文件自身的起始时间（如 MPEG-TS 默认的 1.4 秒延时）不计入
+    int64_t offset = in->offsets[in->current];
+    if (in->ctx->start_time != AV_NOPTS_VALUE) {
+      offset -= in->ctx->start_time;
+    }
+    offset = av_rescale_q(offset, {1, AV_TIME_BASE}, out_tb);
+    if (in->pkt->pts != AV_NOPTS_VALUE) in->pkt->pts += offset;
+    if (in->pkt->dts != AV_NOPTS_VALUE) in->pkt->dts += offset;
+    // 分段边界处 B 帧的 dts 可能与上一段重叠
+    if (in->pkt->dts != AV_NOPTS_VALUE && in->last_dts != AV_NOPTS_VALUE &&
+        in->pkt->dts <= in->last_dts) {
+      in->pkt->dts = in->last_dts + 1;
+      if (in->pkt->pts != AV_NOPTS_VALUE && in->pkt->pts < in->pkt->dts) {
+        in->pkt->pts = in->pkt->dts;
+      }
+    }
+    if (in->pkt->dts != AV_NOPTS_VALUE) in->last_dts = in->pkt->dts;
+    in->pkt->stream_index = in->out_stream->index;
+    in->has_packet = true;
+    return 0;
+  }
+  return 0;
+}
+
+// 精确裁剪拼接出的视频中，重新编码的头尾和直接复制的中间一段参数集
+// （SPS/PPS 等）不同，都在码流中携带。封装把参数集放在文件头时
+// （如 mp4 的 avcC），要用 avc3/hev1 这类允许码流中参数集变化的标签，
+// 否则文件头与大部分数据不符，很多播放器拒绝播放
+// tag 为拼接时输出流要用的标签，0 表示默认；封装不支持时返回 false
+bool InBandParameterSetTag(const AVOutputFormat *oformat, AVCodecID codec_id,
+                           unsigned int *tag) {
+  *tag = 0;
+  if (!oformat || !(oformat->flags & AVFMT_GLOBALHEADER)) {
+    return true;
+  }
+  unsigned int in_band = 0;
+  if (codec_id == AV_CODEC_ID_H264) {
+    in_band = MKTAG('a', 'v', 'c', '3');
+  } else if (codec_id == AV_CODEC_ID_HEVC) {
+    in_band = MKTAG('h', 'e', 'v', '1');
+  }
+  if (!in_band || !oformat->codec_tag ||
+      av_codec_get_id(oformat->codec_tag, in_band) != codec_id) {
+    return false;
+  }
+  *tag = in_band;
+  return true;
+}
+
+}  // namespace
+
+SegmentedVideoConverter::SegmentedVideoConverter(
+    const VideoConverter::Request &request, VideoConverter::Delegate *delegate,
+    VideoConverter::AsyncCallFuncType call_fun)
+    : BaseVideoConverter(request, delegate, call_fun), request_(request) {}
+
+SegmentedVideoConverter::~SegmentedVideoConverter() {
+  if (worker_) {
+    worker_->join();
+  }
+}
+
+void SegmentedVideoConverter::Start() {
+  if (async_call_fun_) {
+    worker_ = std::make_unique<std::thread>(SegmentedVideoConverter::Run, this);
+  } else {
+    SegmentedVideoConverter::Run(this);
+  }
+}
+void SegmentedVideoConverter::Stop() {
+  stopped_ = true;
+  {
+    std::lock_guard<std::mutex> lock(converters_mutex_);
+    for (auto &converter : converters_) {
+      converter->Stop();
+    }
+  }
+  if (worker_) {
+    worker_->join();
+  }
+}
+
+bool SegmentedVideoConverter::Convert() {
+  AnalyzeTitle();
+  if (request_.checkpoint_interval > 0 && !request_.smart_cut) {
+    return ConvertCheckpointed();
+  }
+  std::vector<Segment> segments;
+  bool has_audio = false;
+  if (!PlanSegments(&segments, &has_audio)) {
+    return false;
+  }
+
+  if (segments.size() <= 1) {
+    // 不值得分段，按普通方式转码，精确裁剪只有复制的一段时整体复制视频
+    VideoConverter::Request request = request_;
+    request.parallel_segments = 0;
+    if (!segments.empty() && segments.front().stream_copy) {
+      request.video_encoder = "copy";
+    }
+    auto converter = AddConverter(request);
+    if (!converter) {
+      return false;
+    }
+    converter->Start();
+    return converter->Succeeded() && !stopped_;
+  }
+
+  std::string audio_file = has_audio ? TempFileName("audio") : std::string();
+  bool ret = RunConverters(segments, audio_file) && !stopped_ &&
+             ConcatSegments(segments, audio_file);
+
+  for (const auto &segment : segments) {
+    std::remove(segment.output_file.c_str());
+  }
+  if (!audio_file.empty()) {
+    std::remove(audio_file.c_str());
+  }
+  return ret;
+}
+
+bool SegmentedVideoConverter::ConvertCheckpointed() {
+  std::vector<Segment> segments;
+  bool has_audio = false;
+  std::string journal = output_file_ + ".journal";
+  std::string key = JournalKey();
+  if (LoadJournal(journal, key, &segments, &has_audio)) {
+    AvLog(nullptr, AV_LOG_INFO, "Resume %s from %s.\n", output_file_.c_str(),
+          journal.c_str());
+  } else {
+    if (!PlanSegments(&segments, &has_audio) ||
+        !SaveJournal(journal, key, segments, has_audio)) {
+      return false;
+    }
+  }
+
+  // 逐段转码，每段都是完整的文件，完成后记入日志，
+  // 重新开始时跳过已完成的段，最多重做一段
+  for (size_t i = 0; i < segments.size(); i++) {
+    Segment &segment = segments[i];
+    if (!segment.done) {
+      VideoConverter::Request request = request_;
+      request.output_file = segment.output_file;
+      request.output_video_start_time = 0;
+      request.output_video_record_time = 0;
+      request.parallel_segments = 0;
+      request.checkpoint_interval = 0;
+      auto converter = AddConverter(request);
+      if (!converter) {
+        return false;
+      }
+      converter->SetTimeWindow(segment.start_time, segment.recording_time);
+      converter->Start();
+      if (stopped_) {
+        // 保留日志和已完成的段，下次从这一段继续
+        return false;
+      }
+      if (!converter->Succeeded()) {
+        // 不完整的段不记入日志，重新开始时从这一段重做
+        AvLog(nullptr, AV_LOG_ERROR, "%s: segment %d failed.\n",
+              output_file_.c_str(), static_cast<int>(i));
+        std::remove(segment.output_file.c_str());
+        return false;
+      }
+      segment.done = true;
+      if (!AppendJournal(journal, i)) {
+        return false;
+      }
+    }
+    if (request_.progress_rate > 0) {
+      VideoConverter::Response r;
+      r.output_file = output_file_;
+      r.percent = (i + 1) * 100.0 / segments.size();
+      PostConvertProgress(r);
+    }
+  }
+
+  // 所有段都完成后拼接成请求的封装格式，成功后才删除分段和日志
+  if (!ConcatSegments(segments, std::string(), has_audio)) {
+    return false;
+  }
+  for (const auto &segment : segments) {
+    std::remove(segment.output_file.c_str());
+  }
+  std::remove(journal.c_str());
+  return true;
+}
+
+std::string SegmentedVideoConverter::JournalKey() const {
+  // 请求或者输入文件变化后不能接着转，大小不变的覆盖写入靠修改时间区分
+  std::error_code ec;
+  std::filesystem::path input(input_file_);
+  auto size = std::filesystem::file_size(input, ec);
+  int64_t input_size = ec ? -1 : static_cast<int64_t>(size);
+  auto mtime = std::filesystem::last_write_time(input, ec);
+  int64_t input_mtime =
+      ec ? -1 : static_cast<int64_t>(mtime.time_since_epoch().count());
+  // 直接保存原文，std::hash 的结果换了编译器或版本就会变
+  std::stringstream ss;
+  ss << input_file_ << '|' << input_size << '|' << input_mtime << '|'
+     << request_.output_file_format << '|' << request_.video_encoder << '|'
+     << request_.audio_encoder << '|' << request_.output_video_width << 'x'
+     << request_.output_video_height << '|'
+     << request_.output_video_start_time << '|'
+     << request_.output_video_record_time << '|'
+     << request_.output_video_bitrate << '|' << request_.output_audio_bitrate
+     << '|' << request_.checkpoint_interval << '|' << request_.video_preset
+     << '|' << request_.video_crf << '|' << request_.content_adaptive;
+  return ss.str();
+}
+
+// 日志格式：
+//   checkpoint <has_audio> <key>（key 到行尾，可能包含空格）
+//   segment <start_time> <recording_time> <file>
+//   done <index>
+bool SegmentedVideoConverter::LoadJournal(const std::string &journal,
+                                          const std::string &key,
+                                          std::vector<Segment> *segments,
+                                          bool *has_audio) const {
+  std::ifstream in(journal);
+  std::string line;
+  if (!in || !std::getline(in, line)) {
+    return false;
+  }
+  std::istringstream header(line);
+  std::string tag, journal_key;
+  int audio = 0;
+  bool parsed = false;
+  if (header >> tag >> audio) {
+    header >> std::ws;
+    parsed = static_cast<bool>(std::getline(header, journal_key));
+  }
+  if (!parsed || tag != "checkpoint" || journal_key != key) {
+    AvLog(nullptr, AV_LOG_WARNING, "Ignore stale checkpoint %s.\n",
+          journal.c_str());
+    return false;
+  }
+  *has_audio = audio != 0;
+
+  segments->clear();
+  while (std::getline(in, line)) {
+    std::istringstream ss(line);
+    if (!(ss >> tag)) {
+      continue;
+    }
+    if (tag == "segment") {
+      Segment segment;
+      if (ss >> segment.start_time >> segment.recording_time) {
+        ss >> std::ws;
+        std::getline(ss, segment.output_file);
+        segments->push_back(segment);
+      }
+    } else if (tag == "done") {
+      // 写了一半的行会被忽略，那一段重新转码
+      size_t index = 0;
+      if (ss >> index && index < segments->size()) {
+        (*segments)[index].done = true;
+      }
+    }
+  }
+  return !segments->empty();
+}
+
+bool SegmentedVideoConverter::SaveJournal(const std::string &journal,
+                                          const std::string &key,
+                                          const std::vector<Segment> &segments,
+                                          bool has_audio) const {
+  FILE *f = fopen(journal.c_str(), "wb");
+  if (!f) {
+    AvLog(nullptr, AV_LOG_ERROR, "Cannot write checkpoint %s: %s\n",
+          journal.c_str(), strerror(errno));
+    return false;
+  }
+  fprintf(f, "checkpoint %d %s\n", has_audio ? 1 : 0, key.c_str());
+  for (const auto &segment : segments) {
+    fprintf(f, "segment %lld %lld %s\n",
+            static_cast<long long>(segment.start_time),
+            static_cast<long long>(segment.recording_time),
+            segment.output_file.c_str());
+  }
+  return fclose(f) == 0;
+}
+
+bool SegmentedVideoConverter::AppendJournal(const std::string &journal,
+                                            size_t index) const {
+  FILE *f = fopen(journal.c_str(), "ab");
+  if (!f) {
+    AvLog(nullptr, AV_LOG_ERROR, "Cannot write checkpoint %s: %s\n",
+          journal.c_str(), strerror(errno));
+    return false;
+  }
+  fprintf(f, "done %d\n", static_cast<int>(index));
+  fflush(f);
+  return fclose(f) == 0;
+}
+
+bool SegmentedVideoConverter::PlanSegments(std::vector<Segment> *segments,
+                                           bool *has_audio) {
+  AVFormatContext *ic = nullptr;
+  int ret = avformat_open_input(&ic, input_file_.c_str(), nullptr, nullptr);
+  if (ret < 0) {
+    PrintError(input_file_.c_str(), ret);
+    return false;
+  }
+  ret = request_.probe_cache
+            ? FindStreamInfoCached(ic, input_file_, nullptr)
+            : avformat_find_stream_info(ic, nullptr);
+  if (ret < 0) {
+    PrintError(input_file_.c_str(), ret);
+    avformat_close_input(&ic);
+    return false;
+  }
+  // 之前扫描过整个文件的关键帧时直接用缓存的
+  ProbeCache &probe_cache = ProbeCache::Instance();
+  std::string probe_key;
+  ProbeInfo probe;
+  bool cached_keyframes = request_.probe_cache &&
+                          probe_cache.MakeKey(input_file_, &probe_key) &&
+                          probe_cache.Lookup(probe_key, &probe) &&
+                          probe.has_keyframes;
+
+  int video_index = av_find_best_stream(ic, AVMEDIA_TYPE_VIDEO, -1, -1,
+                                        nullptr, 0);
+  *has_audio =
+      av_find_best_stream(ic, AVMEDIA_TYPE_AUDIO, -1, -1, nullptr, 0) >= 0;
+  int64_t file_start = ic->start_time != AV_NOPTS_VALUE ? ic->start_time : 0;
+
+  // 转码的时间窗口，单位微秒
+  int64_t window_start = request_.output_video_start_time * 1000LL;
+  int64_t window_end = ic->duration > 0 ? ic->duration : INT64_MAX;
+  if (request_.output_video_record_time > 0) {
+    window_end = FFMIN(
+        window_end, window_start + request_.output_video_record_time * 1000LL);
+  }
+
+  // 只读视频流的数据包，不解码，取关键帧的 pts
+  std::vector<int64_t> keyframes;
+  bool open_end = request_.output_video_record_time == 0;
+  bool need_keyframes =
+      video_index >= 0 && (window_end != INT64_MAX || request_.smart_cut);
+  if (need_keyframes && cached_keyframes) {
+    for (int64_t pts : probe.keyframes) {
+      if (pts >= window_start && pts < window_end) {
+        keyframes.push_back(pts);
+      }
+    }
+  } else if (need_keyframes) {
+    AVStream *st = ic->streams[video_index];
+    for (unsigned int i = 0; i < ic->nb_streams; i++) {
+      if (static_cast<int>(i) != video_index) {
+        ic->streams[i]->discard = AVDISCARD_ALL;
+      }
+    }
+    // 先 seek 到窗口开始之前的关键帧，读到窗口结束之后的关键帧就停止
+    if (window_start > 0) {
+      avformat_seek_file(ic, -1, INT64_MIN, file_start + window_start,
+                         file_start + window_start, 0);
+    }
+    AVPacket *pkt = av_packet_alloc();
+    // 从头读到了文件结尾，得到的是整个文件的关键帧
+    bool whole_file = window_start <= 0;
+    while (pkt && !stopped_ && (ret = av_read_frame(ic, pkt)) >= 0) {
+      if (pkt->stream_index == video_index &&
+          (pkt->flags & AV_PKT_FLAG_KEY) && pkt->pts != AV_NOPTS_VALUE) {
+        int64_t pts =
+            av_rescale_q(pkt->pts, st->time_base, {1, AV_TIME_BASE}) -
+            file_start;
+        if (pts >= window_end) {
+          av_packet_unref(pkt);
+          whole_file = false;
+          break;
+        }
+        if (pts >= window_start) {
+          keyframes.push_back(pts);
+        }
+      }
+      av_packet_unref(pkt);
+    }
+    av_packet_free(&pkt);
+    std::sort(keyframes.begin(), keyframes.end());
+    if (whole_file && ret == AVERROR_EOF && !stopped_ && !probe_key.empty()) {
+      probe_cache.StoreKeyframes(probe_key, keyframes);
+    }
+  }
+  if (request_.smart_cut) {
+    PlanSmartCut(ic, video_index, keyframes, window_start, window_end,
+                 open_end, segments);
+    avformat_close_input(&ic);
+    return !stopped_;
+  }
+  avformat_close_input(&ic);
+
+  int nb_segments = 1;
+  unsigned int cores = std::max(1u, std::thread::hardware_concurrency());
+  if (!keyframes.empty()) {
+    int64_t duration = window_end - window_start;
+    if (request_.checkpoint_interval > 0) {
+      nb_segments = static_cast<int>(
+          duration / (request_.checkpoint_interval * int64_t{AV_TIME_BASE}));
+    } else if (request_.parallel_segments > 0) {
+      nb_segments = request_.parallel_segments;
+    } else {
+      nb_segments = static_cast<int>(
+          std::min<int64_t>(cores, duration / kMinSegmentDuration));
+    }
+    nb_segments = std::max(nb_segments, 1);
+  }
+
+  // 每段从目标时间之后的第一个关键帧开始
+  std::vector<int64_t> starts{window_start};
+  for (int i = 1; i < nb_segments; i++) {
+    int64_t target =
+        window_start + (window_end - window_start) / nb_segments * i;
+    auto it = std::lower_bound(keyframes.begin(), keyframes.end(), target);
+    if (it != keyframes.end() && *it > starts.back()) {
+      starts.push_back(*it);
+    }
+  }
+
+  segments->clear();
+  for (size_t i = 0; i < starts.size(); i++) {
+    Segment segment;
+    segment.start_time = starts[i];
+    int64_t end = i + 1 < starts.size() ? starts[i + 1] : window_end;
+    if (end != INT64_MAX) {
+      segment.recording_time = end - starts[i];
+    }
+    segment.output_file = TempFileName(
+        (request_.checkpoint_interval > 0 ? "part" : "seg") +
+        std::to_string(i));
+    segments->push_back(segment);
+  }
+
+  AvLog(nullptr, AV_LOG_INFO,
+        "Split %s into %d segments, %d keyframes, %u cores.\n",
+        input_file_.c_str(), static_cast<int>(segments->size()),
+        static_cast<int>(keyframes.size()), cores);
+  return true;
+}
+
+void SegmentedVideoConverter::PlanSmartCut(
+    AVFormatContext *ic, int video_index, const std::vector<int64_t> &keyframes,
+    int64_t window_start, int64_t window_end, bool open_end,
+    std::vector<Segment> *segments) {
+  segments->clear();
+  Segment whole;
+  whole.start_time = window_start;
+  if (window_end != INT64_MAX) {
+    whole.recording_time = window_end - window_start;
+  }
+
+  // 只有输出和源的视频编码相同、不缩放时中间一段才能直接复制
+  const AVCodec *encoder = nullptr;
+  const AVCodecParameters *par =
+      video_index >= 0 ? ic->streams[video_index]->codecpar : nullptr;
+  if (par && request_.output_video_width <= 0 &&
+      request_.output_video_height <= 0 && request_.video_encoder != "copy") {
+    encoder = request_.video_encoder.empty()
+                  ? avcodec_find_encoder(par->codec_id)
+                  : FindVideoEncoder(request_.video_encoder);
+    if (encoder && encoder->id != par->codec_id) {
+      encoder = nullptr;
+    }
+  }
+
+  // 拼接后的文件要能在码流中携带变化的参数集，见 InBandParameterSetTag
+  unsigned int tag = 0;
+  if (encoder &&
+      !InBandParameterSetTag(
+          av_guess_format(request_.output_file_format.empty()
+                              ? nullptr
+                              : request_.output_file_format.c_str(),
+                          output_file_.c_str(), nullptr),
+          par->codec_id, &tag)) {
+    AvLog(nullptr, AV_LOG_INFO,
+          "%s cannot carry in-band parameter sets for %s.\n",
+          output_file_.c_str(), avcodec_get_name(par->codec_id));
+    encoder = nullptr;
+  }
+
+  // 头：开始时间到第一个关键帧，中：关键帧之间直接复制，
+  // 尾：最后一个关键帧到结束时间，结束时间是文件末尾时一起复制
+  int64_t copy_start = keyframes.empty() ? window_end : keyframes.front();
+  int64_t copy_end = open_end || keyframes.empty() ? window_end
+                                                   : keyframes.back();
+  if (!encoder || copy_start >= copy_end) {
+    AvLog(nullptr, AV_LOG_INFO,
+          "Smart cut is not possible for %s, re-encode it.\n",
+          input_file_.c_str());
+    whole.output_file = TempFileName("seg0");
+    segments->push_back(whole);
+    return;
+  }
+
+  // 重新编码的部分沿用源的码率，尽量和复制的部分画质一致
+  std::string bitrate = request_.output_video_bitrate;
+  int64_t source_bitrate = par->bit_rate > 0 ? par->bit_rate : ic->bit_rate;
+  if (bitrate.empty() && source_bitrate > 0) {
+    bitrate = std::to_string(source_bitrate);
+  }
+  auto add_segment = [&](int64_t start, int64_t end, bool stream_copy) {
+    Segment segment;
+    segment.start_time = start;
+    if (end != INT64_MAX) {
+      segment.recording_time = end - start;
+    }
+    segment.stream_copy = stream_copy;
+    if (!stream_copy) {
+      segment.video_encoder = encoder->name;
+      segment.video_bitrate = bitrate;
+    }
+    // MPEG-TS 在码流中携带参数集，编码和复制的部分可以直接拼接
+    segment.output_file =
+        TempFileName("seg" + std::to_string(segments->size()), ".ts");
+    segments->push_back(segment);
+  };
+  if (copy_start > window_start) {
+    add_segment(window_start, copy_start, false);
+  }
+  add_segment(copy_start, copy_end, true);
+  if (copy_end < window_end && !open_end) {
+    add_segment(copy_end, window_end, false);
+  }
+
+  AvLog(nullptr, AV_LOG_INFO,
+        "Smart cut %s: copy %0.3fs-%0.3fs, re-encode %0.3fs with %s.\n",
+        input_file_.c_str(), copy_start / 1000000.0, copy_end / 1000000.0,
+        (copy_start - window_start +
+         (open_end ? 0 : window_end - copy_end)) / 1000000.0,
+        encoder->name);
+}
+
+bool SegmentedVideoConverter::RunConverters(
+    const std::vector<Segment> &segments, const std::string &audio_file) {
+  unsigned int cores = std::max(1u, std::thread::hardware_concurrency());
+  int threads = request_.threads > 0
+                    ? request_.threads
+                    : std::max(1, static_cast<int>(cores / segments.size()));
+
+  std::vector<std::shared_ptr<FfmpegVideoConverter>> converters;
+  for (const auto &segment : segments) {
+    VideoConverter::Request request = request_;
+    request.output_file = segment.output_file;
+    request.output_video_start_time = 0;
+    request.output_video_record_time = 0;
+    request.threads = threads;
+    request.parallel_segments = 0;
+    if (segment.stream_copy) {
+      request.video_encoder = "copy";
+    } else if (!segment.video_encoder.empty()) {
+      request.video_encoder = segment.video_encoder;
+      request.output_video_bitrate = segment.video_bitrate;
+    }
+    if (request_.smart_cut) {
+      // 重新编码的头尾两段沿用源码率
+      request.output_file_format = "mpegts";
+      request.content_adaptive = 0;
+    }
+    auto converter = AddConverter(request);
+    if (!converter) {
+      return false;
+    }
+    converter->SetTimeWindow(segment.start_time, segment.recording_time);
+    converter->DisableStreams(false, true);
+    converters.push_back(converter);
+  }
+  if (!audio_file.empty()) {
+    // 音频整体转码一次，避免分段边界处的音频帧不连续
+    VideoConverter::Request request = request_;
+    request.output_file = audio_file;
+    request.parallel_segments = 0;
+    auto converter = AddConverter(request);
+    if (!converter) {
+      return false;
+    }
+    converter->DisableStreams(true, false);
+    converters.push_back(converter);
+  }
+
+  // 没有 async_call_fun 时 Start() 同步执行，每段一个线程
+  // 任何一段失败整个输出就作废，其它段也不用再转
+  std::atomic_bool failed{false};
+  std::vector<std::thread> workers;
+  for (auto &converter : converters) {
+    workers.emplace_back([&converters, &failed, converter]() {
+      converter->Start();
+      if (!converter->Succeeded() && !failed.exchange(true)) {
+        for (auto &other : converters) {
+          other->Stop();
+        }
+      }
+    });
+  }
+  // 各段的进度不回调，按已完成的段数估算整体进度
+  for (size_t i = 0; i < workers.size(); i++) {
+    workers[i].join();
+    if (request_.progress_rate <= 0) {
+      continue;
+    }
+    VideoConverter::Response r;
+    r.output_file = output_file_;
+    r.percent = (i + 1) * 100.0 / workers.size();
+    PostConvertProgress(r);
+  }
+  if (failed && !stopped_) {
+    AvLog(nullptr, AV_LOG_ERROR, "%s: segment conversion failed.\n",
+          output_file_.c_str());
+  }
+  return !failed && !stopped_;
+}
+
+bool SegmentedVideoConverter::ConcatSegments(
+    const std::vector<Segment> &segments, const std::string &audio_file,
+    bool segment_audio) {
+  std::vector<ConcatInput> inputs(audio_file.empty() && !segment_audio ? 1
+                                                                        : 2);
+  inputs[0].type = AVMEDIA_TYPE_VIDEO;
+  for (const auto &segment : segments) {
+    inputs[0].files.push_back(segment.output_file);
+    inputs[0].offsets.push_back(segment.start_time - segments[0].start_time);
+  }
+  if (segment_audio) {
+    // 音频和视频在同一个分段文件中
+    inputs[1].type = AVMEDIA_TYPE_AUDIO;
+    inputs[1].files = inputs[0].files;
+    inputs[1].offsets = inputs[0].offsets;
+  } else if (!audio_file.empty()) {
+    inputs[1].type = AVMEDIA_TYPE_AUDIO;
+    inputs[1].files.push_back(audio_file);
+    inputs[1].offsets.push_back(0);
+  }
+
+  AVFormatContext *oc = nullptr;
+  const char *format = request_.output_file_format.empty()
+                           ? nullptr
+                           : request_.output_file_format.c_str();
+  int ret = avformat_alloc_output_context2(&oc, nullptr, format,
+                                           output_file_.c_str());
+  bool header_written = false;
+  do {
+    if (ret < 0) {
+      PrintError(output_file_.c_str(), ret);
+      break;
+    }
+    for (auto &in : inputs) {
+      in.pkt = av_packet_alloc();
+      if (!in.pkt) {
+        ret = AVERROR(ENOMEM);
+        break;
+      }
+      if ((ret = OpenConcatFile(&in)) < 0) {
+        break;
+      }
+      AVStream *ist = in.ctx->streams[in.stream_index];
+      in.out_stream = avformat_new_stream(oc, nullptr);
+      if (!in.out_stream) {
+        ret = AVERROR(ENOMEM);
+        break;
+      }
+      if ((ret = avcodec_parameters_copy(in.out_stream->codecpar,
+                                         ist->codecpar)) < 0) {
+        break;
+      }
+      in.out_stream->codecpar->codec_tag = 0;
+      if (request_.smart_cut && segments.size() > 1 &&
+          in.type == AVMEDIA_TYPE_VIDEO) {
+        // 分段的参数集不同，见 InBandParameterSetTag
+        unsigned int tag = 0;
+        if (InBandParameterSetTag(oc->oformat, ist->codecpar->codec_id,
+                                  &tag)) {
+          in.out_stream->codecpar->codec_tag = tag;
+        }
+      }
+      in.out_stream->time_base = ist->time_base;
+    }
+    if (ret < 0) {
+      break;
+    }
+
+    if (!(oc->oformat->flags & AVFMT_NOFILE)) {
+      ret = avio_open(&oc->pb, output_file_.c_str(), AVIO_FLAG_WRITE);
+      if (ret < 0) {
+        PrintError(output_file_.c_str(), ret);
+        break;
+      }
+    }
+    ret = avformat_write_header(oc, nullptr);
+    if (ret < 0) {
+      PrintError(output_file_.c_str(), ret);
+      break;
+    }
+    header_written = true;
+
+    for (auto &in : inputs) {
+      if ((ret = ReadConcatPacket(&in)) < 0) {
+        break;
+      }
+    }
+    // 按 dts 交错写入音视频
+    while (ret >= 0 && !stopped_) {
+      ConcatInput *next = nullptr;
+      for (auto &in : inputs) {
+        if (!in.has_packet) {
+          continue;
+        }
+        if (!next || next->pkt->dts == AV_NOPTS_VALUE ||
+            (in.pkt->dts != AV_NOPTS_VALUE &&
+             av_compare_ts(in.pkt->dts, in.out_stream->time_base,
+                           next->pkt->dts, next->out_stream->time_base) < 0)) {
+          next = &in;
+        }
+      }
+      if (!next) {
+        break;
+      }
+      ret = av_interleaved_write_frame(oc, next->pkt);
+      if (ret < 0) {
+        PrintError("av_interleaved_write_frame()", ret);
+        break;
+      }
+      ret = ReadConcatPacket(next);
+    }
+  } while (false);
+
+  if (header_written) {
+    int err = av_write_trailer(oc);
+    if (ret >= 0) {
+      ret = err;
+    }
+  }
+  for (auto &in : inputs) {
+    CloseConcatInput(&in);
+  }
+  if (oc) {
+    if (!(oc->oformat->flags & AVFMT_NOFILE)) {
+      avio_closep(&oc->pb);
+    }
+    avformat_free_context(oc);
+  }
+  return ret >= 0 && !stopped_;
+}
+
+std::string SegmentedVideoConverter::TempFileName(
+    const std::string &tag, const std::string &extension) const {
+  // a/b.mp4 -> a/b.seg0.mp4，保留扩展名以便推测封装格式
+  size_t slash = output_file_.find_last_of("/\\");
+  size_t dot = output_file_.find_last_of('.');
+  if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) {
+    return output_file_ + "." + tag + extension;
+  }
+  return output_file_.substr(0, dot) + "." + tag +
+         (extension.empty() ? output_file_.substr(dot) : extension);
+}
+
+VideoConverter::Profile SegmentedVideoConverter::GetProfile() const {
+  VideoConverter::Profile profile;
+  std::lock_guard<std::mutex> lock(converters_mutex_);
+  for (const auto &converter : converters_) {
+    auto streams = converter->GetProfile().streams;
+    profile.streams.insert(profile.streams.end(), streams.begin(),
+                           streams.end());
+  }
+  return profile;
+}
+
+void SegmentedVideoConverter::AnalyzeTitle() {
+  if (request_.content_adaptive != 1 || request_.smart_cut) {
+    return;
+  }
+  content_ = AnalyzeContent(request_);
+  content_ready_ = true;
+}
+
+std::shared_ptr<FfmpegVideoConverter> SegmentedVideoConverter::AddConverter(
+    const VideoConverter::Request &request) {
+  std::lock_guard<std::mutex> lock(converters_mutex_);
+  if (stopped_) {
+    return nullptr;
+  }
+  auto converter =
+      std::make_shared<FfmpegVideoConverter>(request, nullptr, nullptr);
+  if (content_ready_ && request.content_adaptive != 0) {
+    converter->SetContentComplexity(content_);
+  }
+  converters_.push_back(converter);
+  return converter;
+}
+
+void SegmentedVideoConverter::Run(void *arg) {
+  auto converter = static_cast<SegmentedVideoConverter *>(arg);
+  bool succeeded = converter->Convert();
+  VideoConverter::Response r;
+  r.output_file = converter->output_file_;
+  r.succeeded = succeeded;
+  converter->PostConvertEnd(r);
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "base_video_converter.h"
+#include "ffmpeg_content_analyzer.h"
+
+class FfmpegVideoConverter;
+struct AVFormatContext;
+
+// 分段并行转码：按关键帧把视频切成 N 段，每段一个 FfmpegVideoConverter
+// 并行转码，音频单独转码一次，最后无损拼接成一个文件
+// Request::smart_cut 时按关键帧切成头、中、尾三段，只有头尾两段重新编码，
+// 中间一段直接复制数据包
+// Request::checkpoint_interval 时逐段转码并记录日志，中断后可以接着转
+class SegmentedVideoConverter : public BaseVideoConverter {
+ public:
+  SegmentedVideoConverter(const VideoConverter::Request &request,
+                          VideoConverter::Delegate *delegate,
+                          VideoConverter::AsyncCallFuncType call_fun);
+  ~SegmentedVideoConverter() override;
+
+  void Start() override;
+  void Stop() override;
+  // 所有分段转码器的统计合在一起
+  VideoConverter::Profile GetProfile() const override;
+
+ private:
+  struct Segment {
+    int64_t start_time{0};               // 微秒，关键帧时间
+    int64_t recording_time{INT64_MAX};   // 微秒
+    std::string output_file;
+    bool stream_copy{false};
+    // 为空时使用请求中的参数
+    std::string video_encoder;
+    std::string video_bitrate;
+    bool done{false};  // 断点续转时已完成的段
+  };
+
+  bool Convert();
+  bool PlanSegments(std::vector<Segment> *segments, bool *has_audio);
+  // ic 已打开，keyframes 为时间窗口内的关键帧
+  void PlanSmartCut(AVFormatContext *ic, int video_index,
+                    const std::vector<int64_t> &keyframes, int64_t window_start,
+                    int64_t window_end, bool open_end,
+                    std::vector<Segment> *segments);
+  bool RunConverters(const std::vector<Segment> &segments,
+                     const std::string &audio_file);
+  // segment_audio 为 true 时音频在各分段文件中，否则在 audio_file 中
+  bool ConcatSegments(const std::vector<Segment> &segments,
+                      const std::string &audio_file,
+                      bool segment_audio = false);
+  // 断点续转，进度记在输出文件旁边的 .journal 中
+  bool ConvertCheckpointed();
+  std::string JournalKey() const;
+  bool LoadJournal(const std::string &journal, const std::string &key,
+                   std::vector<Segment> *segments, bool *has_audio) const;
+  bool SaveJournal(const std::string &journal, const std::string &key,
+                   const std::vector<Segment> &segments,
+                   bool has_audio) const;
+  bool AppendJournal(const std::string &journal, size_t index) const;
+  // extension 为空时沿用输出文件的扩展名
+  std::string TempFileName(const std::string &tag,
+                           const std::string &extension = std::string()) const;
+  // 整个文件一个码率时在分段之前分析一次，各段使用同样的结果
+  void AnalyzeTitle();
+  // Stop() 之后返回空
+  std::shared_ptr<FfmpegVideoConverter> AddConverter(
+      const VideoConverter::Request &request);
+
+  static void Run(void *converter);
+
+ private:
+  VideoConverter::Request request_;
+  std::atomic_bool stopped_{false};
+
+  mutable std::mutex converters_mutex_;
+  std::vector<std::shared_ptr<FfmpegVideoConverter>> converters_;
+
+  bool content_ready_{false};
+  ContentComplexity content_;
+
+  std::unique_ptr<std::thread> worker_;
+};
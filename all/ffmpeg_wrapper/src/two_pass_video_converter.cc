@@ -0,0 +1,165 @@
+#include "two_pass_video_converter.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+
+#include "ffmpeg_util.h"
+#include "ffmpeg_video_converter.h"
+
+namespace {
+
+// 文件不存在时返回 -1
+int64_t FileSize(const std::string &path) {
+  FILE *f = fopen(path.c_str(), "rb");
+  if (!f) {
+    return -1;
+  }
+  int64_t size = -1;
+  if (fseek(f, 0, SEEK_END) == 0) {
+    size = ftell(f);
+  }
+  fclose(f);
+  return size;
+}
+
+// 两遍的进度各占一半
+class PassDelegate : public VideoConverter::Delegate {
+ public:
+  PassDelegate(int pass,
+               std::function<void(VideoConverter::Response)> post_progress,
+               std::function<void(VideoConverter::Response)> post_segment)
+      : pass_(pass),
+        post_progress_(post_progress),
+        post_segment_(post_segment) {}
+
+  void OnConvertProgress(VideoConverter::Response r) override {
+    if (r.percent >= 0) {
+      r.percent = (pass_ - 1) * 50 + r.percent / 2;
+    }
+    if (pass_ == 1) {
+      // 第一遍还不知道第二遍要多久
+      r.eta = -1;
+    }
+    post_progress_(r);
+  }
+  // 流式输出时只有第二遍输出分片
+  void OnConvertSegment(VideoConverter::Response r) override {
+    post_segment_(r);
+  }
+
+ private:
+  int pass_{1};
+  std::function<void(VideoConverter::Response)> post_progress_;
+  std::function<void(VideoConverter::Response)> post_segment_;
+};
+
+}  // namespace
+
+TwoPassVideoConverter::TwoPassVideoConverter(
+    const VideoConverter::Request &request, VideoConverter::Delegate *delegate,
+    VideoConverter::AsyncCallFuncType call_fun)
+    : BaseVideoConverter(request, delegate, call_fun), request_(request) {}
+
+TwoPassVideoConverter::~TwoPassVideoConverter() {
+  if (worker_) {
+    worker_->join();
+  }
+}
+
+void TwoPassVideoConverter::Start() {
+  if (async_call_fun_) {
+    worker_ = std::make_unique<std::thread>(TwoPassVideoConverter::Run, this);
+  } else {
+    TwoPassVideoConverter::Run(this);
+  }
+}
+void TwoPassVideoConverter::Stop() {
+  stopped_ = true;
+  {
+    std::lock_guard<std::mutex> lock(converter_mutex_);
+    if (converter_) {
+      converter_->Stop();
+    }
+  }
+  if (worker_) {
+    worker_->join();
+  }
+}
+
+VideoConverter::Profile TwoPassVideoConverter::GetProfile() const {
+  std::lock_guard<std::mutex> lock(converter_mutex_);
+  return converter_ ? converter_->GetProfile() : VideoConverter::Profile();
+}
+
+bool TwoPassVideoConverter::Convert() {
+  PassStats stats;
+  // libx264 自己读写统计文件（及 .mbtree），放在输出文件旁边，结束后删除
+  stats.file = output_file_ + ".pass.log";
+  if (request_.content_adaptive != 0) {
+    content_ = AnalyzeContent(request_);
+    content_ready_ = true;
+  }
+  // 第一遍失败时统计数据缺失或不完整，不能用来做第二遍
+  bool ret = RunPass(1, &stats);
+  if (ret) {
+    // libx264 的统计数据在文件中，其它编码器的在内存中
+    int64_t stats_size = stats.data.empty()
+                             ? FileSize(stats.file)
+                             : static_cast<int64_t>(stats.data.size());
+    AvLog(nullptr, AV_LOG_INFO,
+          "Two-pass %s: %lld bytes of pass-1 statistics.\n",
+          output_file_.c_str(), static_cast<long long>(stats_size));
+    ret = RunPass(2, &stats);
+  } else if (!stopped_) {
+    AvLog(nullptr, AV_LOG_ERROR, "Two-pass %s: pass 1 failed.\n",
+          output_file_.c_str());
+  }
+
+  std::remove(stats.file.c_str());
+  std::remove((stats.file + ".mbtree").c_str());
+  return ret;
+}
+
+bool TwoPassVideoConverter::RunPass(int pass, PassStats *stats) {
+  VideoConverter::Request request = request_;
+  request.two_pass = false;
+  // 要的是按码率重新编码，不自动改为直接复制
+  request.auto_stream_copy = false;
+  if (pass == 1) {
+    // 第一遍只需要统计数据，用 null 封装，不写文件
+    request.output_file_format = "null";
+    request.streaming_format.clear();
+  }
+  PassDelegate delegate(
+      pass, [this](VideoConverter::Response r) { PostConvertProgress(r); },
+      [this](VideoConverter::Response r) { PostConvertSegment(r); });
+  std::shared_ptr<FfmpegVideoConverter> converter;
+  {
+    std::lock_guard<std::mutex> lock(converter_mutex_);
+    if (stopped_) {
+      return false;
+    }
+    converter_ = std::make_shared<FfmpegVideoConverter>(request, &delegate,
+                                                        nullptr);
+    converter = converter_;
+  }
+  converter->SetPass(pass, stats);
+  if (content_ready_) {
+    converter->SetContentComplexity(content_);
+  }
+  if (pass == 1) {
+    converter->DisableStreams(false, true);
+  }
+  converter->Start();
+  return converter->Succeeded() && !stopped_;
+}
+
+void TwoPassVideoConverter::Run(void *arg) {
+  auto converter = static_cast<TwoPassVideoConverter *>(arg);
+  bool succeeded = converter->Convert();
+  VideoConverter::Response r;
+  r.output_file = converter->output_file_;
+  r.succeeded = succeeded;
+  converter->PostConvertEnd(r);
+}
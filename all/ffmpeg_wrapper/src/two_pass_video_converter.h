@@ -0,0 +1,47 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "base_video_converter.h"
+#include "ffmpeg_content_analyzer.h"
+
+class FfmpegVideoConverter;
+struct PassStats;
+
+// 两遍编码：第一遍只编码视频、不写文件，编码器的统计数据保存在内存中，
+// 第二遍按统计数据分配码率，输出的码率更接近 output_video_bitrate
+class TwoPassVideoConverter : public BaseVideoConverter {
+ public:
+  TwoPassVideoConverter(const VideoConverter::Request &request,
+                        VideoConverter::Delegate *delegate,
+                        VideoConverter::AsyncCallFuncType call_fun);
+  ~TwoPassVideoConverter() override;
+
+  void Start() override;
+  void Stop() override;
+  // 当前这一遍转码器的统计
+  VideoConverter::Profile GetProfile() const override;
+
+ private:
+  bool Convert();
+  bool RunPass(int pass, PassStats *stats);
+
+  static void Run(void *converter);
+
+ private:
+  VideoConverter::Request request_;
+  std::atomic_bool stopped_{false};
+
+  mutable std::mutex converter_mutex_;
+  std::shared_ptr<FfmpegVideoConverter> converter_;
+
+  // 两遍使用同一份内容分析结果，推算出的码率相同
+  bool content_ready_{false};
+  ContentComplexity content_;
+
+  std::unique_ptr<std::thread> worker_;
+};
@@ -1,6 +1,9 @@
 ﻿#include "ffmpeg_wrapper/video_converter.h"
 
+#include "auto_tune_video_converter.h"
 #include "ffmpeg_video_converter.h"
+#include "segmented_video_converter.h"
+#include "two_pass_video_converter.h"
 
 class VideoConverterWrapper : public VideoConverter {
  public:
@@ -9,6 +12,7 @@ class VideoConverterWrapper : public VideoConverter {
 
   void Start() override { converter_->Start(); }
   void Stop() override { converter_->Stop(); }
+  Profile GetProfile() const override { return converter_->GetProfile(); }
 
  private:
   std::shared_ptr<BaseVideoConverter> converter_;
@@ -18,6 +22,33 @@ std::unique_ptr<VideoConverter> VideoConverter::MakeVideoConverter(
     const VideoConverter::Request& request, VideoConverter::Delegate* delegate,
     AsyncCallFuncType async_call_fun, const char* converter_name) {
   if (strcmp(converter_name, "ffmpeg") == 0) {
+    bool smart_cut =
+        request.smart_cut && (request.output_video_start_time > 0 ||
+                              request.output_video_record_time > 0);
+    // 自定义输入输出和流式输入只能打开一次
+    bool custom_io = request.input.data || request.input.read ||
+                     request.output.write || request.output.buffer ||
+                     request.streaming_input;
+    // 调优之后再按选出的参数走下面的逻辑
+    if (request.auto_tune && request.outputs.empty() && !custom_io) {
+      return std::make_unique<VideoConverterWrapper>(
+          std::make_unique<AutoTuneVideoConverter>(request, delegate,
+                                                   async_call_fun));
+    }
+    if ((request.parallel_segments != 0 || smart_cut ||
+         request.checkpoint_interval > 0) &&
+        request.outputs.empty() && request.streaming_format.empty() &&
+        !custom_io) {
+      return std::make_unique<VideoConverterWrapper>(
+          std::make_unique<SegmentedVideoConverter>(request, delegate,
+                                                    async_call_fun));
+    }
+    if (request.two_pass && request.outputs.empty() &&
+        !request.output_video_bitrate.empty() && !custom_io) {
+      return std::make_unique<VideoConverterWrapper>(
+          std::make_unique<TwoPassVideoConverter>(request, delegate,
+                                                  async_call_fun));
+    }
     return std::make_unique<VideoConverterWrapper>(
         std::make_unique<FfmpegVideoConverter>(request, delegate,
                                                async_call_fun));
@@ -0,0 +1,276 @@
+#include "ffmpeg_wrapper/video_converter_queue.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace {
+
+// 转发任务的回调，转码器本身同步运行在工作线程上
+class JobDelegate : public VideoConverter::Delegate {
+ public:
+  JobDelegate(VideoConverter::Delegate* delegate,
+              VideoConverter::AsyncCallFuncType async_call_fun)
+      : delegate_(delegate), async_call_fun_(async_call_fun) {}
+
+  void OnConvertBegin(VideoConverter::Response r) override {
+    Post([](VideoConverter::Delegate* d,
+            const VideoConverter::Response& r) { d->OnConvertBegin(r); },
+         r);
+  }
+  void OnConvertProgress(VideoConverter::Response r) override {
+    Post([](VideoConverter::Delegate* d,
+            const VideoConverter::Response& r) { d->OnConvertProgress(r); },
+         r);
+  }
+  void OnConvertSegment(VideoConverter::Response r) override {
+    Post([](VideoConverter::Delegate* d,
+            const VideoConverter::Response& r) { d->OnConvertSegment(r); },
+         r);
+  }
+  void OnConvertEnd(VideoConverter::Response r) override {
+    Post([](VideoConverter::Delegate* d,
+            const VideoConverter::Response& r) { d->OnConvertEnd(r); },
+         r);
+  }
+
+ private:
+  template <typename Func>
+  void Post(Func func, const VideoConverter::Response& r) {
+    if (!delegate_) {
+      return;
+    }
+    if (async_call_fun_) {
+      auto delegate = delegate_;
+      async_call_fun_([func, delegate, r]() { func(delegate, r); });
+    } else {
+      func(delegate_, r);
+    }
+  }
+
+ private:
+  VideoConverter::Delegate* delegate_{nullptr};
+  VideoConverter::AsyncCallFuncType async_call_fun_;
+};
+
+struct Job {
+  VideoConverterQueue::JobId id{0};
+  int priority{0};
+  int threads{1};  // 准入控制使用的预计线程数
+  VideoConverter::Request request;
+  std::unique_ptr<JobDelegate> delegate;
+  std::unique_ptr<VideoConverter> converter;
+  bool cancelled{false};
+};
+
+}  // namespace
+
+class VideoConverterQueue::Impl {
+ public:
+  explicit Impl(const Options& options) {
+    int cores =
+        std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+    max_workers_ =
+        options.max_workers > 0 ? options.max_workers : std::max(1, cores / 2);
+    max_threads_ = options.max_threads > 0 ? options.max_threads : cores;
+    for (int i = 0; i < max_workers_; i++) {
+      workers_.emplace_back(&Impl::WorkerLoop, this);
+    }
+  }
+  ~Impl() { Shutdown(); }
+
+  JobId Submit(const VideoConverter::Request& request, int priority,
+               VideoConverter::Delegate* delegate,
+               VideoConverter::AsyncCallFuncType async_call_fun) {
+    auto job = std::make_shared<Job>();
+    job->priority = priority;
+    job->request = request;
+    job->threads = EstimateThreads(&job->request);
+    job->delegate = std::make_unique<JobDelegate>(delegate, async_call_fun);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (shutdown_) {
+      return 0;
+    }
+    job->id = ++last_id_;
+    // 按优先级插入，相同优先级排在后面
+    auto it = std::find_if(queued_.begin(), queued_.end(),
+                           [&job](const std::shared_ptr<Job>& queued) {
+                             return queued->priority < job->priority;
+                           });
+    queued_.insert(it, job);
+    cv_.notify_all();
+    return job->id;
+  }
+
+  bool Cancel(JobId id) {
+    std::shared_ptr<Job> job;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto it = std::find_if(
+          queued_.begin(), queued_.end(),
+          [id](const std::shared_ptr<Job>& queued) { return queued->id == id; });
+      if (it != queued_.end()) {
+        job = *it;
+        queued_.erase(it);
+        counts_.cancelled++;
+      } else {
+        auto running = running_.find(id);
+        if (running == running_.end() || running->second->cancelled) {
+          return false;
+        }
+        running->second->cancelled = true;
+        if (running->second->converter) {
+          running->second->converter->Stop();
+        }
+        return true;
+      }
+    }
+    NotifyNotStarted(*job);
+    return true;
+  }
+
+  void Shutdown() {
+    std::list<std::shared_ptr<Job>> queued;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (shutdown_) {
+        return;
+      }
+      shutdown_ = true;
+      queued.swap(queued_);
+      counts_.cancelled += static_cast<int>(queued.size());
+      for (auto& running : running_) {
+        running.second->cancelled = true;
+        if (running.second->converter) {
+          running.second->converter->Stop();
+        }
+      }
+      cv_.notify_all();
+    }
+    for (auto& job : queued) {
+      NotifyNotStarted(*job);
+    }
+    for (auto& worker : workers_) {
+      worker.join();
+    }
+    workers_.clear();
+  }
+
+  Counts GetCounts() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Counts counts = counts_;
+    counts.queued = static_cast<int>(queued_.size());
+    counts.running = static_cast<int>(running_.size());
+    return counts;
+  }
+
+ private:
+  // threads 为 0（auto）的任务编解码器会按 CPU 核数开线程，
+  // 多个任务同时运行会超额订阅，这里按工作线程数平分线程预算
+  int EstimateThreads(VideoConverter::Request* request) const {
+    if (request->parallel_segments != 0) {
+      // 分段转码自己会占满所有核
+      return max_threads_;
+    }
+    if (request->threads <= 0) {
+      request->threads = std::max(1, max_threads_ / max_workers_);
+    }
+    return std::min(request->threads, max_threads_);
+  }
+
+  // 还没开始就被取消的任务也通知结束，调用方可以释放 delegate
+  // 不能持有 mutex_ 调用，回调里可能再访问队列
+  static void NotifyNotStarted(const Job& job) {
+    VideoConverter::Response r;
+    r.output_file = job.request.output_file;
+    job.delegate->OnConvertEnd(r);
+  }
+
+  // 队首任务的线程数放得下时才开始，没有任务在运行时总是可以开始
+  bool CanAdmitLocked() const {
+    if (queued_.empty()) {
+      return false;
+    }
+    return running_.empty() ||
+           running_threads_ + queued_.front()->threads <= max_threads_;
+  }
+
+  void WorkerLoop() {
+    while (true) {
+      std::shared_ptr<Job> job;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [this] { return shutdown_ || CanAdmitLocked(); });
+        if (shutdown_) {
+          return;
+        }
+        job = queued_.front();
+        queued_.pop_front();
+        job->converter = VideoConverter::MakeVideoConverter(
+            job->request, job->delegate.get(), nullptr);
+        running_threads_ += job->threads;
+        running_.emplace(job->id, job);
+      }
+
+      // 没有 async_call_fun 时 Start() 在当前线程同步执行
+      if (job->converter) {
+        job->converter->Start();
+      }
+
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        running_.erase(job->id);
+        running_threads_ -= job->threads;
+        if (job->cancelled) {
+          counts_.cancelled++;
+        } else {
+          counts_.finished++;
+        }
+        cv_.notify_all();
+      }
+    }
+  }
+
+ private:
+  int max_workers_{1};
+  int max_threads_{1};
+
+  mutable std::mutex mutex_;
+  std::condition_variable cv_;
+  std::list<std::shared_ptr<Job>> queued_;
+  std::unordered_map<JobId, std::shared_ptr<Job>> running_;
+  int running_threads_{0};
+  JobId last_id_{0};
+  Counts counts_;
+  bool shutdown_{false};
+
+  std::vector<std::thread> workers_;
+};
+
+VideoConverterQueue::VideoConverterQueue()
+    : VideoConverterQueue(Options()) {}
+
+VideoConverterQueue::VideoConverterQueue(const Options& options)
+    : impl_(std::make_unique<Impl>(options)) {}
+
+VideoConverterQueue::~VideoConverterQueue() = default;
+
+VideoConverterQueue::JobId VideoConverterQueue::Submit(
+    const VideoConverter::Request& request, int priority,
+    VideoConverter::Delegate* delegate,
+    VideoConverter::AsyncCallFuncType async_call_fun) {
+  return impl_->Submit(request, priority, delegate, async_call_fun);
+}
+
+bool VideoConverterQueue::Cancel(JobId id) { return impl_->Cancel(id); }
+
+void VideoConverterQueue::Shutdown() { impl_->Shutdown(); }
+
+VideoConverterQueue::Counts VideoConverterQueue::GetCounts() const {
+  return impl_->GetCounts();
+}
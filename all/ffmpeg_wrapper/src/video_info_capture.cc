@@ -17,8 +17,13 @@ extern "C" {
 }
 #endif
 
+#include <cmath>
 #include <memory>
 
+#include "ffmpeg_preview_decode.h"
+#include "ffmpeg_probe_cache.h"
+#include "ffmpeg_sws_cache.h"
+
 namespace {
 
 class VideoFirstValidFrameDecoder {
@@ -27,7 +32,9 @@ class VideoFirstValidFrameDecoder {
 
  public:
   std::unique_ptr<VideoInfoCapture::Image> ExtractFirstValidFrame(
-      const char *src_filename, unsigned int *duration_sec) {
+      const char *src_filename, unsigned int *duration_sec,
+      const VideoInfoCapture::CaptureOptions &options) {
+    options_ = options;
     /* open input file, and allocate format context */
     int ret = avformat_open_input(&fmt_ctx, src_filename, nullptr, nullptr);
     if (ret < 0) {
@@ -38,7 +45,7 @@ class VideoFirstValidFrameDecoder {
     }
 
     /* retrieve stream information */
-    if (avformat_find_stream_info(fmt_ctx, nullptr) < 0) {
+    if (FindStreamInfoCached(fmt_ctx, src_filename, nullptr) < 0) {
       fprintf(stderr, "Could not find stream information\n");
       return std::move(image);
     }
@@ -54,6 +61,10 @@ class VideoFirstValidFrameDecoder {
       if (duration_sec) {
         *duration_sec = (double)fmt_ctx->duration / (double)AV_TIME_BASE;
       }
+      // 预览时解封装就丢掉非关键帧和其它流的数据包
+      if (options_.preview) {
+        SetPreviewDiscard(fmt_ctx, video_stream_idx);
+      }
     }
 
     /* dump input information to stderr */
@@ -111,65 +122,52 @@ class VideoFirstValidFrameDecoder {
 
  private:
   int output_video_frame(AVFrame *frame) {
-    if (frame->width != width || frame->height != height ||
-        frame->format != pix_fmt) {
-      /* To handle this change, one could call av_image_alloc again and
-       * decode the following frames into another rawvideo file. */
-      fprintf(stderr,
-              "Error: Width, height and pixel format have to be "
-              "constant in a rawvideo file, but the width, height or "
-              "pixel format of the input video changed:\n"
-              "old: width = %d, height = %d, format = %s\n"
-              "new: width = %d, height = %d, format = %s\n",
-              width, height, av_get_pix_fmt_name(pix_fmt), frame->width,
-              frame->height,
-              av_get_pix_fmt_name(static_cast<AVPixelFormat>(frame->format)));
-      return -1;
+    // 同一个数据包可能解出多帧，只要第一帧
+    if (image) {
+      return 0;
     }
+    // lowres 解码时帧比编码参数里的尺寸小，以帧为准
+    width = frame->width;
+    height = frame->height;
+    pix_fmt = static_cast<AVPixelFormat>(frame->format);
 
     printf("video_frame n:%d coded_n:%d\n", video_frame_count++,
            frame->coded_picture_number);
 
     do {
-      struct SwsContext *sws_ctx =
-          sws_getContext(width, height, pix_fmt, width, height,
-                         AV_PIX_FMT_ARGB,  // argb
-                         SWS_BICUBIC, nullptr, nullptr, nullptr);
-      AVFrame *argb_frame = av_frame_alloc();
-
-      argb_frame->format = AV_PIX_FMT_ARGB;
-      argb_frame->width = width;
-      argb_frame->height = height;
-      int sts = av_frame_get_buffer(argb_frame, 0);
-      sts = sws_scale(sws_ctx,           // struct SwsContext* c,
-                      frame->data,       // const uint8_t* const srcSlice[],
-                      frame->linesize,   // const int srcStride[],
-                      0,                 // int srcSliceY,
-                      frame->height,     // int srcSliceH,
-                      argb_frame->data,  // uint8_t* const dst[],
-                      argb_frame->linesize);  // const int dstStride[]);
-
-      if (sts != frame->height) {
+      int thumb_width = width;
+      int thumb_height = height;
+      FitThumbnailSize(width, height, options_.max_width, options_.max_height,
+                       &thumb_width, &thumb_height);
+      // 预览时用快速缩放，缩小一半以上时用 area 减少锯齿
+      int flags = SWS_BICUBIC;
+      if (options_.preview) {
+        flags = thumb_width * 2 <= width ? SWS_AREA : SWS_FAST_BILINEAR;
+      }
+      // 相同分辨率和像素格式的文件复用缩放上下文
+      ScopedSwsContext sws_ctx({width, height, pix_fmt, thumb_width,
+                                thumb_height,
+                                AV_PIX_FMT_RGBA,  // 与 Image 的字节顺序一致
+                                flags});
+      if (!sws_ctx.get()) {
         break;
       }
-
-      image = std::make_unique<VideoInfoCapture::Image>(width, height);
-      for (int y = 0; y < argb_frame->height; ++y) {
-        for (int x = 0; x < argb_frame->width; ++x) {
-          uint8_t a =
-              *(argb_frame->data[0] + y * argb_frame->linesize[0] + x * 4);
-          uint8_t r =
-              *(argb_frame->data[0] + y * argb_frame->linesize[0] + x * 4 + 1);
-          uint8_t g =
-              *(argb_frame->data[0] + y * argb_frame->linesize[0] + x * 4 + 2);
-          uint8_t b =
-              *(argb_frame->data[0] + y * argb_frame->linesize[0] + x * 4 + 3);
-          image->SetColor(x, y, r, g, b, a);
-        }
+      // 直接缩放到 Image 的缓冲区，不经过中间帧
+      auto rgba_image =
+          std::make_unique<VideoInfoCapture::Image>(thumb_width, thumb_height);
+      uint8_t *dst_data[4] = {rgba_image->Data()};
+      int dst_linesize[4] = {rgba_image->GetStride()};
+      int sts = sws_scale(sws_ctx.get(),    // struct SwsContext* c,
+                          frame->data,      // const uint8_t* const srcSlice[],
+                          frame->linesize,  // const int srcStride[],
+                          0,                // int srcSliceY,
+                          frame->height,    // int srcSliceH,
+                          dst_data,         // uint8_t* const dst[],
+                          dst_linesize);    // const int dstStride[]);
+
+      if (sts == thumb_height) {
+        image = std::move(rgba_image);
       }
-
-      sws_freeContext(sws_ctx);
-      av_frame_free(&argb_frame);
     } while (0);
 
     return 0;
@@ -249,6 +247,15 @@ class VideoFirstValidFrameDecoder {
         return ret;
       }
 
+      if (options_.preview) {
+        int thumb_width = 0;
+        int thumb_height = 0;
+        FitThumbnailSize((*dec_ctx)->width, (*dec_ctx)->height,
+                         options_.max_width, options_.max_height,
+                         &thumb_width, &thumb_height);
+        SetPreviewDecoding(*dec_ctx, dec, thumb_width, thumb_height);
+      }
+
       /* Init the decoders */
       if ((ret = avcodec_open2(*dec_ctx, dec, nullptr)) < 0) {
         fprintf(stderr, "Failed to open %s codec\n",
@@ -273,6 +280,7 @@ class VideoFirstValidFrameDecoder {
   AVFrame *frame{nullptr};
   AVPacket *pkt{nullptr};
   int video_frame_count{0};
+  VideoInfoCapture::CaptureOptions options_;
 
   std::unique_ptr<VideoInfoCapture::Image> image;
 
@@ -286,11 +294,49 @@ class VideoFirstValidFrameDecoder {
 std::unique_ptr<VideoInfoCapture::Image>
 VideoInfoCapture::ExtractVideoFirstValidFrameToImageBuffer(
     const char *video_file_path, unsigned int *duration) {
-  VideoFirstValidFrameDecoder decoder;
-  auto image = decoder.ExtractFirstValidFrame(video_file_path, duration);
+  return ExtractVideoFirstValidFrameToImageBuffer(video_file_path, duration,
+                                                  CaptureOptions());
+}
+
+std::unique_ptr<VideoInfoCapture::Image>
+VideoInfoCapture::ExtractVideoFirstValidFrameToImageBuffer(
+    const char *video_file_path, unsigned int *duration,
+    const CaptureOptions &options) {
+  std::unique_ptr<Image> image;
+  {
+    VideoFirstValidFrameDecoder decoder;
+    image = decoder.ExtractFirstValidFrame(video_file_path, duration, options);
+  }
+  // 没有标记关键帧的流（比如只有恢复点的 H.264）预览解码不出画面，
+  // 退回完整解码
+  if (!image && options.preview) {
+    CaptureOptions full_options = options;
+    full_options.preview = false;
+    VideoFirstValidFrameDecoder decoder;
+    image =
+        decoder.ExtractFirstValidFrame(video_file_path, duration, full_options);
+  }
   return image;
 }
 
+VideoInfoCapture::ScalerCacheStats VideoInfoCapture::GetScalerCacheStats() {
+  ScalerCacheStats stats;
+  stats.hits = SwsContextCache::Instance().hits();
+  stats.misses = SwsContextCache::Instance().misses();
+  return stats;
+}
+
+void VideoInfoCapture::SetProbeCacheOptions(const ProbeCacheOptions &options) {
+  ProbeCache::Instance().SetOptions(options.directory, options.content_hash);
+}
+
+VideoInfoCapture::ProbeCacheStats VideoInfoCapture::GetProbeCacheStats() {
+  ProbeCacheStats stats;
+  stats.hits = ProbeCache::Instance().hits();
+  stats.misses = ProbeCache::Instance().misses();
+  return stats;
+}
+
 VideoInfoCapture::FileInfo VideoInfoCapture::ExtractFileInfo(
     const char *src_filename) {
   VideoInfoCapture::FileInfo file_info;
@@ -304,7 +350,7 @@ VideoInfoCapture::FileInfo VideoInfoCapture::ExtractFileInfo(
     }
 
     /* retrieve stream information */
-    if (avformat_find_stream_info(fmt_ctx, nullptr) < 0) {
+    if (FindStreamInfoCached(fmt_ctx, src_filename, nullptr) < 0) {
       break;
     }
 
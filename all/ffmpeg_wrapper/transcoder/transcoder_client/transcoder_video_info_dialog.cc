@@ -30,7 +30,11 @@ TranscoderVideoInfoDialog::TranscoderVideoInfoDialog(QWidget* parent)
           &TranscoderVideoInfoDialog::OnInputFileBrowserClicked);
 }
 
-TranscoderVideoInfoDialog::~TranscoderVideoInfoDialog() { delete ui_; }
+TranscoderVideoInfoDialog::~TranscoderVideoInfoDialog() {
+  // 先停掉后台提取，之后不会再有回调
+  batch_.reset();
+  delete ui_;
+}
 
 void TranscoderVideoInfoDialog::OnInputFileBrowserClicked() {
   QFileDialog dialog(this);
@@ -48,44 +52,71 @@ void TranscoderVideoInfoDialog::OnInputFileBrowserClicked() {
   if (dialog.exec()) {
     file_names = dialog.selectedFiles();
   }
-  if (!file_names.isEmpty()) {
-    QJsonArray json_arr;
-    for (auto file_name : file_names) {
-      VideoInfoCapture::VideoInfo video_info;
-      QJsonObject json_obj;
-      auto begin = std::chrono::high_resolution_clock::now();
-      if (!VideoInfoCapture::ExtractVideInfo(file_name.toStdString().c_str(),
-                                             &video_info)) {
-        // error info
-        json_obj.insert("err_code", -1);
-        json_obj.insert("err_msg", QString("get video info failed."));
-      } else {
-        json_obj.insert("err_code", 0);
-        json_obj.insert("err_msg", QString(""));
-        QJsonObject json_thumb;
-        json_thumb.insert(
-            "image_path",
-            QString("%1").arg(video_info.thumb_image_path.c_str()));
-        json_thumb.insert("width", video_info.thumb_image_width);
-        json_thumb.insert("height", video_info.thumb_image_height);
-        json_thumb.insert("size", video_info.thumb_image_size);
-        json_obj.insert("thumb_image", json_thumb);
-        json_obj.insert("size", video_info.video_size);
-        json_obj.insert("width", video_info.video_width);
-        json_obj.insert("height", video_info.video_height);
-        json_obj.insert("duration", video_info.video_duration);
-        json_obj.insert("video_path",
-                        QString("%1").arg(video_info.video_path.c_str()));
-      }
-      auto end = std::chrono::high_resolution_clock::now();
-      std::chrono::duration<double, std::milli> elapsed = end - begin;
-      json_obj.insert("extract_cost_time", static_cast<int>(elapsed.count()));
-      json_arr.push_back(json_obj);
-    }
-    QJsonObject json_root;
-    json_root.insert("video_info_list", json_arr);
-    QJsonDocument doc(json_root);
-    QString video_info_json_str(doc.toJson(QJsonDocument::Indented));
-    ui_->outputEdit->setText(video_info_json_str);
+  if (file_names.isEmpty()) {
+    return;
+  }
+  // 后台并发提取，不阻塞界面；上一批还没完成时取消
+  batch_.reset();
+  video_infos_.clear();
+  video_infos_.resize(file_names.size());
+  std::vector<std::string> paths;
+  for (const auto& file_name : file_names) {
+    paths.push_back(file_name.toStdString());
+  }
+  ui_->inputFileButton->setEnabled(false);
+  ui_->outputEdit->setText(
+      QString("extracting video info: 0/%1").arg(file_names.size()));
+  batch_ = VideoInfoCapture::ExtractVideoInfoBatch(
+      paths, VideoInfoCapture::CaptureOptions(),
+      [this](const VideoInfoCapture::BatchResult& result) {
+        QMetaObject::invokeMethod(
+            this, [this, result]() { OnVideoInfoExtracted(result); },
+            Qt::QueuedConnection);
+      });
+}
+
+void TranscoderVideoInfoDialog::OnVideoInfoExtracted(
+    const VideoInfoCapture::BatchResult& result) {
+  const VideoInfoCapture::VideoInfo& video_info = result.video_info;
+  QJsonObject json_obj;
+  if (!result.ok) {
+    // error info
+    json_obj.insert("err_code", -1);
+    json_obj.insert("err_msg", QString("get video info failed."));
+  } else {
+    json_obj.insert("err_code", 0);
+    json_obj.insert("err_msg", QString(""));
+    QJsonObject json_thumb;
+    json_thumb.insert("image_path",
+                      QString("%1").arg(video_info.thumb_image_path.c_str()));
+    json_thumb.insert("width", video_info.thumb_image_width);
+    json_thumb.insert("height", video_info.thumb_image_height);
+    json_thumb.insert("size", video_info.thumb_image_size);
+    json_obj.insert("thumb_image", json_thumb);
+    json_obj.insert("size", video_info.video_size);
+    json_obj.insert("width", video_info.video_width);
+    json_obj.insert("height", video_info.video_height);
+    json_obj.insert("duration", video_info.video_duration);
+    json_obj.insert("video_path",
+                    QString("%1").arg(video_info.video_path.c_str()));
+  }
+  json_obj.insert("extract_cost_time", result.extract_cost_time);
+  video_infos_[static_cast<int>(result.index)] = json_obj;
+
+  if (result.finished < result.total) {
+    ui_->outputEdit->setText(QString("extracting video info: %1/%2")
+                                 .arg(result.finished)
+                                 .arg(result.total));
+    return;
+  }
+  QJsonArray json_arr;
+  for (const auto& video_info_obj : video_infos_) {
+    json_arr.push_back(video_info_obj);
   }
+  QJsonObject json_root;
+  json_root.insert("video_info_list", json_arr);
+  QJsonDocument doc(json_root);
+  QString video_info_json_str(doc.toJson(QJsonDocument::Indented));
+  ui_->outputEdit->setText(video_info_json_str);
+  ui_->inputFileButton->setEnabled(true);
 }
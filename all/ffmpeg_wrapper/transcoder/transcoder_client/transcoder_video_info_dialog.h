@@ -7,6 +7,11 @@
 #pragma once
 
 #include <QDialog>
+#include <QJsonObject>
+#include <QVector>
+#include <memory>
+
+#include "video_info_capture.h"
 
 namespace Ui {
 class TranscoderVideoInfoDialog;
@@ -22,6 +27,13 @@ class TranscoderVideoInfoDialog : public QDialog {
  private slots:
   void OnInputFileBrowserClicked();
 
+ private:
+  // 在界面线程上按完成顺序收到每个文件的结果
+  void OnVideoInfoExtracted(const VideoInfoCapture::BatchResult& result);
+
  private:
   Ui::TranscoderVideoInfoDialog* ui_{nullptr};
+  std::unique_ptr<VideoInfoCapture::Batch> batch_;
+  // 按选择的顺序输出
+  QVector<QJsonObject> video_infos_;
 };
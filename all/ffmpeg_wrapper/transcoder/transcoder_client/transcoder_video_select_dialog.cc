@@ -15,6 +15,7 @@
 #include <QMessageBox>
 #include <QStandardPaths>
 #include <QUrl>
+#include <cstring>
 
 #include "transcoder_base/log/log_writer.h"
 #include "ui_transcoder_video_select_dialog.h"
@@ -25,14 +26,15 @@ QImage ConvertCvImageToQImage(const VideoInfoCapture::Image& cvimage,
                               double afactor = 1.0) {
   int cvwidth = cvimage.GetWidth();
   int cvheight = cvimage.GetHeight();
-  QImage dest(cvwidth, cvheight, QImage::Format_ARGB32);
+  // Image 按 r、g、b、a 的字节顺序存放，与 Format_RGBA8888 相同，整行拷贝
+  QImage dest(cvwidth, cvheight, QImage::Format_RGBA8888);
   for (int y = 0; y < cvheight; ++y) {
-    for (int x = 0; x < cvwidth; ++x) {
-      unsigned char r, g, b, a;
-      cvimage.GetColor(x, y, &r, &g, &b, &a);
-      a = a * afactor;
-      QColor qcolor(r, g, b, a);
-      dest.setPixelColor(x, y, qcolor);
+    uchar* row = dest.scanLine(y);
+    memcpy(row, cvimage.Row(y), cvwidth * 4);
+    if (afactor != 1.0) {
+      for (int x = 0; x < cvwidth; ++x) {
+        row[x * 4 + 3] = row[x * 4 + 3] * afactor;
+      }
     }
   }
   return dest;
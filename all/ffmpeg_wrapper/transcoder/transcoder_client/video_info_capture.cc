@@ -23,15 +23,28 @@ extern "C" {
 }
 #endif
 
+#include <QCryptographicHash>
 #include <QDateTime>
 #include <QDir>
 #include <QFileInfo>
 #include <QImage>
 #include <QStandardPaths>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstring>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <utility>
 #include <vector>
 
+#include "ffmpeg_preview_decode.h"
+#include "ffmpeg_probe_cache.h"
+#include "ffmpeg_sws_cache.h"
+
 namespace {
 std::vector<std::string> AvailableEncoders(AVMediaType type) {
   std::vector<std::string> encoders;
@@ -92,7 +105,9 @@ class VideoFirstValidFrameDecoder {
 
  public:
   std::unique_ptr<VideoInfoCapture::Image> ExtractFirstValidFrame(
-      const char *src_filename, unsigned int *duration_sec) {
+      const char *src_filename, unsigned int *duration_sec,
+      const VideoInfoCapture::CaptureOptions &options) {
+    options_ = options;
     /* open input file, and allocate format context */
     int ret = avformat_open_input(&fmt_ctx, src_filename, nullptr, nullptr);
     if (ret < 0) {
@@ -103,7 +118,7 @@ class VideoFirstValidFrameDecoder {
     }
 
     /* retrieve stream information */
-    if (avformat_find_stream_info(fmt_ctx, nullptr) < 0) {
+    if (FindStreamInfoCached(fmt_ctx, src_filename, nullptr) < 0) {
       fprintf(stderr, "Could not find stream information\n");
       return std::move(image);
     }
@@ -119,6 +134,9 @@ class VideoFirstValidFrameDecoder {
       if (duration_sec) {
         *duration_sec = static_cast<double>(fmt_ctx->duration) / AV_TIME_BASE;
       }
+      if (options_.preview) {
+        SetPreviewDiscard(fmt_ctx, video_stream_idx);
+      }
     }
 
     /* dump input information to stderr */
@@ -176,65 +194,52 @@ class VideoFirstValidFrameDecoder {
 
  private:
   int output_video_frame(AVFrame *frame) {
-    if (frame->width != width || frame->height != height ||
-        frame->format != pix_fmt) {
-      /* To handle this change, one could call av_image_alloc again and
-       * decode the following frames into another rawvideo file. */
-      fprintf(stderr,
-              "Error: Width, height and pixel format have to be "
-              "constant in a rawvideo file, but the width, height or "
-              "pixel format of the input video changed:\n"
-              "old: width = %d, height = %d, format = %s\n"
-              "new: width = %d, height = %d, format = %s\n",
-              width, height, av_get_pix_fmt_name(pix_fmt), frame->width,
-              frame->height,
-              av_get_pix_fmt_name(static_cast<AVPixelFormat>(frame->format)));
-      return -1;
+    // 同一个数据包可能解出多帧，只要第一帧
+    if (image) {
+      return 0;
     }
+    // lowres 解码时帧比编码参数里的尺寸小，以帧为准
+    width = frame->width;
+    height = frame->height;
+    pix_fmt = static_cast<AVPixelFormat>(frame->format);
 
     printf("video_frame n:%d coded_n:%d\n", video_frame_count++,
            frame->coded_picture_number);
 
     do {
-      struct SwsContext *sws_ctx =
-          sws_getContext(width, height, pix_fmt, width, height,
-                         AV_PIX_FMT_ARGB,  // argb
-                         SWS_BICUBIC, nullptr, nullptr, nullptr);
-      AVFrame *argb_frame = av_frame_alloc();
-
-      argb_frame->format = AV_PIX_FMT_ARGB;
-      argb_frame->width = width;
-      argb_frame->height = height;
-      int sts = av_frame_get_buffer(argb_frame, 0);
-      sts = sws_scale(sws_ctx,           // struct SwsContext* c,
-                      frame->data,       // const uint8_t* const srcSlice[],
-                      frame->linesize,   // const int srcStride[],
-                      0,                 // int srcSliceY,
-                      frame->height,     // int srcSliceH,
-                      argb_frame->data,  // uint8_t* const dst[],
-                      argb_frame->linesize);  // const int dstStride[]);
-
-      if (sts != frame->height) {
+      int thumb_width = width;
+      int thumb_height = height;
+      FitThumbnailSize(width, height, options_.max_width, options_.max_height,
+                       &thumb_width, &thumb_height);
+      // 预览时用快速缩放，缩小一半以上时用 area 减少锯齿
+      int flags = SWS_BICUBIC;
+      if (options_.preview) {
+        flags = thumb_width * 2 <= width ? SWS_AREA : SWS_FAST_BILINEAR;
+      }
+      // 相同分辨率和像素格式的文件复用缩放上下文
+      ScopedSwsContext sws_ctx({width, height, pix_fmt, thumb_width,
+                                thumb_height,
+                                AV_PIX_FMT_RGBA,  // 与 Image 的字节顺序一致
+                                flags});
+      if (!sws_ctx.get()) {
         break;
       }
-
-      image = std::make_unique<VideoInfoCapture::Image>(width, height);
-      for (int y = 0; y < argb_frame->height; ++y) {
-        for (int x = 0; x < argb_frame->width; ++x) {
-          uint8_t a =
-              *(argb_frame->data[0] + y * argb_frame->linesize[0] + x * 4);
-          uint8_t r =
-              *(argb_frame->data[0] + y * argb_frame->linesize[0] + x * 4 + 1);
-          uint8_t g =
-              *(argb_frame->data[0] + y * argb_frame->linesize[0] + x * 4 + 2);
-          uint8_t b =
-              *(argb_frame->data[0] + y * argb_frame->linesize[0] + x * 4 + 3);
-          image->SetColor(x, y, r, g, b, a);
-        }
+      // 直接缩放到 Image 的缓冲区，不经过中间帧
+      auto rgba_image =
+          std::make_unique<VideoInfoCapture::Image>(thumb_width, thumb_height);
+      uint8_t *dst_data[4] = {rgba_image->Data()};
+      int dst_linesize[4] = {rgba_image->GetStride()};
+      int sts = sws_scale(sws_ctx.get(),    // struct SwsContext* c,
+                          frame->data,      // const uint8_t* const srcSlice[],
+                          frame->linesize,  // const int srcStride[],
+                          0,                // int srcSliceY,
+                          frame->height,    // int srcSliceH,
+                          dst_data,         // uint8_t* const dst[],
+                          dst_linesize);    // const int dstStride[]);
+
+      if (sts == thumb_height) {
+        image = std::move(rgba_image);
       }
-
-      sws_freeContext(sws_ctx);
-      av_frame_free(&argb_frame);
     } while (0);
 
     return 0;
@@ -314,6 +319,15 @@ class VideoFirstValidFrameDecoder {
         return ret;
       }
 
+      if (options_.preview) {
+        int thumb_width = 0;
+        int thumb_height = 0;
+        FitThumbnailSize((*dec_ctx)->width, (*dec_ctx)->height,
+                         options_.max_width, options_.max_height,
+                         &thumb_width, &thumb_height);
+        SetPreviewDecoding(*dec_ctx, dec, thumb_width, thumb_height);
+      }
+
       /* Init the decoders */
       if ((ret = avcodec_open2(*dec_ctx, dec, nullptr)) < 0) {
         fprintf(stderr, "Failed to open %s codec\n",
@@ -338,6 +352,7 @@ class VideoFirstValidFrameDecoder {
   AVFrame *frame{nullptr};
   AVPacket *pkt{nullptr};
   int video_frame_count{0};
+  VideoInfoCapture::CaptureOptions options_;
 
   std::unique_ptr<VideoInfoCapture::Image> image;
 
@@ -351,11 +366,38 @@ class VideoFirstValidFrameDecoder {
 std::unique_ptr<VideoInfoCapture::Image>
 VideoInfoCapture::ExtractVideoFirstValidFrameToImageBuffer(
     const char *video_file_path, unsigned int *duration) {
-  VideoFirstValidFrameDecoder decoder;
-  auto image = decoder.ExtractFirstValidFrame(video_file_path, duration);
+  return ExtractVideoFirstValidFrameToImageBuffer(video_file_path, duration,
+                                                  CaptureOptions());
+}
+
+std::unique_ptr<VideoInfoCapture::Image>
+VideoInfoCapture::ExtractVideoFirstValidFrameToImageBuffer(
+    const char *video_file_path, unsigned int *duration,
+    const CaptureOptions &options) {
+  std::unique_ptr<Image> image;
+  {
+    VideoFirstValidFrameDecoder decoder;
+    image = decoder.ExtractFirstValidFrame(video_file_path, duration, options);
+  }
+  // 没有标记关键帧的流（比如只有恢复点的 H.264）预览解码不出画面，
+  // 退回完整解码
+  if (!image && options.preview) {
+    CaptureOptions full_options = options;
+    full_options.preview = false;
+    VideoFirstValidFrameDecoder decoder;
+    image =
+        decoder.ExtractFirstValidFrame(video_file_path, duration, full_options);
+  }
   return image;
 }
 
+VideoInfoCapture::ScalerCacheStats VideoInfoCapture::GetScalerCacheStats() {
+  ScalerCacheStats stats;
+  stats.hits = SwsContextCache::Instance().hits();
+  stats.misses = SwsContextCache::Instance().misses();
+  return stats;
+}
+
 VideoInfoCapture::FileInfo VideoInfoCapture::ExtractFileInfo(
     const char *src_filename) {
   VideoInfoCapture::FileInfo file_info;
@@ -369,7 +411,7 @@ VideoInfoCapture::FileInfo VideoInfoCapture::ExtractFileInfo(
     }
 
     /* retrieve stream information */
-    if (avformat_find_stream_info(fmt_ctx, nullptr) < 0) {
+    if (FindStreamInfoCached(fmt_ctx, src_filename, nullptr) < 0) {
       break;
     }
 
@@ -436,14 +478,15 @@ QImage ConvertCvImageToQImage(const VideoInfoCapture::Image &cvimage,
                               double afactor = 1.0) {
   int cvwidth = cvimage.GetWidth();
   int cvheight = cvimage.GetHeight();
-  QImage dest(cvwidth, cvheight, QImage::Format_ARGB32);
+  // Image 按 r、g、b、a 的字节顺序存放，与 Format_RGBA8888 相同，整行拷贝
+  QImage dest(cvwidth, cvheight, QImage::Format_RGBA8888);
   for (int y = 0; y < cvheight; ++y) {
-    for (int x = 0; x < cvwidth; ++x) {
-      unsigned char r, g, b, a;
-      cvimage.GetColor(x, y, &r, &g, &b, &a);
-      a = a * afactor;
-      QColor qcolor(r, g, b, a);
-      dest.setPixelColor(x, y, qcolor);
+    uchar *row = dest.scanLine(y);
+    memcpy(row, cvimage.Row(y), cvwidth * 4);
+    if (afactor != 1.0) {
+      for (int x = 0; x < cvwidth; ++x) {
+        row[x * 4 + 3] = row[x * 4 + 3] * afactor;
+      }
     }
   }
   return dest;
@@ -454,8 +497,16 @@ class VideoInfoDecoder {
 
  public:
   bool ExtractVideoInfo(const char *src_filename,
-                        VideoInfoCapture::VideoInfo *video_info) {
+                        VideoInfoCapture::VideoInfo *video_info,
+                        const VideoInfoCapture::CaptureOptions &options) {
     video_info_ = {};
+    options_ = options;
+    if (options_.max_width <= 0) {
+      options_.max_width = kMaxThumbImageWidth;
+    }
+    if (options_.max_height <= 0) {
+      options_.max_height = kMaxThumbImageHeight;
+    }
     src_file_path_ = src_filename;
     /* open input file, and allocate format context */
     int ret = avformat_open_input(&fmt_ctx, src_filename, nullptr, nullptr);
@@ -467,7 +518,7 @@ class VideoInfoDecoder {
     }
 
     /* retrieve stream information */
-    if (avformat_find_stream_info(fmt_ctx, nullptr) < 0) {
+    if (FindStreamInfoCached(fmt_ctx, src_filename, nullptr) < 0) {
       fprintf(stderr, "Could not find stream information\n");
       return false;
     }
@@ -481,11 +532,15 @@ class VideoInfoDecoder {
       height = video_dec_ctx->height;
       pix_fmt = video_dec_ctx->pix_fmt;
 
-      video_info_.video_width = video_dec_ctx->width;
-      video_info_.video_height = video_dec_ctx->height;
+      // lowres 解码时解码器的尺寸会变小，用编码参数里的
+      video_info_.video_width = video_stream->codecpar->width;
+      video_info_.video_height = video_stream->codecpar->height;
       // fmt_ctx->duration us
       video_info_.video_duration =
           static_cast<double>(fmt_ctx->duration) / 1000;
+      if (options_.preview) {
+        SetPreviewDiscard(fmt_ctx, video_stream_idx);
+      }
     }
 
     /* dump input information to stderr */
@@ -549,64 +604,51 @@ class VideoInfoDecoder {
   }
 
  private:
+  // 缩略图默认缩小到这个尺寸以内
+  static constexpr int kMaxThumbImageWidth = 1920;
+  static constexpr int kMaxThumbImageHeight = 1080;
+  // 缩略图文件名的序号，批量提取的工作线程共享
+  static std::atomic<uint64_t> thumb_sequence_;
+
   int output_video_frame(AVFrame *frame) {
-    if (frame->width != width || frame->height != height ||
-        frame->format != pix_fmt) {
-      /* To handle this change, one could call av_image_alloc again and
-       * decode the following frames into another rawvideo file. */
-      fprintf(stderr,
-              "Error: Width, height and pixel format have to be "
-              "constant in a rawvideo file, but the width, height or "
-              "pixel format of the input video changed:\n"
-              "old: width = %d, height = %d, format = %s\n"
-              "new: width = %d, height = %d, format = %s\n",
-              width, height, av_get_pix_fmt_name(pix_fmt), frame->width,
-              frame->height,
-              av_get_pix_fmt_name(static_cast<AVPixelFormat>(frame->format)));
-      return -1;
+    // 同一个数据包可能解出多帧，只要第一帧
+    if (!video_info_.thumb_image_path.empty()) {
+      return 0;
     }
+    // lowres 解码时帧比编码参数里的尺寸小，以帧为准
+    width = frame->width;
+    height = frame->height;
+    pix_fmt = static_cast<AVPixelFormat>(frame->format);
 
     printf("video_frame n:%d coded_n:%d\n", video_frame_count++,
            frame->coded_picture_number);
 
     do {
-      constexpr const int kMaxThumbImageWidth = 1920;
-      constexpr const int kMaxThumbImageHeight = 1080;
       int src_w = width;
       int src_h = height;
       int dest_w = width;
       int dest_h = height;
       // scale to dst
-      auto w_scale = static_cast<double>(dest_w) / kMaxThumbImageWidth;
-      auto h_scale = static_cast<double>(dest_h) / kMaxThumbImageHeight;
-      if (dest_w > kMaxThumbImageWidth && dest_h > kMaxThumbImageHeight) {
-        if (w_scale > h_scale) {
-          // scale by width
-          dest_h = src_h / w_scale;
-          dest_w = kMaxThumbImageWidth;
-        } else {
-          // scale by height;
-          dest_w = src_w / h_scale;
-          dest_h = kMaxThumbImageHeight;
-        }
-      } else if (video_info_.video_width > kMaxThumbImageWidth) {
-        dest_h = src_h / w_scale;
-        dest_w = kMaxThumbImageWidth;
-      } else if (video_info_.video_height > kMaxThumbImageHeight) {
-        dest_w = src_w / h_scale;
-        dest_h = kMaxThumbImageHeight;
+      FitThumbnailSize(src_w, src_h, options_.max_width, options_.max_height,
+                       &dest_w, &dest_h);
+      // 预览时用快速缩放，缩小一半以上时用 area 减少锯齿
+      int flags = SWS_BICUBIC;
+      if (options_.preview) {
+        flags = dest_w * 2 <= src_w ? SWS_AREA : SWS_FAST_BILINEAR;
+      }
+      ScopedSwsContext sws_ctx({src_w, src_h, pix_fmt, dest_w, dest_h,
+                                AV_PIX_FMT_ARGB,  // argb
+                                flags});
+      if (!sws_ctx.get()) {
+        break;
       }
-      struct SwsContext *sws_ctx =
-          sws_getContext(src_w, src_h, pix_fmt, dest_w, dest_h,
-                         AV_PIX_FMT_ARGB,  // argb
-                         SWS_BICUBIC, nullptr, nullptr, nullptr);
       AVFrame *argb_frame = av_frame_alloc();
 
       argb_frame->format = AV_PIX_FMT_ARGB;
       argb_frame->width = dest_w;
       argb_frame->height = dest_h;
       int sts = av_frame_get_buffer(argb_frame, 0);
-      sts = sws_scale(sws_ctx,           // struct SwsContext* c,
+      sts = sws_scale(sws_ctx.get(),     // struct SwsContext* c,
                       frame->data,       // const uint8_t* const srcSlice[],
                       frame->linesize,   // const int srcStride[],
                       0,                 // int srcSliceY,
@@ -616,6 +658,7 @@ class VideoInfoDecoder {
 
       if (sts != argb_frame->height) {
         // scale failed
+        av_frame_free(&argb_frame);
         break;
       }
 
@@ -632,11 +675,21 @@ class VideoInfoDecoder {
 
       QFileInfo src_video_file_info(QString(src_file_path_.c_str()));
       // calc image thumb path
+      // 批量提取时不同目录下的同名文件、同一个文件出现多次都可能在同一秒内
+      // 完成，文件名加上绝对路径的哈希和进程内的序号
+      QString path_hash = QString::fromLatin1(
+          QCryptographicHash::hash(
+              src_video_file_info.absoluteFilePath().toUtf8(),
+              QCryptographicHash::Md5)
+              .toHex()
+              .left(16));
       QString thumb_image_path =
-          QString("%1/%2_thumb_%3.png")
+          QString("%1/%2_thumb_%3_%4_%5.png")
               .arg(image_cache_dir)
               .arg(src_video_file_info.baseName())
-              .arg(QDateTime::currentDateTime().toString("yyyyMMdd_HHmmss"));
+              .arg(path_hash)
+              .arg(QDateTime::currentDateTime().toString("yyyyMMdd_HHmmss"))
+              .arg(thumb_sequence_++);
 
       QImage srcimage(argb_frame->width, argb_frame->height,
                       QImage::Format_ARGB32);
@@ -691,7 +744,6 @@ class VideoInfoDecoder {
         video_info_.video_size = src_video_file_info.size();
         video_info_.video_path = src_file_path_;
       }
-      sws_freeContext(sws_ctx);
       av_frame_free(&argb_frame);
     } while (false);
 
@@ -772,6 +824,15 @@ class VideoInfoDecoder {
         return ret;
       }
 
+      if (options_.preview) {
+        int thumb_width = 0;
+        int thumb_height = 0;
+        FitThumbnailSize((*dec_ctx)->width, (*dec_ctx)->height,
+                         options_.max_width, options_.max_height,
+                         &thumb_width, &thumb_height);
+        SetPreviewDecoding(*dec_ctx, dec, thumb_width, thumb_height);
+      }
+
       /* Init the decoders */
       if ((ret = avcodec_open2(*dec_ctx, dec, nullptr)) < 0) {
         fprintf(stderr, "Failed to open %s codec\n",
@@ -796,6 +857,7 @@ class VideoInfoDecoder {
   AVFrame *frame{nullptr};
   AVPacket *pkt{nullptr};
   int video_frame_count{0};
+  VideoInfoCapture::CaptureOptions options_;
 
   std::string src_file_path_;
   VideoInfoCapture::VideoInfo video_info_;
@@ -804,19 +866,134 @@ class VideoInfoDecoder {
   VideoInfoDecoder(const VideoInfoDecoder &) = delete;
   VideoInfoDecoder &operator=(const VideoInfoDecoder &) = delete;
 };
+std::atomic<uint64_t> VideoInfoDecoder::thumb_sequence_{0};
 }  // namespace
 
 bool VideoInfoCapture::ExtractVideInfo(
     const char *video_file_path, VideoInfoCapture::VideoInfo *video_info) {
+  return ExtractVideInfo(video_file_path, video_info, CaptureOptions());
+}
+
+bool VideoInfoCapture::ExtractVideInfo(const char *video_file_path,
+                                       VideoInfoCapture::VideoInfo *video_info,
+                                       const CaptureOptions &options) {
   if (!video_info) {
     return false;
   }
   VideoInfoCapture::VideoInfo ret;
 
   // extract info
-  VideoInfoDecoder decoder;
-  auto image = decoder.ExtractVideoInfo(video_file_path, &ret);
+  {
+    VideoInfoDecoder decoder;
+    decoder.ExtractVideoInfo(video_file_path, &ret, options);
+  }
+  // 与 ExtractVideoFirstValidFrameToImageBuffer 相同，预览解码不出画面时
+  // 退回完整解码
+  if (ret.thumb_image_path.empty() && options.preview) {
+    CaptureOptions full_options = options;
+    full_options.preview = false;
+    ret = {};
+    VideoInfoDecoder decoder;
+    decoder.ExtractVideoInfo(video_file_path, &ret, full_options);
+  }
 
   *video_info = ret;
-  return true;
+  return !ret.thumb_image_path.empty();
+}
+
+namespace {
+constexpr int kMaxBatchThreads = 16;
+
+class VideoInfoBatch : public VideoInfoCapture::Batch {
+ public:
+  VideoInfoBatch(const std::vector<std::string> &paths,
+                 const VideoInfoCapture::CaptureOptions &options,
+                 VideoInfoCapture::BatchCallback callback)
+      : paths_(paths), options_(options), callback_(std::move(callback)) {}
+  ~VideoInfoBatch() override {
+    Cancel();
+    Wait();
+  }
+
+  void Start() {
+    int threads = options_.threads;
+    if (threads <= 0) {
+      threads = static_cast<int>(std::thread::hardware_concurrency()) * 2;
+      threads = std::min(std::max(threads, 1), kMaxBatchThreads);
+    }
+    threads = static_cast<int>(std::min<size_t>(threads, paths_.size()));
+    for (int i = 0; i < threads; i++) {
+      workers_.emplace_back(&VideoInfoBatch::Work, this);
+    }
+  }
+
+  void Cancel() override {
+    cancelled_ = true;
+    // 等正在执行的回调结束
+    std::lock_guard<std::recursive_mutex> lock(callback_mutex_);
+  }
+
+  void Wait() override {
+    std::lock_guard<std::mutex> lock(wait_mutex_);
+    for (auto &worker : workers_) {
+      if (worker.joinable()) {
+        worker.join();
+      }
+    }
+  }
+
+ private:
+  void Work() {
+    while (!cancelled_) {
+      size_t index = next_++;
+      if (index >= paths_.size()) {
+        return;
+      }
+      VideoInfoCapture::BatchResult result;
+      result.index = index;
+      result.path = paths_[index];
+      result.total = paths_.size();
+      auto begin = std::chrono::steady_clock::now();
+      result.ok = VideoInfoCapture::ExtractVideInfo(
+          result.path.c_str(), &result.video_info, options_);
+      auto end = std::chrono::steady_clock::now();
+      result.extract_cost_time = static_cast<int>(
+          std::chrono::duration_cast<std::chrono::milliseconds>(end - begin)
+              .count());
+
+      std::lock_guard<std::recursive_mutex> lock(callback_mutex_);
+      if (cancelled_) {
+        return;
+      }
+      result.finished = ++finished_;
+      if (callback_) {
+        callback_(result);
+      }
+    }
+  }
+
+ private:
+  std::vector<std::string> paths_;
+  VideoInfoCapture::CaptureOptions options_;
+  VideoInfoCapture::BatchCallback callback_;
+
+  std::atomic<size_t> next_{0};
+  std::atomic_bool cancelled_{false};
+  // 回调中可能调用 Cancel()
+  std::recursive_mutex callback_mutex_;
+  size_t finished_{0};
+
+  std::mutex wait_mutex_;
+  std::vector<std::thread> workers_;
+};
+}  // namespace
+
+std::unique_ptr<VideoInfoCapture::Batch>
+VideoInfoCapture::ExtractVideoInfoBatch(const std::vector<std::string> &paths,
+                                        const CaptureOptions &options,
+                                        BatchCallback callback) {
+  auto batch =
+      std::make_unique<VideoInfoBatch>(paths, options, std::move(callback));
+  batch->Start();
+  return batch;
 }
@@ -6,9 +6,13 @@
 
 #pragma once
 
+#include <cstdint>
+#include <cstdio>
+#include <functional>
 #include <memory>
 #include <string>
 #include <unordered_map>
+#include <vector>
 
 class VideoInfoCapture {
  public:
@@ -18,18 +22,41 @@ class VideoInfoCapture {
   static std::vector<std::string> AvailableFileFormats();
 
  public:
-  // argb 32bit image
+  // 32bit 图像，每个像素按 r、g、b、a 的字节顺序存放；每行 GetStride()
+  // 字节，行首按 kAlignment 对齐，可以直接作为 sws_scale 的输出
   struct Image final {
+    static constexpr int kAlignment = 64;
+
     ~Image() { printf("destroy image\n"); }
     Image(int width, int height) {
       printf("contruct image\n");
       this->width = width;
       this->height = height;
-      image_data = std::make_unique<unsigned char[]>(width * height * 4);
+      stride = (width * 4 + kAlignment - 1) / kAlignment * kAlignment;
+      // 不初始化，像素由调用者整行写入
+      storage.reset(new unsigned char[static_cast<size_t>(stride) * height +
+                                      kAlignment]);
+      uintptr_t addr = reinterpret_cast<uintptr_t>(storage.get());
+      image_data =
+          storage.get() + (kAlignment - addr % kAlignment) % kAlignment;
     }
+    // 使用调用者的缓冲区，不拷贝也不释放，stride 为每行的字节数
+    Image(int width, int height, unsigned char* data, int stride)
+        : width(width), height(height), stride(stride), image_data(data) {}
 
     int GetWidth() const { return width; }
     int GetHeight() const { return height; }
+    int GetStride() const { return stride; }
+    unsigned char* Data() { return image_data; }
+    const unsigned char* Data() const { return image_data; }
+    // 第 row 行开头，连续 width * 4 个字节
+    unsigned char* Row(int row) {
+      return image_data + static_cast<size_t>(row) * stride;
+    }
+    const unsigned char* Row(int row) const {
+      return image_data + static_cast<size_t>(row) * stride;
+    }
+
     bool GetColor(int col, int row, unsigned char* r, unsigned char* g,
                   unsigned char* b, unsigned char* a) const {
       if (!(r && g && b && a)) {
@@ -38,27 +65,29 @@ class VideoInfoCapture {
       if (col < 0 || col >= width || row < 0 || row >= height) {
         return false;
       }
-      int color_pos = row * width * 4 + col * 4;
-      *r = image_data.get()[color_pos];
-      *g = image_data.get()[color_pos + 1];
-      *b = image_data.get()[color_pos + 2];
-      *a = image_data.get()[color_pos + 3];
+      const unsigned char* color = Row(row) + col * 4;
+      *r = color[0];
+      *g = color[1];
+      *b = color[2];
+      *a = color[3];
       return true;
     }
 
     void SetColor(int col, int row, unsigned char r, unsigned char g,
                   unsigned char b, unsigned char a) {
-      int color_pos = row * width * 4 + col * 4;
-      image_data.get()[color_pos] = r;
-      image_data.get()[color_pos + 1] = g;
-      image_data.get()[color_pos + 2] = b;
-      image_data.get()[color_pos + 3] = a;
+      unsigned char* color = Row(row) + col * 4;
+      color[0] = r;
+      color[1] = g;
+      color[2] = b;
+      color[3] = a;
     }
 
    private:
     int width{0};
     int height{0};
-    std::unique_ptr<unsigned char[]> image_data;
+    int stride{0};
+    unsigned char* image_data{nullptr};
+    std::unique_ptr<unsigned char[]> storage;
 
    private:
     Image(const Image&) = delete;
@@ -68,6 +97,28 @@ class VideoInfoCapture {
   static std::unique_ptr<Image> ExtractVideoFirstValidFrameToImageBuffer(
       const char* video_file_path, unsigned int* duration);
 
+  struct CaptureOptions {
+    // 预览模式：只解码关键帧，跳过环路滤波，解码器支持时用 lowres，
+    // 用快速缩放直接缩到缩略图尺寸；画质略差，适合缩略图和预览
+    bool preview{false};
+    // 按比例缩小到这个尺寸以内，0 表示不限制
+    int max_width{0};
+    int max_height{0};
+    // 批量提取的线程数，0 表示 CPU 核数的两倍（最多 16 个）：
+    // 每个文件的耗时有不少在等待读取
+    int threads{0};
+  };
+  static std::unique_ptr<Image> ExtractVideoFirstValidFrameToImageBuffer(
+      const char* video_file_path, unsigned int* duration,
+      const CaptureOptions& options);
+
+  // 截图时缩放上下文缓存的命中统计，进程内所有截图共享一个缓存
+  struct ScalerCacheStats {
+    int64_t hits{0};
+    int64_t misses{0};
+  };
+  static ScalerCacheStats GetScalerCacheStats();
+
   struct FileInfo {
     std::unordered_map<int, int64_t> audio_stream_bitrates;
     std::unordered_map<int, int64_t> video_stream_bitrates;
@@ -86,4 +137,34 @@ class VideoInfoCapture {
     int video_size{0};
   };
   static bool ExtractVideInfo(const char* src_file_path, VideoInfo* video_info = nullptr);
+  // options 的最大宽高为 0 时，缩略图缩小到 1920x1080 以内
+  // 解码出缩略图并保存成功时返回 true
+  static bool ExtractVideInfo(const char* src_file_path, VideoInfo* video_info,
+                              const CaptureOptions& options);
+
+  // 批量提取视频信息，每个文件完成后回调一次
+  struct BatchResult {
+    size_t index{0};  // 在 paths 中的下标，完成的顺序与之无关
+    std::string path;
+    bool ok{false};
+    VideoInfo video_info;
+    int extract_cost_time{0};  // msec
+    size_t finished{0};        // 包括这个在内已经完成的文件数
+    size_t total{0};
+  };
+  // 在工作线程上调用，同一时间只有一个回调在执行
+  using BatchCallback = std::function<void(const BatchResult&)>;
+  class Batch {
+   public:
+    // 取消并等待工作线程退出
+    virtual ~Batch() = default;
+    // 还没开始的文件不再提取；返回后不会再有回调，可以在回调中调用
+    virtual void Cancel() = 0;
+    // 等待所有文件完成或者取消，不能在回调中调用
+    virtual void Wait() = 0;
+  };
+  // 在 options.threads 个工作线程上并发提取，立即返回
+  static std::unique_ptr<Batch> ExtractVideoInfoBatch(
+      const std::vector<std::string>& paths, const CaptureOptions& options,
+      BatchCallback callback);
 };